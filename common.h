@@ -11,6 +11,8 @@
 
 // buffer limits
 #define MAXNAMELEN 256
+#define PKT_HEADER_LEN 5
+#define MUX_HEADER_LEN 9
 #define MAXPKTLEN  2048
 #define MAXMSGLEN  1024
 
@@ -24,6 +26,25 @@
 #define EMAIL_MSG_TO_CLIENT 3
 #define CLOSE_CON 4
 #define SERVER_ERROR 5
+#define URGENT_MSG_TO_SERVER 6
+#define PING 7
+#define PONG 8
+#define PEER_HELLO 9
+#define RELAY_BATCH 10
+#define RELAY_ACK 11
+#define MUX_HELLO 12
+#define SHM_HELLO 13
+#define MAIL_BATCH 14
+#define MAIL_STATUS 15
+#define MAIL_ACK 16
+#define MAIL_FETCH 17
+
+// states of a mail reported by MAIL_STATUS
+#define MAIL_UNKNOWN   0    // never queued here, or forgotten since
+#define MAIL_QUEUED    1    // waiting for its recipient or a peer server
+#define MAIL_DELIVERED 2    // handed to its recipient or a peer server
+#define MAIL_EXPIRED   3    // dropped from the queue without delivery
+#define MAIL_QUARANTINED 4  // held back by the content filter
 
 // structure of a packet
 typedef struct _packet {
@@ -39,9 +60,13 @@ typedef struct _packet {
 
 } Packet;
 
-extern int startserver();
+extern uint32_t maxpktlen;
+
+extern int startserver(char *addr, ushort port, int backlog, int deferaccept);
+extern int startlocal(char *path, int type, mode_t mode, int backlog);
 extern Packet *recvpkt(int sd);
 extern int sendpkt(int sd, uint8_t typ, uint32_t len, char *buf);
 extern void freepkt(Packet *msg);
+extern uint64_t nowusec();
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,439 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailadmin.c
+// Description: This file contains methods to inspect the server's members
+//				and pending mail over a unix-domain admin socket.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include "common.h"
+#include "mailserver.h"
+#include "maillog.h"
+
+// An admin connection is a member which speaks lines of text instead of
+// packets. Each command opens a query on one of the server's indexes: the
+// list of all members, the list of all mails by age, a recipient's
+// mailbox, or the mails charged to a sender ip-address. Mails to every
+// user at an ip-address, and mails from a sender name on any ip-address,
+// have no index of their own: the quotas charge by the connection's
+// ip-address and mailboxes are by user. Those queries walk the list by
+// age, or the index of another part of the query, and skip the mails which
+// do not match, which still only costs a slice per pass of the event loop.
+//
+// The query keeps a cursor on its next row and answers a page at a time;
+// 'more' continues from the cursor. Rows are produced by adminwork() on
+// each pass of the event loop, at most ADMIN_SLICE of them and only while
+// the connection's output is below OUTBUF_HIGHWATER, so a page over
+// millions of mails is streamed without holding up anyone else. When the
+// row under a cursor leaves its index the cursor moves on to the next one.
+//
+// Commands:
+//   members [limit <n>]
+//   mails [to <name>@<ip> | to <ip> | from <ip> | sender <name>]
+//         [older <seconds>] [limit <n>]
+//   more
+//   help
+//   quit
+
+// Global Variables
+Admin * adminlist = NULL;
+
+static char helptext[] =
+	"members [limit <n>]\n"
+	"mails [to <name>@<ip> | to <ip> | from <ip> | sender <name>]\n"
+	"      [older <seconds>] [limit <n>]\n"
+	"more\n"
+	"help\n"
+	"quit\n"
+	"end\n";
+
+// creates the listening admin socket at the given path. returns the
+// socket, or -1 on failure.
+int startadmin(char *path) {
+	return (startlocal(path, SOCK_STREAM, S_IRUSR | S_IWUSR, ADMIN_BACKLOG));
+}
+
+// accepts every pending admin connection.
+int acceptadmins(int adminsock) {
+	Member *memb;
+	Admin *admin;
+	int csd, accepted = 0;
+
+	while ((csd = accept4(adminsock, NULL, NULL,
+					SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		if (!watchsock(csd, EPOLLIN)) {
+			MAILLOG("epoll_ctl: %s\n", strerror(errno));
+			close(csd);
+			continue;
+		}
+
+		admin = (Admin *) calloc(1, sizeof(Admin));
+		if (!admin) {
+			fprintf(stderr, "error : unable to calloc admin\n");
+			exit(0);
+		}
+		memb = addmember(csd, "local");
+		memb->events = EPOLLIN;
+		memb->admin = admin;
+		admin->memb = memb;
+		admin->next = adminlist;
+		if (adminlist)
+			adminlist->prev = admin;
+		adminlist = admin;
+		accepted++;
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		MAILLOG("accept: %s\n", strerror(errno));
+	return (accepted);
+}
+
+// frees the query state of an admin connection which is going away.
+void freeadmin(Member *memb) {
+	Admin *admin = memb->admin;
+
+	if (!admin)
+		return;
+	if (admin->next)
+		admin->next->prev = admin->prev;
+	if (admin->prev)
+		admin->prev->next = admin->next;
+	else
+		adminlist = admin->next;
+	memb->admin = NULL;
+	free(admin);
+}
+
+// returns the mail after the given one in the index the query walks.
+static Mail *nextmail(Admin *admin, Mail *mail) {
+	switch (admin->index) {
+		case ADMIN_BY_AGE:
+			return (mail->anext);
+		case ADMIN_BY_SENDER:
+			return (mail->snext);
+		case ADMIN_BY_RCPT:
+			// urgent mail is listed before the normal mail of the mailbox
+			if (mail->next)
+				return (mail->next);
+			return (mail->urgent ? mail->mbox->head : NULL);
+	}
+	return (NULL);
+}
+
+// moves the cursors resting on a mail which is leaving the given index to
+// the next mail.
+void adminunlinkmail(Mail *mail, int index) {
+	Admin *admin;
+
+	for (admin = adminlist; admin; admin = admin->next) {
+		if (admin->index == index && admin->pos == mail)
+			admin->pos = nextmail(admin, mail);
+	}
+}
+
+// moves the cursors resting on a member which is going away to the next
+// member.
+void adminunlinkmember(Member *memb) {
+	Admin *admin;
+
+	for (admin = adminlist; admin; admin = admin->next) {
+		if (admin->index == ADMIN_MEMBERS && admin->mpos == memb)
+			admin->mpos = memb->next;
+	}
+}
+
+// sends a line of text to the admin connection.
+static void adminprint(Member *memb, const char *fmt, ...) {
+	char line[MAXPKTLEN];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (len >= (int) sizeof(line)) {
+		len = sizeof(line) - 1;
+		line[len - 1] = '\n';
+	}
+	queuetext(memb, line, len);
+}
+
+// sends one row of a members query.
+static void printmember(Member *to, Member *memb) {
+	adminprint(to, "member sock=%d name=%s ip=%s queued=%d pending=%zu kind=%s\n",
+			memb->sock, memb->name ? memb->name : "-", memb->ipaddr,
+			memb->mbox ? memb->mbox->count : 0, outpending(memb),
+			memb->admin ? "admin" : memb->mux ? "session" : memb->peer ? "peer" :
+			memb->relay ? "relay" : "client");
+}
+
+// sends one row of a mails query.
+static void printmail(Member *to, Mail *mail, uint64_t now) {
+	adminprint(to, "mail id=%llu age=%llu from=%s@%s to=%s@%s size=%u%s%s\n",
+			(unsigned long long) mail->mailid, (unsigned long long) ((now - mail->queuedat) / 1000000),
+			mail->sendername ? mail->sendername : "unknown",
+			mail->senderip ? mail->senderip : "unknown",
+			mail->name, mail->ipaddr, mail->size,
+			mail->urgent ? " urgent" : "", mail->mbox ? "" : " relay");
+}
+
+// returns 1 if the mail is one the query asks for beyond its index.
+static int adminmatch(Admin *admin, Mail *mail) {
+	if (admin->rcptip[0] && strcmp(mail->ipaddr, admin->rcptip) != 0)
+		return (0);
+	if (admin->sendername[0] && (mail->sendername == NULL ||
+				strcmp(mail->sendername, admin->sendername) != 0))
+		return (0);
+	return (1);
+}
+
+// sends rows of the open query until the page is full, the slice is used
+// up or the connection's output is full. ends the page when it is full or
+// the query has no more rows.
+static void pageadmin(Admin *admin) {
+	Member *memb = admin->memb;
+	uint64_t now = nowusec();
+	int visits;
+
+	for (visits = 0; visits < ADMIN_SLICE; visits++) {
+		if (outpending(memb) >= OUTBUF_HIGHWATER)
+			return;
+		if (admin->limit > 0 && admin->left == 0)
+			break;
+
+		if (admin->index == ADMIN_MEMBERS) {
+			if (admin->mpos == NULL)
+				break;
+			printmember(memb, admin->mpos);
+			admin->mpos = admin->mpos->next;
+			admin->left--;
+			continue;
+		}
+
+		if (admin->pos == NULL)
+			break;
+
+		// the age and sender indexes are oldest first, so the first mail
+		// too young ends the query. a mailbox lists its urgent mail first,
+		// so there the young mails are only skipped.
+		if (admin->olderthan && now - admin->pos->queuedat < admin->olderthan) {
+			if (admin->index != ADMIN_BY_RCPT) {
+				admin->pos = NULL;
+				break;
+			}
+			admin->pos = nextmail(admin, admin->pos);
+			continue;
+		}
+		if (!adminmatch(admin, admin->pos)) {
+			admin->pos = nextmail(admin, admin->pos);
+			continue;
+		}
+		printmail(memb, admin->pos, now);
+		admin->pos = nextmail(admin, admin->pos);
+		admin->left--;
+	}
+	if (visits == ADMIN_SLICE)
+		return;
+
+	// the page is done
+	admin->paging = 0;
+	if (admin->pos || admin->mpos) {
+		adminprint(memb, "more\n");
+	} else {
+		admin->index = 0;
+		adminprint(memb, "end\n");
+	}
+}
+
+// starts a page of the open query.
+static void startpage(Admin *admin) {
+	admin->left = admin->limit;
+	admin->paging = 1;
+	pageadmin(admin);
+}
+
+// runs one command of an admin connection. returns 0 if the connection
+// is closing.
+static int admincommand(Admin *admin, char *line) {
+	Member *memb = admin->memb;
+	char *save, *word, *arg, *at;
+	uint64_t val;
+	Mailbox *mbox;
+	Sender *sender;
+
+	word = strtok_r(line, " \t\r", &save);
+	if (word == NULL)
+		return (1);
+
+	if (strcmp(word, "quit") == 0) {
+		lingermember(memb);
+		return (0);
+	}
+	if (strcmp(word, "help") == 0) {
+		queuetext(memb, helptext, strlen(helptext));
+		return (1);
+	}
+	if (strcmp(word, "more") == 0) {
+		if (admin->index == 0) {
+			adminprint(memb, "error: no query to continue.\n");
+			return (1);
+		}
+		startpage(admin);
+		return (1);
+	}
+	if (strcmp(word, "members") != 0 && strcmp(word, "mails") != 0) {
+		adminprint(memb, "error: unknown command %s, try help.\n", word);
+		return (1);
+	}
+
+	// a new query replaces the open one
+	admin->index = strcmp(word, "members") == 0 ? ADMIN_MEMBERS : ADMIN_BY_AGE;
+	admin->pos = NULL;
+	admin->mpos = NULL;
+	admin->olderthan = 0;
+	admin->rcptip[0] = '\0';
+	admin->sendername[0] = '\0';
+	admin->limit = ADMIN_PAGE;
+	mbox = NULL;
+	sender = NULL;
+
+	while ((word = strtok_r(NULL, " \t\r", &save)) != NULL) {
+		arg = strtok_r(NULL, " \t\r", &save);
+		if (arg == NULL)
+			goto bad;
+		if (strcmp(word, "limit") == 0) {
+			if (!parsenumber(arg, &val) || val > INT32_MAX)
+				goto bad;
+			admin->limit = val;
+		} else if (admin->index == ADMIN_MEMBERS) {
+			goto bad;
+		} else if (strcmp(word, "older") == 0) {
+			if (!parsenumber(arg, &val) || val > UINT32_MAX)
+				goto bad;
+			admin->olderthan = val * 1000000;
+		} else if (strcmp(word, "to") == 0 && admin->index == ADMIN_BY_AGE &&
+				!admin->rcptip[0] && (at = strchr(arg, '@')) != NULL) {
+			*at = '\0';
+			admin->index = ADMIN_BY_RCPT;
+			mbox = findmailbox(arg, at + 1);
+		} else if (strcmp(word, "to") == 0 && admin->index != ADMIN_BY_RCPT &&
+				!admin->rcptip[0] && strlen(arg) < sizeof(admin->rcptip)) {
+			strcpy(admin->rcptip, arg);
+		} else if (strcmp(word, "sender") == 0 && !admin->sendername[0] &&
+				strlen(arg) < sizeof(admin->sendername)) {
+			strcpy(admin->sendername, arg);
+		} else if (strcmp(word, "from") == 0 && admin->index == ADMIN_BY_AGE) {
+			admin->index = ADMIN_BY_SENDER;
+			sender = findsender(arg);
+		} else {
+			goto bad;
+		}
+	}
+
+	switch (admin->index) {
+		case ADMIN_MEMBERS:
+			admin->mpos = memblist;
+			break;
+		case ADMIN_BY_AGE:
+			admin->pos = mailagehead;
+			break;
+		case ADMIN_BY_RCPT:
+			if (mbox)
+				admin->pos = mbox->urgenthead ? mbox->urgenthead : mbox->head;
+			break;
+		case ADMIN_BY_SENDER:
+			if (sender)
+				admin->pos = sender->head;
+			break;
+	}
+	startpage(admin);
+	return (1);
+
+bad:
+	admin->index = 0;
+	adminprint(memb, "error: bad arguments, try help.\n");
+	return (1);
+}
+
+// runs every complete command line in the given bytes, stopping while a
+// page is being sent. returns the number of bytes used, or -1 if the
+// member is gone.
+ssize_t parseadmin(Member *memb, char *data, size_t len) {
+	Admin *admin = memb->admin;
+	char line[ADMIN_INPUT_MAX];
+	size_t used = 0, n;
+	char *nl;
+
+	while (used < len && !admin->paging && !memb->closing) {
+		nl = memchr(data + used, '\n', len - used);
+		if (nl == NULL)
+			break;
+		n = nl - (data + used);
+		if (n >= sizeof(line))
+			n = sizeof(line) - 1;
+		memcpy(line, data + used, n);
+		line[n] = '\0';
+		used = nl - data + 1;
+		if (!admincommand(admin, line))
+			return (len);
+	}
+
+	// an admin which does not wait for its answers is cut off
+	if (len - used > ADMIN_INPUT_MAX) {
+		adminprint(memb, "error: too many commands waiting.\n");
+		lingermember(memb);
+		return (len);
+	}
+	return (used);
+}
+
+// sends the next rows of every admin connection with a page open, and
+// runs the commands that waited for the page to end.
+void adminwork() {
+	Admin *admin, *next;
+	Member *memb;
+	ssize_t used;
+
+	for (admin = adminlist; admin; admin = next) {
+		next = admin->next;
+		memb = admin->memb;
+		if (!admin->paging || memb->closing)
+			continue;
+		pageadmin(admin);
+		if (admin->paging || memb->inlen == 0)
+			continue;
+		used = parseadmin(memb, memb->inbuf, memb->inlen);
+		dropinput(memb, used);
+	}
+}
+
+// returns 0 if an admin page can make progress right away, or -1 if
+// there is nothing to do until a socket is ready.
+int admintimeout() {
+	Admin *admin;
+
+	for (admin = adminlist; admin; admin = admin->next) {
+		if (admin->paging && !admin->memb->closing &&
+				outpending(admin->memb) < OUTBUF_HIGHWATER)
+			return (0);
+	}
+	return (-1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
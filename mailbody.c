@@ -0,0 +1,240 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailbody.c
+// Description: This file contains methods to share the texts of queued
+//				emails which are identical.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "common.h"
+#include "mailserver.h"
+
+// The message and the frame of every queued mail are kept in a table
+// keyed by their content. A text already in the table is not copied again
+// but gets another reference, so the same notification sent to many users,
+// however it was submitted, is stored once. A text is freed with its last
+// reference. The table chains entries by a 64-bit hash of the text taken
+// eight bytes at a time, and doubles when it holds more texts than
+// buckets. Only the event loop thread may use it.
+//
+// A text knows the mails holding it, and the first of them is the one
+// charged for it. When that mail goes while others still hold the text,
+// the next one in line takes over the charge, so a text stays paid for as
+// long as it is stored. Messages and frames are kept apart, each mail
+// being linked into the holders of its message and of its frame.
+
+// a text shared by the mails referring to it
+typedef struct _body {
+
+	// next text in the same bucket, and the hash of this one
+	struct _body * hnext;
+	uint64_t hash;
+
+	// mails referring to the text, and its length with the '\0'
+	uint32_t refs;
+	uint32_t len;
+
+	// set for a frame, and the mails holding the text, the first of which
+	// is charged for it
+	int frame;
+	Mail * holders;
+
+	char text[];
+
+} Body;
+
+// Global Variables
+Body ** bodytab = NULL;
+uint64_t bodybuckets = 0;
+uint64_t bodycount = 0;
+
+// texts looked up and found, and bytes stored and referred to
+uint64_t bodylookups = 0;
+uint64_t bodyhits = 0;
+uint64_t bodybytes = 0;
+uint64_t bodyrefbytes = 0;
+
+// hashes the bytes eight at a time, mixing each word in with a multiply.
+// frames hash apart from messages.
+static uint64_t hashbody(const char *text, size_t len, int frame) {
+	uint64_t hash = (0x9e3779b97f4a7c15ull + frame) ^ len, word;
+
+	for (; len >= sizeof(word); text += sizeof(word), len -= sizeof(word)) {
+		memcpy(&word, text, sizeof(word));
+		hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+		hash ^= hash >> 32;
+	}
+	word = 0;
+	memcpy(&word, text, len);
+	hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ull;
+	return (hash ^ (hash >> 29));
+}
+
+// doubles the buckets of the table, or makes the first ones.
+static void growbodies() {
+	uint64_t newbuckets = bodybuckets ? bodybuckets * 2 : BODY_BUCKETS;
+	Body **newtab, *body, *next;
+	uint64_t i;
+
+	newtab = (Body **) calloc(newbuckets, sizeof(Body *));
+	if (!newtab) {
+		fprintf(stderr, "error : unable to calloc body table\n");
+		exit(0);
+	}
+	for (i = 0; i < bodybuckets; i++) {
+		for (body = bodytab[i]; body; body = next) {
+			next = body->hnext;
+			body->hnext = newtab[body->hash & (newbuckets - 1)];
+			newtab[body->hash & (newbuckets - 1)] = body;
+		}
+	}
+	free(bodytab);
+	bodytab = newtab;
+	bodybuckets = newbuckets;
+}
+
+// returns the text with given hash in the table, NULL if it is not there.
+static Body *findbody(const char *text, size_t len, int frame, uint64_t hash) {
+	Body *body;
+
+	if (bodybuckets == 0)
+		return (NULL);
+	for (body = bodytab[hash & (bodybuckets - 1)]; body; body = body->hnext) {
+		if (body->hash == hash && body->len == len && body->frame == frame &&
+				memcmp(body->text, text, len) == 0)
+			return (body);
+	}
+	return (NULL);
+}
+
+// returns the links of a mail in the holders of its message or its frame.
+static Mail **holdnext(Mail *mail, int frame) {
+	return (frame ? &mail->framenext : &mail->msgnext);
+}
+
+static Mail **holdprev(Mail *mail, int frame) {
+	return (frame ? &mail->frameprev : &mail->msgprev);
+}
+
+// returns 1 if the len bytes of text are already kept as a message, or
+// as a frame if frame is set, for a queued mail.
+int sharedbody(const char *text, size_t len, int frame) {
+	return (findbody(text, len, frame, hashbody(text, len, frame)) != NULL);
+}
+
+// stores the len bytes of text, which end with a '\0', as the message of
+// the mail, or as its frame if frame is set, sharing the copy kept for
+// other mails. returns 1 if the text was not kept yet, and the mail is
+// the one charged for it.
+int keepbody(Mail *mail, int frame, const char *text, size_t len) {
+	uint64_t hash = hashbody(text, len, frame);
+	Body *body;
+
+	bodylookups++;
+	bodyrefbytes += len;
+	if (bodycount >= bodybuckets)
+		growbodies();
+	if ((body = findbody(text, len, frame, hash)) != NULL) {
+
+		// behind the first holder, which stays charged
+		*holdprev(mail, frame) = body->holders;
+		*holdnext(mail, frame) = *holdnext(body->holders, frame);
+		if (*holdnext(mail, frame))
+			*holdprev(*holdnext(mail, frame), frame) = mail;
+		*holdnext(body->holders, frame) = mail;
+		body->refs++;
+		bodyhits++;
+		if (frame)
+			mail->frame = body->text;
+		else
+			mail->message = body->text;
+		return (0);
+	}
+
+	body = (Body *) malloc(offsetof(Body, text) + len);
+	if (!body) {
+		fprintf(stderr, "error : unable to malloc body\n");
+		exit(0);
+	}
+	body->hash = hash;
+	body->refs = 1;
+	body->len = len;
+	body->frame = frame;
+	body->holders = mail;
+	*holdnext(mail, frame) = *holdprev(mail, frame) = NULL;
+	memcpy(body->text, text, len);
+	body->hnext = bodytab[hash & (bodybuckets - 1)];
+	bodytab[hash & (bodybuckets - 1)] = body;
+	bodycount++;
+	bodybytes += len;
+	if (frame)
+		mail->frame = body->text;
+	else
+		mail->message = body->text;
+	return (1);
+}
+
+// lets go of the mail's message, or its frame if frame is set, freeing the
+// text once no mail holds it. returns the mail which is charged for the
+// text from now on, in place of this one, or NULL.
+Mail *dropbody(Mail *mail, int frame) {
+	char *text = frame ? mail->frame : mail->message;
+	Mail *next, *prev;
+	Body *body, **link;
+
+	if (text == NULL)
+		return (NULL);
+	body = (Body *) (text - offsetof(Body, text));
+	bodyrefbytes -= body->len;
+	next = *holdnext(mail, frame);
+	prev = *holdprev(mail, frame);
+	if (next)
+		*holdprev(next, frame) = prev;
+	if (prev)
+		*holdnext(prev, frame) = next;
+	if (frame)
+		mail->frame = NULL;
+	else
+		mail->message = NULL;
+	if (body->holders == mail) {
+		body->holders = next;
+		if (--body->refs > 0)
+			return (next);
+	} else if (--body->refs > 0) {
+		return (NULL);
+	}
+
+	for (link = &bodytab[body->hash & (bodybuckets - 1)]; *link != body;
+			link = &(*link)->hnext)
+		;
+	*link = body->hnext;
+	bodycount--;
+	bodybytes -= body->len;
+	free(body);
+	return (NULL);
+}
+
+// displays how much sharing the texts saves.
+void listbodystats() {
+	printf("mail texts: %llu stored in %llu bytes, %llu bytes saved; "
+			"%llu of %llu lookups shared (%.1f%%)\n",
+			(unsigned long long) bodycount,
+			(unsigned long long) bodybytes,
+			(unsigned long long) (bodyrefbytes - bodybytes),
+			(unsigned long long) bodyhits,
+			(unsigned long long) bodylookups,
+			bodylookups ? bodyhits * 100.0 / bodylookups : 0.0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,224 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailcapture.c
+// Description: This file contains methods to record the traffic clients
+//				send to the server into a capture file.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <unistd.h>
+#include "common.h"
+#include "mailserver.h"
+#include "mailcapture.h"
+
+// The event loop copies each record into a ring of bytes and a capture
+// thread writes the ring to the file, the same way the log works: a single
+// producer and a single consumer, each publishing its index with a release
+// store, no locks. A record goes into the ring whole or, if the ring has
+// no room for it, is dropped and counted, so a slow disk never holds up
+// the server. Only the event loop thread may record.
+
+// Global Variables
+char capring[CAPTURE_RING_SIZE];
+
+// bytes put into the ring and bytes written out, on their own cache lines
+_Alignas(64) atomic_uint_fast64_t caphead = 0;
+_Alignas(64) atomic_uint_fast64_t captail = 0;
+
+// records taken and records lost to a full ring
+_Alignas(64) atomic_uint_fast64_t caprecords = 0;
+atomic_uint_fast64_t capdropped = 0;
+
+atomic_int capstopping = 0;
+pthread_t capthreadid;
+int capfd = -1;
+
+// id of the last connection recorded, and when the last record was taken
+uint32_t capconnid = 0;
+uint64_t caplast = 0;
+
+// writes the bytes to the capture file. gives up on errors other than
+// EINTR, the capture is lost then but the server goes on.
+static void writecapture(char *buf, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(capfd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+// writes the ring out as it fills. naps while it is empty, longer the
+// longer it stays empty.
+static void *capthread(void *arg) {
+	useconds_t nap = CAPTURE_IDLE_MIN_USEC;
+	uint64_t head, tail;
+	size_t off, first;
+	int stopping;
+
+	while (1) {
+		// read the flag first: once it is set every record is in the ring
+		stopping = atomic_load(&capstopping);
+		head = atomic_load_explicit(&caphead, memory_order_acquire);
+		tail = atomic_load_explicit(&captail, memory_order_relaxed);
+
+		if (head == tail) {
+			if (stopping)
+				break;
+			usleep(nap);
+			nap = nap * 2 > CAPTURE_IDLE_MAX_USEC ? CAPTURE_IDLE_MAX_USEC : nap * 2;
+			continue;
+		}
+
+		nap = CAPTURE_IDLE_MIN_USEC;
+		off = tail & (CAPTURE_RING_SIZE - 1);
+		first = CAPTURE_RING_SIZE - off < head - tail ?
+			CAPTURE_RING_SIZE - off : head - tail;
+		writecapture(capring + off, first);
+		writecapture(capring, head - tail - first);
+		atomic_store_explicit(&captail, head, memory_order_release);
+	}
+	return (NULL);
+}
+
+// copies bytes into the ring at the given position.
+static void putring(uint64_t pos, const char *buf, size_t len) {
+	size_t off = pos & (CAPTURE_RING_SIZE - 1);
+	size_t first = CAPTURE_RING_SIZE - off < len ? CAPTURE_RING_SIZE - off : len;
+
+	memcpy(capring + off, buf, first);
+	memcpy(capring, buf + first, len - first);
+}
+
+// records an event of the connection. dropped if the ring is full.
+static void record(uint32_t connid, uint32_t session, uint8_t typ,
+		const char *text, uint32_t len) {
+	char hdr[CAPTURE_RECORD_LEN];
+	uint64_t head, tail, now, delta;
+	uint32_t val;
+
+	head = atomic_load_explicit(&caphead, memory_order_relaxed);
+	tail = atomic_load_explicit(&captail, memory_order_acquire);
+	if (CAPTURE_RING_SIZE - (head - tail) < CAPTURE_RECORD_LEN + (uint64_t) len) {
+		atomic_fetch_add_explicit(&capdropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	now = nowusec();
+	delta = now - caplast;
+	caplast = now;
+
+	val = htonl(delta > UINT32_MAX ? UINT32_MAX : delta);
+	memcpy(hdr, &val, sizeof(val));
+	val = htonl(connid);
+	memcpy(hdr + 4, &val, sizeof(val));
+	val = htonl(session);
+	memcpy(hdr + 8, &val, sizeof(val));
+	hdr[12] = typ;
+	val = htonl(len);
+	memcpy(hdr + 13, &val, sizeof(val));
+
+	putring(head, hdr, sizeof(hdr));
+	if (len > 0)
+		putring(head + sizeof(hdr), text, len);
+	atomic_store_explicit(&caphead, head + sizeof(hdr) + len,
+			memory_order_release);
+	atomic_fetch_add_explicit(&caprecords, 1, memory_order_relaxed);
+}
+
+// starts recording into the file at the given path, which is replaced.
+// returns 0 if the file cannot be written.
+int startcapture(char *path) {
+	char hdr[CAPTURE_HEADER_LEN];
+	struct timespec ts;
+	uint64_t start;
+
+	capfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (capfd == -1) {
+		perror("open");
+		return (0);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	start = htobe64((uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+	memcpy(hdr, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+	memcpy(hdr + CAPTURE_MAGIC_LEN, &start, sizeof(start));
+	writecapture(hdr, sizeof(hdr));
+	caplast = nowusec();
+
+	if (pthread_create(&capthreadid, NULL, capthread, NULL) != 0) {
+		fprintf(stderr, "error : unable to start capture thread\n");
+		exit(0);
+	}
+	atexit(stopcapture);
+	return (1);
+}
+
+// writes out every record taken so far and closes the capture.
+void stopcapture() {
+	if (capfd == -1)
+		return;
+	atomic_store(&capstopping, 1);
+	pthread_join(capthreadid, NULL);
+	close(capfd);
+	capfd = -1;
+}
+
+// gives a new client connection its id and records it, if capturing.
+void captureopen(Member *memb) {
+	if (capfd == -1)
+		return;
+	memb->connid = ++capconnid;
+	record(memb->connid, 0, CAPTURE_OPEN, memb->ipaddr, strlen(memb->ipaddr));
+}
+
+// records that the client connection went away.
+void captureclose(Member *memb) {
+	if (memb->connid == 0 || capfd == -1)
+		return;
+	record(memb->connid, 0, CAPTURE_CLOSE, NULL, 0);
+	memb->connid = 0;
+}
+
+// records a frame the client connection sent.
+void captureframe(Member *memb, uint32_t session, uint8_t typ, char *text,
+		uint32_t len) {
+	if (capfd == -1)
+		return;
+	record(memb->connid, session, typ, text, len);
+}
+
+// displays the counters of the capture.
+void listcapture() {
+	if (capfd == -1)
+		return;
+	printf("capture records: %llu taken, %llu dropped, %llu bytes written\n",
+			(unsigned long long) atomic_load(&caprecords),
+			(unsigned long long) atomic_load(&capdropped),
+			(unsigned long long) (atomic_load(&captail) + CAPTURE_HEADER_LEN));
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,41 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailcapture.h
+// Description: This file contains the format of the traffic captures
+//				written by the server and replayed by mailreplay.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// A capture starts with CAPTURE_MAGIC and the wall clock time it was
+// started at, in microseconds, and goes on with one record per event. A
+// record is CAPTURE_RECORD_LEN bytes of header followed by its text:
+//
+//   microseconds since the previous record     4 bytes
+//   connection id                              4 bytes
+//   session id, 0 unless multiplexed           4 bytes
+//   packet type, or CAPTURE_OPEN/CLOSE         1 byte
+//   length of the text                         4 bytes
+//
+// All numbers are in network byte order. Every frame a client sends is
+// recorded as it was received, with its type and text. A connection's
+// first record is CAPTURE_OPEN with its ip-address as text, its last one
+// CAPTURE_CLOSE. Connection ids are never reused within a capture.
+
+#define CAPTURE_MAGIC       "MAILCAP1"
+#define CAPTURE_MAGIC_LEN   8
+#define CAPTURE_HEADER_LEN  (CAPTURE_MAGIC_LEN + 8)
+#define CAPTURE_RECORD_LEN  17
+
+// record types which are not packets
+#define CAPTURE_OPEN        0xf0        // a client connected
+#define CAPTURE_CLOSE       0xf1        // a client went away
+
+// writer thread of the server
+#define CAPTURE_RING_SIZE   (8 << 20)   // bytes buffered, a power of two
+#define CAPTURE_IDLE_MIN_USEC 1000      // writer naps between checks of
+#define CAPTURE_IDLE_MAX_USEC 50000     // an empty ring
+
+///////////////////////////////////////////////////////////////////////////////
@@ -12,198 +12,191 @@
 // Include files.
 
 #include <stdio.h>
-#include <fcntl.h>
 #include <string.h>
 #include <sys/types.h>
-#include <sys/socket.h>
+#include <sys/select.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <netdb.h>
-#include <time.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <errno.h>
+#include <unistd.h>
 #include "common.h"
+#include "maillib.h"
 
-extern int hooktoserver(char *user, char *servhost, ushort servport);
+// The connection to the server is the client library's, see maillib.h;
+// this is only its front end on the terminal.
 
-main(int argc, char *argv[]) {
-	setbuf(stdout, NULL);
-	int sock;
+// set once the server greeted us, until then a lost connection is fatal
+int welcomed = 0;
 
-	// check usage
-	if (argc != 4) {
-		fprintf(stderr, "usage : %s <username> <server_ip_address> <5945>\n", argv[0]);
-		exit(1);
+// names of the states of a mail reported by MAIL_STATUS
+char *states[] = { "unknown", "queued", "delivered", "expired", "quarantined" };
+
+// displays an email received.
+void onmail(MailClient *mc, uint64_t mailid, char *text, void *arg) {
+	printf("New email received !\n>> %s\n", text);
+}
+
+// displays the id of an email we sent, or the answer to 'status <id>'.
+void ondone(MailClient *mc, uint64_t mailid, int state, char *error, void *arg) {
+	if (state == MC_REFUSED || state == MC_LOST) {
+		printf(">> %s\n", error);
+		return;
 	}
+	printf(">> mail %llu %s.\n", (unsigned long long) mailid,
+			state <= MAIL_QUARANTINED ? states[state] : "unknown");
+}
 
-	// get hooked on to the server
-	sock = hooktoserver(argv[1], argv[2], atoi(argv[3]));
+// displays what happens to the connection.
+void onevent(MailClient *mc, int event, char *text, void *arg) {
+	switch (event) {
+		case MC_WELCOME:
+			welcomed = 1;
+			printf(">> %s\n", text);
+			break;
+		case MC_ERROR:
+			printf(">> %s\n", text);
+			break;
+		case MC_DOWN:
+			if (!welcomed) {
+				fprintf(stderr, "connecting: %s\n", text);
+				exit(1);
+			}
+			fprintf(stderr, "Server closed the connection (%s), reconnecting.\n", text);
+			break;
+		case MC_CLOSED:
+			exit(0);
+	}
+}
 
-	if (sock == -1)
-		exit(1);
+// runs a line typed by the user.
+void runline(MailClient *mc, char *msg) {
+	unsigned long long mailid;
+	struct in_addr in;
+	char *sp, *at;
+	int urgent = 0;
 
-	fflush(stdout);
+	if (strncmp(msg, QUIT_STRING, strlen(QUIT_STRING)) == 0) {
+		mcclose(mc);
+		return;
+	}
 
-	// Initialize FDs to zero.
-	// Assign Input FD to client Fds.
-	// Assign socked FD to client Fds.
+	// 'status <id>' asks what became of an email we sent.
+	if (sscanf(msg, "status %llu", &mailid) == 1) {
+		mcstatus(mc, mailid, ondone, NULL);
+		return;
+	}
 
-	fd_set clientfds, tempfds;
-	FD_ZERO(&clientfds);
-	FD_ZERO(&tempfds);
-	FD_SET(sock, &clientfds);
-	FD_SET(0, &clientfds);
+	// a leading '!' marks the email as urgent.
+	if (msg[0] == '!') {
+		urgent = 1;
+		msg++;
+	}
 
-	while (1) {
+	// <recp_user>@<ip_addr> <mesg>, it is okay to have an empty body
+	sp = strchr(msg, ' ');
+	at = strchr(msg, '@');
+	if (sp == NULL || at == NULL) {
+		fprintf(stderr,
+				"error: invalid e-mail format.\nsyntax: <recp_user>@<ip_addr> <mesg>\n");
+		return;
+	}
+	if (sp < at) {
+		fprintf(stderr, "error: user name cannot contain spaces.\n");
+		fprintf(stderr,
+				"error: invalid e-mail format.\nsyntax: <recp_user>@<ip_addr> <mesg>\n");
+		return;
+	}
+	if (at == msg) {
+		fprintf(stderr, "error: no username entered.\n");
+		return;
+	}
+	*sp = '\0';
+	if (inet_pton(AF_INET, at + 1, &in) != 1) {
+		fprintf(stderr,
+				"error: invalid ip-address format.\nsyntax: <recp_user>@<ip_addr> <mesg>\n");
+		return;
+	}
+	if (strlen(sp + 1) > 80) {
+		fprintf(stderr, "error: mail message length can be atmost 80 characters.\n");
+		return;
+	}
+	if (!mcsubmit(mc, msg, sp + 1, urgent, ondone, NULL)) {
+		fprintf(stderr,
+				"error: invalid e-mail format.\nsyntax: <recp_user>@<ip_addr> <mesg>\n");
+	}
+}
 
-		// Use tempfds as it will be overwritten on select call
-		// We want clientfds to keep track of all connected fds.
+// runs the lines typed by the user. only what is already there is read,
+// and a partial line waits for the rest.
+void readlines(MailClient *mc) {
+	static char intxt[MAXMSGLEN];
+	static size_t inlen = 0;
+	char *line, *nl;
+	ssize_t n;
+
+	n = read(0, intxt + inlen, sizeof(intxt) - inlen - 1);
+	if (n == 0)
+		exit(0);
+	if (n < 0)
+		return;
+	inlen += n;
+	intxt[inlen] = '\0';
+
+	for (line = intxt; (nl = strchr(line, '\n')) != NULL; line = nl + 1) {
+		*nl = '\0';
+		runline(mc, line);
+	}
+	inlen -= line - intxt;
+	memmove(intxt, line, inlen);
+
+	// forget a line too long to be an email
+	if (inlen == sizeof(intxt) - 1)
+		inlen = 0;
+}
 
-		tempfds = clientfds;
+main(int argc, char *argv[]) {
+	setbuf(stdout, NULL);
+	MailClient *mc;
+	fd_set fds;
+	struct timeval tv;
+	int timeout, ok;
+
+	// check usage. a server on this host may be reached on its unix
+	// socket, and from there through shared memory.
+	mc = argc >= 3 ? mcnew(argv[1], onmail, onevent, NULL) : NULL;
+	if (argc == 3 && argv[2][0] == '/') {
+		ok = mcconnectlocal(mc, argv[2], 0);
+	} else if (argc == 4 && argv[2][0] == '/' && strcmp(argv[3], "shm") == 0) {
+		ok = mcconnectlocal(mc, argv[2], 1);
+	} else if (argc == 4) {
+		ok = mcconnect(mc, argv[2], atoi(argv[3]));
+	} else {
+		fprintf(stderr, "usage : %s <username> <server_ip_address> <5945>\n", argv[0]);
+		fprintf(stderr, "        %s <username> </path/to/unix/socket> [shm]\n", argv[0]);
+		exit(1);
+	}
+	if (!ok) {
+		fprintf(stderr, "error: invalid server address %s.\n", argv[2]);
+		exit(1);
+	}
 
-		if (select(FD_SETSIZE, &tempfds, NULL, NULL, NULL) == -1) {
+	// wait for the server and the user at once
+	while (1) {
+		FD_ZERO(&fds);
+		FD_SET(0, &fds);
+		FD_SET(mcfd(mc), &fds);
+		timeout = mctimeout(mc);
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		if (select(mcfd(mc) + 1, &fds, NULL, NULL, timeout >= 0 ? &tv : NULL) == -1) {
 			perror("select");
 			exit(4);
 		}
 
-		// For every fd in the list, if the fd is set, check if
-		// that is socket fd. If so, then it means that it we
-		// received some message from server. It can be a message
-		// from different client or server death. Also if the fd
-		// is 0, it means there is some input from the user.
-		// Read that input and send it to the server.
-
-		int fd;
-		for (fd = 0; fd < FD_SETSIZE; fd++) {
-			if (FD_ISSET(fd,&tempfds)) {
-				if (fd == sock) {
-					Packet *pkt;
-					pkt = recvpkt(sock);
-					if (!pkt) {
-
-						// server killed, exit
-						fprintf(stderr, "Server closed the connection.\n");
-						exit(1);
-					}
-
-					// display the text
-					if (pkt->type == EMAIL_MSG_TO_CLIENT) {
-						printf("New email received !\n>> %s\n", pkt->text);
-					}else if(pkt->type == WELCOME_MSG){
-
-						// Received welcome message. Print it.
-						printf(">> %s\n", pkt->text);
-
-						// Send username to client.
-						char msg[MAXMSGLEN];
-						strcpy(msg, argv[1]);
-
-						// fprintf(stderr, "user: %s", msg);
-						sendpkt(sock, USER_NAME, strlen(msg) + 1, msg);
-
-					}else if(pkt->type == SERVER_ERROR) {
-
-						printf(">> %s\n", pkt->text);
-					}
-					else{
-						fprintf(stderr, "error: unexpected reply from server\n");
-						exit(1);
-					}
-
-					// free the message
-					freepkt(pkt);
-				}
-
-				if (fd == 0) {
-					char msg[MAXMSGLEN];
-
-					if (!fgets(msg, MAXMSGLEN, stdin))
-						exit(0);
-
-					if (strncmp(msg, QUIT_STRING, strlen(QUIT_STRING)) == 0) {
-						sendpkt(sock, CLOSE_CON, 0, NULL);
-						break;
-					}
-
-					char * pch1, *pch2, *user, *ipaddr;
-					pch1 = strstr(msg, " ");
-					pch2 = strstr(msg, "@");
-
-					if (pch1 == NULL || pch2 == NULL) {
-						fprintf(stderr,
-								"error: invalid e-mail format.\nsyntax: <recp_user>@<ip_addr> <mesg>\n");
-						break;
-					}
-
-					if (pch1 < pch2)
-					{
-						fprintf(stderr, "error: user name cannot contain spaces.\n");
-						fprintf(stderr,
-								"error: invalid e-mail format.\nsyntax: <recp_user>@<ip_addr> <mesg>\n");
-						break;
-					}
-
-					user = (char *) malloc((strlen(msg) - strlen(pch2) + 1)*sizeof(char));
-					strncpy(user, msg, (strlen(msg) - strlen(pch2))*sizeof(char));
-					user[strlen(msg) - strlen(pch2)] = '\0';
-
-					// fprintf(stderr, "client: user: %s", user);
-
-					if(strcmp(user,"") == 0)
-					{
-						fprintf(stderr, "error: no username entered.\n");
-						free(user);
-						break;
-					}
-
-					ipaddr = (char *) malloc(
-							(strlen(pch2) - strlen(pch1))* sizeof(char));
-					strncpy(ipaddr, msg + strlen(user) + 1,
-							(strlen(pch2) - strlen(pch1) - 1) * sizeof(char));
-					ipaddr[strlen(pch2) - strlen(pch1) - 1] = '\0';
-
-					// fprintf(stderr, "server: ip: %s", ipaddr);
-
-					struct sockaddr_in sa;
-					int result = inet_pton(AF_INET, ipaddr, &(sa.sin_addr));
-					if(result == 0){
-						fprintf(stderr,
-								"error: invalid ip-address format.\nsyntax: <recp_user>@<ip_addr> <mesg>\n");
-						free(user);
-						free(ipaddr);
-						break;
-					}
-
-					char * mailmsg;
-					mailmsg = (char *) malloc(strlen(pch1) * sizeof(char));
-					strncpy(mailmsg,
-							msg + strlen(user) + strlen(ipaddr) + 2,
-							(strlen(pch1) - 1) * sizeof(char));
-					mailmsg[strlen(pch1)-1] = '\0';
-
-					// It is okay to have empty body in the email message.
-
-					if(strlen(mailmsg) > 80)
-					{
-						fprintf(stderr, "error: mail message length can be atmost 80 characters.\n");
-						free(user);
-						free(ipaddr);
-						free(mailmsg);
-						break;
-					}
-
-					// fprintf(stderr, "server: mailmsg: %s", mailmsg);
-
-					free(user);
-					free(ipaddr);
-					free(mailmsg);
-
-					msg[strlen(msg) - 1] = '\0';
-					sendpkt(sock, EMAIL_MSG_TO_SERVER, strlen(msg) + 1, msg);
-
-				}
-			}
-		}
+		if (FD_ISSET(0, &fds))
+			readlines(mc);
+		mchandle(mc);
 	}
 }
 
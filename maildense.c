@@ -0,0 +1,233 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: maildense.c
+// Description: This file contains methods to hold many idle connections
+//				in little memory.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "common.h"
+#include "mailserver.h"
+#include "maillog.h"
+
+// Most clients only wait for mail, and in dense mode an idle one costs its
+// member, its mailbox and its socket but no buffers. A member takes an
+// input or output buffer when it has something to keep in it, and gives
+// the buffer back once it is empty again: a member's output once it is
+// written, its input once the packets in it were handled. Buffers of the
+// first size are kept in a pool for the next member, so a busy server
+// does not go to malloc for them; buffers which grew are freed.
+//
+// The kernel holds the buffers of a socket on demand too, but only up to
+// their sizes, and a client which does not read may pin a lot of mail in
+// its send buffer. Client sockets get a small send buffer, which the
+// kernel doubles and which holds the largest packet. It is widened once a
+// member's output does not fit, and shrunk again by narrowidle() once the
+// member was quiet for a while. The receive buffer is left alone: the
+// server reads everything as it comes, so it holds nothing while the
+// client is idle, and a receive buffer shrunk on an open connection
+// shrinks its window for good, even once it is widened again.
+//
+// The descriptor limit is raised as far as it goes, since every client
+// takes one.
+
+// free buffers of one size
+typedef struct _bufpool {
+	char ** bufs;
+	int count;
+	size_t size;
+} BufPool;
+
+// Global Variables
+BufPool inpool = { NULL, 0, INBUF_INITIAL };
+BufPool outpool = { NULL, 0, OUTBUF_INITIAL };
+
+// buffers taken from a pool and taken from malloc
+uint64_t pooltaken = 0;
+uint64_t poolmissed = 0;
+
+// members whose send buffers are widened, and when to look at them next
+Member ** widened = NULL;
+int nwidened = 0;
+int capwidened = 0;
+uint64_t nextnarrow = 0;
+
+// raises the descriptor limit to the hard limit. returns 0 if the pools
+// cannot be made.
+int startdense() {
+	struct rlimit lim;
+
+	inpool.bufs = (char **) malloc(DENSE_POOL_BUFS * sizeof(char *));
+	outpool.bufs = (char **) malloc(DENSE_POOL_BUFS * sizeof(char *));
+	if (!inpool.bufs || !outpool.bufs) {
+		fprintf(stderr, "error : unable to malloc buffer pools\n");
+		return (0);
+	}
+
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+		lim.rlim_cur = lim.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &lim) == -1)
+			perror("setrlimit");
+	}
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0)
+		printf("dense: up to %llu descriptors.\n",
+				(unsigned long long) lim.rlim_cur);
+	return (1);
+}
+
+// returns the pool of buffers of the given size, NULL if there is none.
+static BufPool *findpool(size_t size) {
+	if (!config.dense)
+		return (NULL);
+	if (size == INBUF_INITIAL)
+		return (&inpool);
+	if (size == OUTBUF_INITIAL)
+		return (&outpool);
+	return (NULL);
+}
+
+// returns a buffer of the given size, from its pool if there is one.
+char *takebuf(size_t size) {
+	BufPool *pool = findpool(size);
+	char *buf;
+
+	if (pool && pool->count > 0) {
+		pooltaken++;
+		return (pool->bufs[--pool->count]);
+	}
+	poolmissed++;
+	buf = (char *) malloc(size);
+	if (!buf) {
+		fprintf(stderr, "error : unable to malloc buffer\n");
+		exit(0);
+	}
+	return (buf);
+}
+
+// gives back a buffer of the given size taken with takebuf(), or grown
+// from one with realloc(). NULL is ignored.
+void givebuf(char *buf, size_t size) {
+	BufPool *pool = findpool(size);
+
+	if (buf == NULL)
+		return;
+	if (pool && pool->count < DENSE_POOL_BUFS) {
+		pool->bufs[pool->count++] = buf;
+		return;
+	}
+	free(buf);
+}
+
+// sets the send buffer size of an idle client socket.
+void densesock(int sd) {
+	int size = DENSE_SOCK_BUF;
+
+	setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+// sets the send buffer size of a member's socket. returns 0 if the kernel
+// refused.
+static int sizesock(Member *memb, int size) {
+	if (setsockopt(memb->sock, SOL_SOCKET, SO_SNDBUF, &size,
+				sizeof(size)) == -1) {
+		MAILLOG("setsockopt SO_SNDBUF: %s\n", strerror(errno));
+		return (0);
+	}
+	return (1);
+}
+
+// notes that the member's output outgrows its small send buffer, and
+// widens it unless it already is. returns 1 if it was just widened.
+int densebusy(Member *memb) {
+	memb->active = 1;
+	if (memb->widened || memb->shm || memb->mux || memb->admin || memb->peer)
+		return (0);
+	if (!sizesock(memb, DENSE_WIDE_SOCK_BUF))
+		return (0);
+	if (nwidened == capwidened) {
+		capwidened = capwidened ? capwidened * 2 : 256;
+		widened = (Member **) realloc(widened, capwidened * sizeof(Member *));
+		if (!widened) {
+			fprintf(stderr, "error : unable to realloc widened members\n");
+			exit(0);
+		}
+	}
+	widened[nwidened++] = memb;
+	memb->widened = 1;
+	return (1);
+}
+
+// shrinks the send buffers of the widened members which were quiet since
+// the last time, at most every DENSE_NARROW_SEC. it runs when the event
+// loop wakes, so a quiet server narrows them at its next event.
+void narrowidle() {
+	uint64_t now;
+	Member *memb;
+	int i, kept = 0;
+
+	if (nwidened == 0 || (now = nowusec()) < nextnarrow)
+		return;
+	nextnarrow = now + (uint64_t) DENSE_NARROW_SEC * 1000000;
+	for (i = 0; i < nwidened; i++) {
+		memb = widened[i];
+		if (memb->active || outpending(memb) > 0 || memb->inlen > 0 ||
+				!sizesock(memb, DENSE_SOCK_BUF)) {
+			memb->active = 0;
+			widened[kept++] = memb;
+			continue;
+		}
+		memb->widened = 0;
+	}
+	nwidened = kept;
+}
+
+// forgets a widened member which is going away.
+void denseforget(Member *memb) {
+	int i, kept = 0;
+
+	if (!memb->widened)
+		return;
+	for (i = 0; i < nwidened; i++) {
+		if (widened[i] != memb)
+			widened[kept++] = widened[i];
+	}
+	nwidened = kept;
+}
+
+// displays how many connections hold buffers.
+void listdensestats() {
+	Member *memb;
+	uint64_t conns = 0, inbufs = 0, outbufs = 0;
+
+	if (!config.dense)
+		return;
+	for (memb = memblist; memb; memb = memb->next) {
+		if (memb->mux)
+			continue;
+		conns++;
+		inbufs += memb->inbuf != NULL;
+		outbufs += memb->outbuf != NULL;
+	}
+	printf("dense: %llu connections, %llu with input and %llu with output "
+			"buffers, %d widened\n",
+			(unsigned long long) conns, (unsigned long long) inbufs,
+			(unsigned long long) outbufs, nwidened);
+	printf("dense: %d and %d buffers pooled, %llu taken from the pools and "
+			"%llu allocated\n", inpool.count, outpool.count,
+			(unsigned long long) pooltaken, (unsigned long long) poolmissed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
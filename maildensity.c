@@ -0,0 +1,306 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: maildensity.c
+// Description: This file contains methods to measure how much memory a
+//				mail server takes for each idle client.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "common.h"
+
+// Opens many connections to a server, logs each in as a user of its own
+// and leaves them idle, then reports the memory they take divided by
+// their number. The server's share is the growth of its resident set,
+// read from /proc for the process given with --pid. The kernel's share is
+// the growth of its slab caches and of the memory held by TCP sockets;
+// when the server runs on this host this covers both ends of every
+// connection, ours as well as the server's.
+//
+// The connections are made in waves, each wave logged in and its welcome
+// read before the next, so the server's accept queue never overflows. A
+// server on the loopback network is connected to from a new source
+// address every DENSITY_PER_ADDR connections, since one address runs out
+// of ports long before 100000 connections.
+
+#define DENSITY_DEFAULT_CONNS  100000
+#define DENSITY_WAVE           1000         // connections made before reading their welcomes
+#define DENSITY_PER_ADDR       20000        // connections from one loopback address
+#define DENSITY_SOURCE_BASE    0x7f000100   // 127.0.1.0
+#define DENSITY_SETTLE         2            // seconds given to the server before measuring
+#define DENSITY_SPARE_FDS      16           // descriptors kept for other uses
+
+// Global Variables
+char * server = "127.0.0.1";
+unsigned short port = 5945;
+int conns = DENSITY_DEFAULT_CONNS;
+pid_t serverpid = 0;
+int hold = 0;
+
+// returns the resident memory of the process in bytes, 0 if unknown.
+uint64_t residentbytes(pid_t pid) {
+	char path[64];
+	unsigned long long size, resident;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/statm", (int) pid);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return (0);
+	if (fscanf(fp, "%llu %llu", &size, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+	return (resident * sysconf(_SC_PAGESIZE));
+}
+
+// returns the memory of the kernel's slab caches and TCP sockets in bytes.
+uint64_t kernelbytes() {
+	char line[256];
+	unsigned long long kb, pages, total = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/meminfo", "r");
+	if (fp != NULL) {
+		while (fgets(line, sizeof(line), fp)) {
+			if (sscanf(line, "Slab: %llu kB", &kb) == 1)
+				total += kb * 1024;
+		}
+		fclose(fp);
+	}
+	fp = fopen("/proc/net/sockstat", "r");
+	if (fp != NULL) {
+		while (fgets(line, sizeof(line), fp)) {
+			char *mem = strstr(line, " mem ");
+			if (strncmp(line, "TCP:", 4) == 0 && mem &&
+					sscanf(mem, " mem %llu", &pages) == 1)
+				total += pages * sysconf(_SC_PAGESIZE);
+		}
+		fclose(fp);
+	}
+	return (total);
+}
+
+// reads len bytes from the socket. returns 0 if it fails.
+int readfull(int sd, char *buf, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(sd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (0);
+		buf += n;
+		len -= n;
+	}
+	return (1);
+}
+
+// reads the welcome packet the server greets each client with. returns 0
+// if it does not come.
+int readwelcome(int sd) {
+	char buf[PKT_HEADER_LEN + MAXPKTLEN];
+	uint32_t lent;
+
+	if (!readfull(sd, buf, PKT_HEADER_LEN))
+		return (0);
+	memcpy(&lent, buf + 1, sizeof(lent));
+	lent = ntohl(lent);
+	if (buf[0] != WELCOME_MSG || lent > MAXPKTLEN)
+		return (0);
+	return (readfull(sd, buf + PKT_HEADER_LEN, lent));
+}
+
+// connects to the server as the i-th client and logs in. returns the
+// socket, or -1 if it fails.
+int openidle(int i, struct sockaddr_in *address) {
+	struct sockaddr_in source;
+	char pkt[PKT_HEADER_LEN + 32];
+	uint32_t lent;
+	int sd, on = 1;
+
+	sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd == -1) {
+		perror("socket");
+		return (-1);
+	}
+	if ((ntohl(address->sin_addr.s_addr) >> 24) == 127) {
+		memset(&source, 0, sizeof(source));
+		source.sin_family = AF_INET;
+		source.sin_addr.s_addr = htonl(DENSITY_SOURCE_BASE +
+				i / DENSITY_PER_ADDR);
+		setsockopt(sd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+		if (bind(sd, (struct sockaddr *) &source, sizeof(source)) == -1) {
+			perror("bind");
+			close(sd);
+			return (-1);
+		}
+	}
+	if (connect(sd, (struct sockaddr *) address, sizeof(*address)) == -1) {
+		perror("connect");
+		close(sd);
+		return (-1);
+	}
+
+	lent = snprintf(pkt + PKT_HEADER_LEN, sizeof(pkt) - PKT_HEADER_LEN,
+			"idle%d", i) + 1;
+	pkt[0] = USER_NAME;
+	lent = htonl(lent);
+	memcpy(pkt + 1, &lent, sizeof(lent));
+	if (write(sd, pkt, PKT_HEADER_LEN + ntohl(lent)) == -1) {
+		perror("write");
+		close(sd);
+		return (-1);
+	}
+	return (sd);
+}
+
+// raises the descriptor limit, and lowers the number of connections to
+// what it allows.
+void raiselimit() {
+	struct rlimit lim;
+
+	if (getrlimit(RLIMIT_NOFILE, &lim) == -1)
+		return;
+	lim.rlim_cur = lim.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &lim);
+	if (lim.rlim_cur < (rlim_t) conns + DENSITY_SPARE_FDS) {
+		fprintf(stderr, "warning: only %llu descriptors, opening %llu "
+				"connections.\n", (unsigned long long) lim.rlim_cur,
+				(unsigned long long) lim.rlim_cur - DENSITY_SPARE_FDS);
+		conns = lim.rlim_cur - DENSITY_SPARE_FDS;
+	}
+}
+
+// prints the command line options.
+void usage(char *prog) {
+	fprintf(stderr, "usage : %s [options]\n", prog);
+	fprintf(stderr, "  --address <ip-addr>   server to connect to (127.0.0.1)\n");
+	fprintf(stderr, "  --port <port>         port of the server (5945)\n");
+	fprintf(stderr, "  --conns <n>           idle connections to open (%d)\n",
+			DENSITY_DEFAULT_CONNS);
+	fprintf(stderr, "  --pid <pid>           server process to measure (none)\n");
+	fprintf(stderr, "  --hold                keep the connections open until enter\n");
+}
+
+int main(int argc, char *argv[]) {
+	static struct option options[] = {
+		{ "address", required_argument, NULL, 'a' },
+		{ "port",    required_argument, NULL, 'p' },
+		{ "conns",   required_argument, NULL, 'n' },
+		{ "pid",     required_argument, NULL, 'P' },
+		{ "hold",    no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct sockaddr_in address;
+	uint64_t serverbefore = 0, serverafter = 0, kernbefore, kernafter;
+	char buf[MAXPKTLEN];
+	int *socks;
+	int opt, i, first, opened = 0;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		if (opt == 'a' && inet_pton(AF_INET, optarg, &address.sin_addr) == 1)
+			server = optarg;
+		else if (opt == 'p' && atoi(optarg) > 0 && atoi(optarg) <= 65535)
+			port = atoi(optarg);
+		else if (opt == 'n' && atoi(optarg) > 0)
+			conns = atoi(optarg);
+		else if (opt == 'P' && atoi(optarg) > 0)
+			serverpid = atoi(optarg);
+		else if (opt == 'h')
+			hold = 1;
+		else {
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+	if (optind != argc) {
+		usage(argv[0]);
+		exit(1);
+	}
+	inet_pton(AF_INET, server, &address.sin_addr);
+	address.sin_port = htons(port);
+
+	raiselimit();
+	socks = (int *) malloc(conns * sizeof(int));
+	if (!socks) {
+		fprintf(stderr, "error : unable to malloc sockets\n");
+		exit(1);
+	}
+	if (serverpid && (serverbefore = residentbytes(serverpid)) == 0) {
+		fprintf(stderr, "error: cannot read the memory of process %d.\n",
+				(int) serverpid);
+		exit(1);
+	}
+	kernbefore = kernelbytes();
+
+	// open the connections a wave at a time
+	for (first = 0; first < conns; first = opened) {
+		for (i = first; i < conns && i < first + DENSITY_WAVE; i++) {
+			socks[i] = openidle(i, &address);
+			if (socks[i] == -1)
+				break;
+		}
+		for (; opened < i; opened++) {
+			if (!readwelcome(socks[opened])) {
+				fprintf(stderr, "error: no welcome on connection %d.\n", opened);
+				break;
+			}
+		}
+		if (opened < first + DENSITY_WAVE && opened < conns)
+			break;
+	}
+	if (opened == 0) {
+		fprintf(stderr, "error: no connection made.\n");
+		exit(1);
+	}
+
+	// let the server settle, and take whatever else it sent
+	sleep(DENSITY_SETTLE);
+	for (i = 0; i < opened; i++) {
+		while (recv(socks[i], buf, sizeof(buf), MSG_DONTWAIT) > 0)
+			;
+	}
+
+	kernafter = kernelbytes();
+	printf("%d idle connections\n", opened);
+	if (serverpid) {
+		serverafter = residentbytes(serverpid);
+		printf("server: %lld bytes, %.0f per connection\n",
+				(long long) (serverafter - serverbefore),
+				(double) (int64_t) (serverafter - serverbefore) / opened);
+	}
+	printf("kernel: %lld bytes, %.0f per connection (both ends if local)\n",
+			(long long) (kernafter - kernbefore),
+			(double) (int64_t) (kernafter - kernbefore) / opened);
+	fflush(stdout);
+
+	if (hold) {
+		printf("holding the connections, press enter to close them.\n");
+		fflush(stdout);
+		getchar();
+	}
+	return (opened == conns ? 0 : 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,698 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailfilter.c
+// Description: This file contains methods to drop or quarantine submitted
+//				emails matching the rules of a content filter.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+#include "common.h"
+#include "mailserver.h"
+#include "mailtrace.h"
+
+// The filter file holds one rule per line, blank lines and lines starting
+// with '#' aside:
+//
+//     drop|quarantine sender <user>@<ip-addr>
+//     drop|quarantine from <ip-addr>[/<n>]
+//     drop|quarantine body <keyword>
+//
+// A sender rule matches the logged in user sending the mail, a from rule
+// the ip-address it connected from, and a body rule the keyword anywhere
+// in the message, ignoring case. When several rules match, drop wins.
+//
+// The rules are compiled into a rule set: sender rules into a hash table,
+// ranges into one hash table per prefix length probed longest first, and
+// keywords into an Aho-Corasick automaton flattened into a table of next
+// states by state and byte. Checking a message then costs one lookup per
+// byte however many keywords there are. A reload compiles the file into a
+// new rule set and only then swaps it in, so a bad file leaves the rules
+// in force untouched.
+
+// a rule as written in the filter file
+typedef struct _filterrule {
+
+	// FILTER_DROP or FILTER_QUARANTINE
+	int action;
+
+	// the line of the rule, for listings
+	char * text;
+
+	// mails the rule caught since it was loaded
+	uint64_t hits;
+
+} FilterRule;
+
+// hash table of the ranges of one prefix length, keyed by their network
+// address in host byte order. a slot holds its rule's index plus 1, 0
+// while empty.
+typedef struct _prefixtab {
+	int bits;
+	uint32_t mask;
+	uint32_t * nets;
+	int32_t * rules;
+	uint32_t size;
+} PrefixTab;
+
+// a compiled filter file
+typedef struct _filterset {
+
+	// rules in the order of the file
+	FilterRule * rules;
+	int nrules;
+
+	// sender rules keyed by "<user>@<ip-addr>", slots as in PrefixTab
+	char ** senders;
+	int32_t * senderrules;
+	uint32_t sendersize;
+
+	// ranges, one table per prefix length, longest first
+	PrefixTab prefixes[33];
+	int nprefixes;
+
+	// keyword automaton: next state by state and byte, and the rule the
+	// state matches plus 1, 0 for none. states fit in 16 bits, which
+	// halves the table the scan walks.
+	uint16_t * delta;
+	int32_t * match;
+	int nstates;
+
+	// rules of each kind
+	int nsenders;
+	int nranges;
+	int nkeywords;
+
+	// nanoseconds checking a mail took when the rules were compiled, and
+	// the sum of what the rounds found, which keeps them from being
+	// optimized away
+	uint64_t cost;
+	uint64_t benchsum;
+
+} FilterSet;
+
+// a mail held back by the filter
+typedef struct _quarantined {
+	uint64_t mailid;
+	uint64_t heldat;
+	char * from;
+	char * to;
+	char * message;
+	char * rule;
+} Quarantined;
+
+// Global Variables
+FilterSet * filterset = NULL;
+
+// mails checked, dropped and quarantined since the server started
+uint64_t filterchecked = 0;
+uint64_t filterdropped = 0;
+uint64_t filterheld = 0;
+
+// the last QUARANTINE_MAILS mails held back, filterheld counting them all
+Quarantined quarantine[QUARANTINE_MAILS];
+
+// set by SIGHUP, the rules are loaded again by the event loop
+volatile sig_atomic_t filterhangup = 0;
+
+// hashes the bytes of name, '@' and ip (FNV-1a).
+static uint32_t hashsender(const char *name, const char *ip) {
+	uint32_t hash = 2166136261u;
+
+	for (; *name; name++)
+		hash = (hash ^ (uint8_t) *name) * 16777619u;
+	hash = (hash ^ '@') * 16777619u;
+	for (; *ip; ip++)
+		hash = (hash ^ (uint8_t) *ip) * 16777619u;
+	return (hash);
+}
+
+// hashes a network address.
+static uint32_t hashnet(uint32_t net) {
+	return ((net * 2654435761u) ^ (net >> 16));
+}
+
+// returns the smallest power of two holding n entries at most half full.
+static uint32_t tablesize(int n) {
+	uint32_t size = 16;
+
+	while (size < (uint32_t) n * 2)
+		size <<= 1;
+	return (size);
+}
+
+// calloc()s or exits.
+static void *filteralloc(size_t n, size_t size, char *what) {
+	void *p = calloc(n ? n : 1, size);
+
+	if (!p) {
+		fprintf(stderr, "error : unable to calloc %s\n", what);
+		exit(0);
+	}
+	return (p);
+}
+
+// keeps the stronger of the two rules, the first one on a tie. rules are
+// given as index plus 1, 0 for none.
+static int32_t strongerrule(FilterSet *set, int32_t have, int32_t rule) {
+	if (have == 0 || (rule != 0 &&
+				set->rules[rule - 1].action > set->rules[have - 1].action))
+		return (rule);
+	return (have);
+}
+
+// frees a rule set.
+static void freefilterset(FilterSet *set) {
+	int i;
+
+	if (set == NULL)
+		return;
+	for (i = 0; i < set->nrules; i++)
+		free(set->rules[i].text);
+	free(set->rules);
+	for (i = 0; i < (int) set->sendersize; i++)
+		free(set->senders[i]);
+	free(set->senders);
+	free(set->senderrules);
+	for (i = 0; i < set->nprefixes; i++) {
+		free(set->prefixes[i].nets);
+		free(set->prefixes[i].rules);
+	}
+	free(set->delta);
+	free(set->match);
+	free(set);
+}
+
+// parses "a.b.c.d[/n]" into a network address in host byte order and a
+// prefix length. returns 0 if invalid.
+static int parserange(char *str, uint32_t *net, int *bits) {
+	char buf[INET_ADDRSTRLEN + 4];
+	struct in_addr in;
+	char *slash, *end;
+	long n = 32;
+
+	if (strlen(str) >= sizeof(buf))
+		return (0);
+	strcpy(buf, str);
+	if ((slash = strchr(buf, '/')) != NULL) {
+		*slash = '\0';
+		n = strtol(slash + 1, &end, 10);
+		if (end == slash + 1 || *end != '\0' || n < 0 || n > 32)
+			return (0);
+	}
+	if (inet_pton(AF_INET, buf, &in) != 1)
+		return (0);
+	*bits = n;
+	*net = ntohl(in.s_addr) & (n == 0 ? 0 : 0xffffffffu << (32 - n));
+	return (1);
+}
+
+// adds a sender rule given as "<user>@<ip-addr>".
+static void addsender(FilterSet *set, char *addr, int32_t rule) {
+	char *at = strchr(addr, '@');
+	uint32_t i;
+
+	*at = '\0';
+	i = hashsender(addr, at + 1) & (set->sendersize - 1);
+	*at = '@';
+	for (; set->senders[i]; i = (i + 1) & (set->sendersize - 1)) {
+		if (strcmp(set->senders[i], addr) == 0) {
+			set->senderrules[i] = strongerrule(set, set->senderrules[i], rule);
+			return;
+		}
+	}
+	set->senders[i] = strdup(addr);
+	set->senderrules[i] = rule;
+}
+
+// adds a range to the table of its prefix length.
+static void addrange(FilterSet *set, uint32_t net, int bits, int32_t rule) {
+	PrefixTab *tab = NULL;
+	uint32_t i;
+	int p;
+
+	for (p = 0; p < set->nprefixes; p++) {
+		if (set->prefixes[p].bits == bits) {
+			tab = &set->prefixes[p];
+			break;
+		}
+	}
+	for (i = hashnet(net) & (tab->size - 1); tab->rules[i];
+			i = (i + 1) & (tab->size - 1)) {
+		if (tab->nets[i] == net) {
+			tab->rules[i] = strongerrule(set, tab->rules[i], rule);
+			return;
+		}
+	}
+	tab->nets[i] = net;
+	tab->rules[i] = rule;
+}
+
+// adds a keyword to the trie of the automaton. edges lead away from the
+// root only, so a next state of 0 means there is no edge yet.
+static void addkeyword(FilterSet *set, char *word, int32_t rule) {
+	uint16_t *next;
+	int32_t state = 0;
+
+	for (; *word; word++) {
+		next = &set->delta[(state << 8) | (uint8_t) tolower((uint8_t) *word)];
+		if (*next == 0)
+			*next = set->nstates++;
+		state = *next;
+	}
+	set->match[state] = strongerrule(set, set->match[state], rule);
+}
+
+// turns the trie into the automaton. states are visited breadth first, so
+// the state a state falls back to is complete when the state is reached:
+// a missing edge becomes the fallback's edge, and a state also matches
+// what its fallback matches. uppercase letters then lead where lowercase
+// ones do.
+static void buildautomaton(FilterSet *set) {
+	int32_t *fail, *queue, state, next;
+	uint16_t *row;
+	int head = 0, tail = 0, c;
+
+	fail = (int32_t *) filteralloc(set->nstates, sizeof(int32_t), "filter states");
+	queue = (int32_t *) filteralloc(set->nstates, sizeof(int32_t), "filter states");
+
+	for (c = 0; c < 256; c++) {
+		if ((next = set->delta[c]) != 0)
+			queue[tail++] = next;
+	}
+	while (head < tail) {
+		state = queue[head++];
+		row = &set->delta[state << 8];
+		for (c = 0; c < 256; c++) {
+			if (row[c] == 0) {
+				row[c] = set->delta[(fail[state] << 8) | c];
+				continue;
+			}
+			next = row[c];
+			fail[next] = set->delta[(fail[state] << 8) | c];
+			set->match[next] = strongerrule(set, set->match[next],
+					set->match[fail[next]]);
+			queue[tail++] = next;
+		}
+	}
+
+	for (state = 0; state < set->nstates; state++) {
+		row = &set->delta[state << 8];
+		for (c = 'A'; c <= 'Z'; c++)
+			row[c] = row[tolower(c)];
+	}
+	free(fail);
+	free(queue);
+}
+
+// returns the index of the strongest rule matching the mail, -1 if none.
+static int matchfilter(FilterSet *set, char *name, char *ip, char *msg) {
+	const uint16_t *delta = set->delta;
+	const int32_t *match = set->match;
+	const uint8_t *p = (const uint8_t *) msg;
+	int32_t best = 0, state = 0, m;
+	struct in_addr in;
+	uint32_t addr, net, i;
+	PrefixTab *tab;
+	int k;
+
+	if (set->nsenders && name) {
+		k = strlen(name);
+		for (i = hashsender(name, ip) & (set->sendersize - 1);
+				set->senders[i]; i = (i + 1) & (set->sendersize - 1)) {
+			if (strncmp(set->senders[i], name, k) == 0 &&
+					set->senders[i][k] == '@' &&
+					strcmp(set->senders[i] + k + 1, ip) == 0) {
+				best = set->senderrules[i];
+				break;
+			}
+		}
+	}
+
+	// the longest range holding the address decides
+	if (set->nranges && inet_pton(AF_INET, ip, &in) == 1) {
+		addr = ntohl(in.s_addr);
+		for (k = 0; k < set->nprefixes; k++) {
+			tab = &set->prefixes[k];
+			net = addr & tab->mask;
+			for (i = hashnet(net) & (tab->size - 1); tab->rules[i];
+					i = (i + 1) & (tab->size - 1)) {
+				if (tab->nets[i] == net)
+					break;
+			}
+			if (tab->rules[i]) {
+				best = strongerrule(set, best, tab->rules[i]);
+				break;
+			}
+		}
+	}
+
+	if (set->nkeywords && (best == 0 ||
+				set->rules[best - 1].action != FILTER_DROP)) {
+		for (; *p; p++) {
+			state = delta[(state << 8) | *p];
+			if ((m = match[state]) != 0 && m != best) {
+				best = strongerrule(set, best, m);
+				if (set->rules[best - 1].action == FILTER_DROP)
+					break;
+			}
+		}
+	}
+	return (best - 1);
+}
+
+// measures how long checking a full line of mailclient takes with the
+// rules of the set.
+static void timefilter(FilterSet *set) {
+	char msg[FILTER_BENCH_LEN + 1];
+	uint64_t start, sum = 0;
+	int i;
+
+	for (i = 0; i < FILTER_BENCH_LEN; i++)
+		msg[i] = "the quick brown fox jumps over the lazy dog "[i % 44];
+	msg[FILTER_BENCH_LEN] = '\0';
+
+	// each round starts a little further into the line, so the rounds
+	// cannot be folded into one
+	start = nowusec();
+	for (i = 0; i < FILTER_BENCH_ROUNDS; i++)
+		sum += matchfilter(set, "nobody", "192.0.2.1", msg + (i & 7));
+	set->cost = (nowusec() - start) * 1000 / FILTER_BENCH_ROUNDS;
+	set->benchsum = sum;
+}
+
+// splits a line of the filter file into its action, kind and argument,
+// in place. returns 0 for a blank line or a comment, -1 if the line is not
+// a rule.
+static int splitrule(char *line, char **act, char **kind, char **arg) {
+	char *end;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	*act = line + strspn(line, " \t");
+	if (**act == '\0' || **act == '#')
+		return (0);
+
+	*kind = *act + strcspn(*act, " \t");
+	if (**kind == '\0')
+		return (-1);
+	*(*kind)++ = '\0';
+	*kind += strspn(*kind, " \t");
+
+	*arg = *kind + strcspn(*kind, " \t");
+	if (**arg == '\0')
+		return (-1);
+	*(*arg)++ = '\0';
+	*arg += strspn(*arg, " \t");
+	for (end = *arg + strlen(*arg); end > *arg && isspace((uint8_t) end[-1]); )
+		*--end = '\0';
+
+	// only a keyword may hold blanks
+	if (**arg == '\0' || (strcmp(*kind, "body") != 0 && strpbrk(*arg, " \t")))
+		return (-1);
+	if (strcmp(*act, "drop") != 0 && strcmp(*act, "quarantine") != 0)
+		return (-1);
+	return (1);
+}
+
+// reads the filter file and compiles its rules. returns NULL, having said
+// why, if the file cannot be read or holds a bad rule.
+static FilterSet *loadfilter(char *path) {
+	char line[FILTER_MAX_LINE], text[FILTER_MAX_LINE], *act, *kind, *arg, *at;
+	int counts[33] = { 0 }, lineno = 0, bits, p, i;
+	size_t keybytes = 0;
+	struct in_addr in;
+	FilterSet *set;
+	uint32_t net;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror("fopen");
+		return (NULL);
+	}
+	set = (FilterSet *) filteralloc(1, sizeof(FilterSet), "filter");
+
+	// first pass: check every rule and count the entries of each table
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if (strchr(line, '\n') == NULL && !feof(fp)) {
+			fprintf(stderr, "error: %s:%d: line too long.\n", path, lineno);
+			goto bad;
+		}
+		if ((i = splitrule(line, &act, &kind, &arg)) == 0)
+			continue;
+		if (i < 0) {
+			fprintf(stderr, "error: %s:%d: bad rule.\n", path, lineno);
+			goto bad;
+		}
+
+		if (strcmp(kind, "sender") == 0) {
+			at = strchr(arg, '@');
+			if (at == NULL || at == arg || inet_pton(AF_INET, at + 1, &in) != 1) {
+				fprintf(stderr, "error: %s:%d: bad sender.\n", path, lineno);
+				goto bad;
+			}
+			set->nsenders++;
+		} else if (strcmp(kind, "from") == 0) {
+			if (!parserange(arg, &net, &bits)) {
+				fprintf(stderr, "error: %s:%d: bad range.\n", path, lineno);
+				goto bad;
+			}
+			counts[bits]++;
+			set->nranges++;
+		} else if (strcmp(kind, "body") == 0) {
+			keybytes += strlen(arg);
+			if (keybytes >= FILTER_MAX_STATES) {
+				fprintf(stderr, "error: %s:%d: keywords too long.\n", path, lineno);
+				goto bad;
+			}
+			set->nkeywords++;
+		} else {
+			fprintf(stderr, "error: %s:%d: bad rule.\n", path, lineno);
+			goto bad;
+		}
+		if (++set->nrules > FILTER_MAX_RULES) {
+			fprintf(stderr, "error: %s:%d: too many rules.\n", path, lineno);
+			goto bad;
+		}
+	}
+
+	// size the tables
+	set->rules = (FilterRule *) filteralloc(set->nrules, sizeof(FilterRule),
+			"filter rules");
+	set->sendersize = tablesize(set->nsenders);
+	set->senders = (char **) filteralloc(set->sendersize, sizeof(char *),
+			"filter senders");
+	set->senderrules = (int32_t *) filteralloc(set->sendersize,
+			sizeof(int32_t), "filter senders");
+	for (bits = 32; bits >= 0; bits--) {
+		if (counts[bits] == 0)
+			continue;
+		p = set->nprefixes++;
+		set->prefixes[p].bits = bits;
+		set->prefixes[p].mask = bits == 0 ? 0 : 0xffffffffu << (32 - bits);
+		set->prefixes[p].size = tablesize(counts[bits]);
+		set->prefixes[p].nets = (uint32_t *) filteralloc(set->prefixes[p].size,
+				sizeof(uint32_t), "filter ranges");
+		set->prefixes[p].rules = (int32_t *) filteralloc(set->prefixes[p].size,
+				sizeof(int32_t), "filter ranges");
+	}
+	set->delta = (uint16_t *) filteralloc((keybytes + 1) << 8, sizeof(uint16_t),
+			"filter automaton");
+	set->match = (int32_t *) filteralloc(keybytes + 1, sizeof(int32_t),
+			"filter automaton");
+	set->nstates = 1;
+
+	// second pass: fill them in, the file was checked
+	rewind(fp);
+	for (i = 0; i < set->nrules && fgets(line, sizeof(line), fp) != NULL; ) {
+		line[strcspn(line, "\r\n")] = '\0';
+		strcpy(text, line);
+		if (splitrule(line, &act, &kind, &arg) == 0)
+			continue;
+		set->rules[i].action = strcmp(act, "drop") == 0 ?
+			FILTER_DROP : FILTER_QUARANTINE;
+		set->rules[i].text = strdup(text);
+		if (strcmp(kind, "sender") == 0) {
+			addsender(set, arg, i + 1);
+		} else if (strcmp(kind, "from") == 0) {
+			parserange(arg, &net, &bits);
+			addrange(set, net, bits, i + 1);
+		} else {
+			addkeyword(set, arg, i + 1);
+		}
+		i++;
+	}
+	fclose(fp);
+
+	buildautomaton(set);
+	timefilter(set);
+	return (set);
+
+bad:
+	fclose(fp);
+	freefilterset(set);
+	return (NULL);
+}
+
+// asks the event loop to load the rules again.
+static void onhangup(int sig) {
+	filterhangup = 1;
+}
+
+// loads the rules of the filter file, and loads them again on SIGHUP.
+// returns 0 if the file cannot be loaded.
+int startfilter(char *path) {
+	struct sigaction sa;
+
+	if ((filterset = loadfilter(path)) == NULL)
+		return (0);
+	printf("filter: %d rules loaded from %s, about %llu nsec per mail.\n",
+			filterset->nrules, path, (unsigned long long) filterset->cost);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onhangup;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGHUP, &sa, NULL);
+	return (1);
+}
+
+// loads the rules of the filter file again. the rules in force stay if
+// the file cannot be loaded.
+void reloadfilter() {
+	FilterSet *set;
+
+	if (config.filterpath == NULL) {
+		fprintf(stderr, "error: no filter file, start with --filter.\n");
+		return;
+	}
+	if ((set = loadfilter(config.filterpath)) == NULL) {
+		fprintf(stderr, "error: filter not reloaded, the old rules stay.\n");
+		return;
+	}
+	freefilterset(filterset);
+	filterset = set;
+	printf("filter: %d rules reloaded from %s, about %llu nsec per mail.\n",
+			set->nrules, config.filterpath, (unsigned long long) set->cost);
+}
+
+// reloads the rules if a SIGHUP asked for it.
+void checkfilter() {
+	if (!filterhangup)
+		return;
+	filterhangup = 0;
+	reloadfilter();
+	fflush(stdout);
+}
+
+// holds back a mail from the member for review, under a new id.
+static uint64_t holdmail(Member *memb, char *mname, char *ipaddr,
+		char *mailmsg, FilterRule *rule) {
+	Quarantined *held = &quarantine[filterheld++ % QUARANTINE_MAILS];
+	char addr[MAXNAMELEN * 2 + INET_ADDRSTRLEN];
+
+	free(held->from);
+	free(held->to);
+	free(held->message);
+	free(held->rule);
+
+	held->mailid = ++globalmailid;
+	held->heldat = nowusec();
+	snprintf(addr, sizeof(addr), "%s@%s", memb->name ? memb->name : "",
+			memb->ipaddr);
+	held->from = strdup(addr);
+	snprintf(addr, sizeof(addr), "%s@%s", mname, ipaddr);
+	held->to = strdup(addr);
+	held->message = strdup(mailmsg);
+	held->rule = strdup(rule->text);
+	setstatus(held->mailid, MAIL_QUARANTINED);
+	return (held->mailid);
+}
+
+// checks a mail the member submitted against the rules. returns
+// FILTER_PASS if it may be queued, FILTER_DROP if it must be refused, or
+// FILTER_QUARANTINE if it was held back under the id put in mailid.
+int filtermail(Member *memb, char *mname, char *ipaddr, char *mailmsg,
+		uint64_t *mailid) {
+	FilterRule *rule;
+	int found;
+#ifdef MAIL_TRACE
+	uint64_t start;
+#endif
+
+	if (filterset == NULL)
+		return (FILTER_PASS);
+
+#ifdef MAIL_TRACE
+	start = tracenow();
+	found = matchfilter(filterset, memb->name, memb->ipaddr, mailmsg);
+	tracefilter(start);
+#else
+	found = matchfilter(filterset, memb->name, memb->ipaddr, mailmsg);
+#endif
+	filterchecked++;
+	if (found < 0)
+		return (FILTER_PASS);
+
+	rule = &filterset->rules[found];
+	rule->hits++;
+	if (rule->action == FILTER_DROP) {
+		filterdropped++;
+		return (FILTER_DROP);
+	}
+	*mailid = holdmail(memb, mname, ipaddr, mailmsg, rule);
+	return (FILTER_QUARANTINE);
+}
+
+// displays the rules with the mails each caught, and the mails held back.
+void listfilter() {
+	Quarantined *held;
+	uint64_t i, now = nowusec();
+	int r;
+
+	if (filterset == NULL) {
+		printf("no content filter.\n");
+		return;
+	}
+	printf("================\nFilter rules\n================\n");
+	for (r = 0; r < filterset->nrules; r++)
+		printf("%10llu  %s\n", (unsigned long long) filterset->rules[r].hits,
+				filterset->rules[r].text);
+	printf("================\nQuarantined mails\n================\n");
+	for (i = filterheld > QUARANTINE_MAILS ? filterheld - QUARANTINE_MAILS : 0;
+			i < filterheld; i++) {
+		held = &quarantine[i % QUARANTINE_MAILS];
+		printf("%llu: %s -> %s, %llus ago, by '%s'\n>> %s\n",
+				(unsigned long long) held->mailid, held->from, held->to,
+				(unsigned long long) ((now - held->heldat) / 1000000),
+				held->rule, held->message);
+	}
+	printf("================\n");
+}
+
+// displays the counters of the filter.
+void listfilterstats() {
+	if (filterset == NULL)
+		return;
+	printf("filter: %d rules (%d senders, %d ranges, %d keywords, %d states), "
+			"about %llu nsec per mail\n", filterset->nrules,
+			filterset->nsenders, filterset->nranges, filterset->nkeywords,
+			filterset->nstates, (unsigned long long) filterset->cost);
+	printf("filter mails: %llu checked, %llu dropped, %llu quarantined\n",
+			(unsigned long long) filterchecked,
+			(unsigned long long) filterdropped,
+			(unsigned long long) filterheld);
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,705 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailhandoff.c
+// Description: This file contains methods to hand the sockets and the
+//				mail queue of a running server over to a new server process.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include "common.h"
+#include "mailserver.h"
+#include "mailshm.h"
+#include "maillog.h"
+
+// A server started with --handoff <path> listens on a unix SOCK_SEQPACKET
+// socket at that path. A new server started with the same option first
+// connects there, and if an old server answers it takes over instead of
+// starting fresh: the old server writes its state into a memfd, passes the
+// memfd, its listening sockets and the sockets of its clients over with
+// SCM_RIGHTS, and waits for the new server to say it is done. Only then
+// does the old server exit, without closing a single connection; until
+// then it has changed nothing, so a new server which fails leaves the old
+// one serving. Whatever clients send meanwhile waits in the kernel for the
+// new server to read it.
+//
+// The state carries the status history, every mail with its id and age,
+// oldest first, and every client connection with its name, its options,
+// the unread tail of a packet, its unwritten output, its sessions, and the
+// rings of a client on shared memory. Mails which were in flight to an
+// acknowledging recipient are queued again and sent once more; the client
+// drops the ones it has seen by their ids. Connections to peer servers are
+// not handed over, the new server connects again and relays what they had
+// in flight. Admin connections close.
+//
+// The state is written field by field in host byte order, since both
+// servers run on the same host, and starts with HANDOFF_MAGIC and
+// HANDOFF_VERSION so that an incompatible server is refused.
+
+#define HANDOFF_MAGIC    0x4d41494c     // "MAIL"
+#define HANDOFF_VERSION  1
+#define HANDOFF_FDS      250            // descriptors passed in one message
+#define HANDOFF_TIMEOUT  10             // seconds either side waits for the other
+#define HANDOFF_NONE     UINT32_MAX     // no descriptor, or a NULL string
+
+// options of a client connection handed over
+#define HANDOFF_LOCAL    0x01
+#define HANDOFF_BATCHING 0x02
+#define HANDOFF_WANTIDS  0x04
+#define HANDOFF_ACKING   0x08
+#define HANDOFF_MUXED    0x10
+#define HANDOFF_RELAY    0x20
+#define HANDOFF_CLOSING  0x40
+#define HANDOFF_PULLING  0x80
+
+// the serialized state, written or read from off
+typedef struct _handoffbuf {
+	char * data;
+	size_t len;
+	size_t cap;
+	size_t off;
+
+	// descriptors the state refers to by index
+	int * fds;
+	int nfds;
+	int fdcap;
+
+	// set once a read ran past the end or found garbage
+	int bad;
+} HandoffBuf;
+
+// appends bytes to the state.
+static void putbytes(HandoffBuf *hb, const void *buf, size_t len) {
+	if (hb->len + len > hb->cap) {
+		size_t cap = hb->cap ? hb->cap : 65536;
+		while (cap < hb->len + len)
+			cap *= 2;
+		hb->data = (char *) realloc(hb->data, cap);
+		if (!hb->data) {
+			fprintf(stderr, "error : unable to realloc handoff state\n");
+			exit(0);
+		}
+		hb->cap = cap;
+	}
+	memcpy(hb->data + hb->len, buf, len);
+	hb->len += len;
+}
+
+static void put8(HandoffBuf *hb, uint8_t val) {
+	putbytes(hb, &val, sizeof(val));
+}
+
+static void put32(HandoffBuf *hb, uint32_t val) {
+	putbytes(hb, &val, sizeof(val));
+}
+
+static void put64(HandoffBuf *hb, uint64_t val) {
+	putbytes(hb, &val, sizeof(val));
+}
+
+// appends a string with its terminating '\0', or HANDOFF_NONE for NULL.
+static void putstr(HandoffBuf *hb, char *str) {
+	if (str == NULL) {
+		put32(hb, HANDOFF_NONE);
+		return;
+	}
+	put32(hb, strlen(str) + 1);
+	putbytes(hb, str, strlen(str) + 1);
+}
+
+// appends a length and that many bytes.
+static void putblob(HandoffBuf *hb, char *buf, size_t len) {
+	put32(hb, len);
+	putbytes(hb, buf, len);
+}
+
+// remembers a descriptor to pass along and appends its index, or
+// HANDOFF_NONE for -1.
+static void putfd(HandoffBuf *hb, int fd) {
+	if (fd == -1) {
+		put32(hb, HANDOFF_NONE);
+		return;
+	}
+	if (hb->nfds == hb->fdcap) {
+		hb->fdcap = hb->fdcap ? hb->fdcap * 2 : 1024;
+		hb->fds = (int *) realloc(hb->fds, hb->fdcap * sizeof(int));
+		if (!hb->fds) {
+			fprintf(stderr, "error : unable to realloc handoff descriptors\n");
+			exit(0);
+		}
+	}
+	put32(hb, hb->nfds);
+	hb->fds[hb->nfds++] = fd;
+}
+
+// takes len bytes from the state. returns NULL past the end.
+static char *getbytes(HandoffBuf *hb, size_t len) {
+	char *buf;
+
+	if (hb->bad || hb->len - hb->off < len) {
+		hb->bad = 1;
+		return (NULL);
+	}
+	buf = hb->data + hb->off;
+	hb->off += len;
+	return (buf);
+}
+
+static uint8_t get8(HandoffBuf *hb) {
+	uint8_t val = 0;
+	char *buf = getbytes(hb, sizeof(val));
+	if (buf)
+		memcpy(&val, buf, sizeof(val));
+	return (val);
+}
+
+static uint32_t get32(HandoffBuf *hb) {
+	uint32_t val = 0;
+	char *buf = getbytes(hb, sizeof(val));
+	if (buf)
+		memcpy(&val, buf, sizeof(val));
+	return (val);
+}
+
+static uint64_t get64(HandoffBuf *hb) {
+	uint64_t val = 0;
+	char *buf = getbytes(hb, sizeof(val));
+	if (buf)
+		memcpy(&val, buf, sizeof(val));
+	return (val);
+}
+
+// takes a string from the state, pointing into it. returns NULL for a
+// NULL string or garbage.
+static char *getstr(HandoffBuf *hb) {
+	uint32_t len = get32(hb);
+	char *str;
+
+	if (len == HANDOFF_NONE || hb->bad)
+		return (NULL);
+	str = getbytes(hb, len);
+	if (str == NULL || len == 0 || str[len - 1] != '\0') {
+		hb->bad = 1;
+		return (NULL);
+	}
+	return (str);
+}
+
+// takes a length and that many bytes from the state.
+static char *getblob(HandoffBuf *hb, size_t *len) {
+	*len = get32(hb);
+	return (getbytes(hb, *len));
+}
+
+// takes a descriptor index from the state. returns -1 for none.
+static int getfd(HandoffBuf *hb) {
+	uint32_t idx = get32(hb);
+
+	if (idx == HANDOFF_NONE)
+		return (-1);
+	if (idx >= (uint32_t) hb->nfds) {
+		hb->bad = 1;
+		return (-1);
+	}
+	return (hb->fds[idx]);
+}
+
+// returns the options of the member as HANDOFF_* bits.
+static uint32_t memberflags(Member *memb) {
+	return ((memb->local ? HANDOFF_LOCAL : 0) |
+			(memb->batching ? HANDOFF_BATCHING : 0) |
+			(memb->wantids ? HANDOFF_WANTIDS : 0) |
+			(memb->acking ? HANDOFF_ACKING : 0) |
+			(memb->muxed ? HANDOFF_MUXED : 0) |
+			(memb->relay ? HANDOFF_RELAY : 0) |
+			(memb->closing ? HANDOFF_CLOSING : 0) |
+			(memb->pulling ? HANDOFF_PULLING : 0));
+}
+
+// sets the options of the member from HANDOFF_* bits.
+static void setmemberflags(Member *memb, uint32_t flags) {
+	memb->local = (flags & HANDOFF_LOCAL) != 0;
+	memb->batching = (flags & HANDOFF_BATCHING) != 0;
+	memb->wantids = (flags & HANDOFF_WANTIDS) != 0;
+	memb->acking = (flags & HANDOFF_ACKING) != 0;
+	memb->relay = (flags & HANDOFF_RELAY) != 0;
+	memb->pulling = (flags & HANDOFF_PULLING) != 0;
+}
+
+// writes the client connection, and its sessions, into the state.
+static void savemember(HandoffBuf *hb, Member *memb) {
+	Member *sess;
+	uint32_t i;
+
+	putfd(hb, memb->sock);
+	put32(hb, memberflags(memb));
+	putstr(hb, memb->name);
+	putstr(hb, memb->ipaddr);
+	put32(hb, memb->discard);
+	putblob(hb, memb->inbuf, memb->inlen);
+	putblob(hb, memb->outbuf + memb->outoff, memb->outlen - memb->outoff);
+
+	putfd(hb, memb->shm ? memb->shm->memfd : -1);
+	putfd(hb, memb->shm ? memb->shm->notifyfd : -1);
+	putfd(hb, memb->shm ? memb->shm->peerfd : -1);
+
+	put32(hb, memb->muxed ? memb->nsessions : 0);
+	for (i = 0; memb->muxed && i < memb->sessbuckets; i++) {
+		for (sess = memb->sesstab[i]; sess; sess = sess->hnext) {
+			put32(hb, sess->session);
+			put32(hb, memberflags(sess));
+			putstr(hb, sess->name);
+		}
+	}
+}
+
+// writes the listening sockets, the mail queue and the client connections
+// into the state. nothing is changed.
+static void savestate(HandoffBuf *hb, int servsock, int unixsock,
+		int adminsock) {
+	Member *memb, *last = NULL;
+	size_t countat;
+	uint32_t count, slot;
+	uint64_t mailid;
+	int state;
+	Mail *mail;
+
+	put32(hb, HANDOFF_MAGIC);
+	put32(hb, HANDOFF_VERSION);
+	putfd(hb, servsock);
+	putfd(hb, unixsock);
+	putfd(hb, adminsock);
+	put64(hb, globalmailid);
+
+	// the status history, so senders can still ask about their mail
+	countat = hb->len;
+	put32(hb, 0);
+	for (count = 0, slot = 0; slot < STATUS_HISTORY; slot++) {
+		if ((state = laststatus(slot, &mailid)) == MAIL_UNKNOWN)
+			continue;
+		put64(hb, mailid);
+		put8(hb, state);
+		count++;
+	}
+	memcpy(hb->data + countat, &count, sizeof(count));
+
+	// every mail, oldest first
+	countat = hb->len;
+	put32(hb, 0);
+	for (count = 0, mail = mailagehead; mail; mail = mail->anext, count++) {
+		put64(hb, mail->mailid);
+		put64(hb, mail->queuedat);
+		put8(hb, mail->urgent);
+		put8(hb, mail->mbox == NULL);
+		putstr(hb, mail->name);
+		putstr(hb, mail->ipaddr);
+		putstr(hb, mail->sendername);
+		putstr(hb, mail->senderip);
+		putstr(hb, mail->sender ? mail->sender->ipaddr : "0.0.0.0");
+		putstr(hb, mail->message);
+	}
+	memcpy(hb->data + countat, &count, sizeof(count));
+
+	// client connections, oldest first. sessions go with their connection.
+	for (memb = memblist; memb; memb = memb->next)
+		last = memb;
+	countat = hb->len;
+	put32(hb, 0);
+	for (count = 0, memb = last; memb; memb = memb->prev) {
+		if (memb->mux || memb->peer || memb->admin)
+			continue;
+		savemember(hb, memb);
+		count++;
+	}
+	memcpy(hb->data + countat, &count, sizeof(count));
+}
+
+// puts a client connection handed over back into the member table. a
+// connection which was closing is returned to be closed once the takeover
+// is done, others NULL.
+static Member *restoremember(HandoffBuf *hb) {
+	Member *memb, *sess;
+	uint32_t flags, discard, nsessions, session, sflags;
+	char *name, *ipaddr, *sname, *in, *out;
+	size_t inlen, outlen;
+	int sock, memfd, notifyfd, peerfd;
+	Shm *shm;
+
+	sock = getfd(hb);
+	flags = get32(hb);
+	name = getstr(hb);
+	ipaddr = getstr(hb);
+	discard = get32(hb);
+	in = getblob(hb, &inlen);
+	out = getblob(hb, &outlen);
+	memfd = getfd(hb);
+	notifyfd = getfd(hb);
+	peerfd = getfd(hb);
+	nsessions = get32(hb);
+	if (hb->bad || sock == -1 || ipaddr == NULL) {
+		hb->bad = 1;
+		return (NULL);
+	}
+
+	if (!watchsock(sock, EPOLLIN)) {
+		fprintf(stderr, "error: epoll_ctl: %s\n", strerror(errno));
+		exit(1);
+	}
+	memb = addmember(sock, ipaddr);
+	memb->events = EPOLLIN;
+	setmemberflags(memb, flags);
+	memb->discard = discard;
+	if (inlen)
+		keeppartial(memb, in, inlen);
+	if (outlen)
+		queuetext(memb, out, outlen);
+
+	// a client on shared memory keeps its rings and whatever is in them
+	if (memfd != -1) {
+		shm = shmadopt(memfd, notifyfd, peerfd);
+		if (shm == NULL || !attachshm(memb, shm)) {
+			fprintf(stderr, "error: could not take over shared memory.\n");
+			exit(1);
+		}
+		shmpoke(shm);
+	}
+
+	if (flags & HANDOFF_MUXED)
+		startsessions(memb);
+	while (nsessions-- > 0 && !hb->bad) {
+		session = get32(hb);
+		sflags = get32(hb);
+		sname = getstr(hb);
+		if (!memb->muxed || findsession(memb, session) != NULL) {
+			hb->bad = 1;
+			break;
+		}
+		sess = opensession(memb, session);
+		setmemberflags(sess, sflags);
+		if (sname)
+			updatemember(sess, sname);
+	}
+
+	trackidle(memb);
+	captureopen(memb);
+	if (flags & HANDOFF_CLOSING)
+		return (memb);
+	if (name)
+		updatemember(memb, name);
+	return (NULL);
+}
+
+// puts the status history, the mail queue and the client connections of
+// the state back. listening sockets are returned through the pointers.
+// returns 0 if the state is garbage.
+static int restorestate(HandoffBuf *hb, int *servsock, int *unixsock,
+		int *adminsock) {
+	Member **closing = NULL, *memb;
+	uint32_t count, n, nclosing = 0;
+	uint64_t mailid, queuedat;
+	int urgent, topeer, state;
+	char *name, *ipaddr, *sendername, *senderip, *chargeip, *message;
+
+	if (get32(hb) != HANDOFF_MAGIC || get32(hb) != HANDOFF_VERSION) {
+		fprintf(stderr, "error: the running server is not compatible.\n");
+		return (0);
+	}
+	*servsock = getfd(hb);
+	*unixsock = getfd(hb);
+	*adminsock = getfd(hb);
+	mailid = get64(hb);
+	if (mailid > globalmailid)
+		globalmailid = mailid;
+
+	for (count = get32(hb); count > 0 && !hb->bad; count--) {
+		mailid = get64(hb);
+		state = get8(hb);
+		setstatus(mailid, state);
+	}
+
+	for (count = get32(hb), n = 0; n < count && !hb->bad; n++) {
+		mailid = get64(hb);
+		queuedat = get64(hb);
+		urgent = get8(hb);
+		topeer = get8(hb);
+		name = getstr(hb);
+		ipaddr = getstr(hb);
+		sendername = getstr(hb);
+		senderip = getstr(hb);
+		chargeip = getstr(hb);
+		message = getstr(hb);
+		if (hb->bad || !name || !ipaddr || !chargeip || !message ||
+				(sendername && !senderip))
+			return (0);
+		restoremail(mailid, queuedat, sendername, senderip, chargeip, name,
+				ipaddr, message, urgent, topeer);
+	}
+	printf("took over %u mails.\n", count);
+
+	count = get32(hb);
+	if (!hb->bad && count > 0) {
+		closing = (Member **) calloc(count, sizeof(Member *));
+		if (!closing) {
+			fprintf(stderr, "error : unable to calloc handoff members\n");
+			exit(0);
+		}
+	}
+	for (n = 0; n < count && !hb->bad; n++) {
+		if ((memb = restoremember(hb)) != NULL)
+			closing[nclosing++] = memb;
+	}
+	if (hb->bad || *servsock == -1) {
+		free(closing);
+		return (0);
+	}
+	printf("took over %u clients.\n", count);
+
+	// connections which were closing go on writing their last packets
+	for (n = 0; n < nclosing; n++)
+		lingermember(closing[n]);
+	free(closing);
+	return (1);
+}
+
+// sends the descriptors over the handoff connection, HANDOFF_FDS at a
+// time, each message carrying their number. returns 0 on failure.
+static int sendfds(int sd, int *fds, int nfds) {
+	char cbuf[CMSG_SPACE(HANDOFF_FDS * sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t n;
+
+	do {
+		n = nfds > HANDOFF_FDS ? HANDOFF_FDS : nfds;
+		memset(&msg, 0, sizeof(msg));
+		memset(cbuf, 0, sizeof(cbuf));
+		iov.iov_base = &n;
+		iov.iov_len = sizeof(n);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if (n > 0) {
+			msg.msg_control = cbuf;
+			msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+			cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+			memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+		}
+		if (sendmsg(sd, &msg, MSG_NOSIGNAL) != (ssize_t) sizeof(n))
+			return (0);
+		fds += n;
+		nfds -= n;
+	} while (nfds > 0);
+	return (1);
+}
+
+// receives one message of descriptors sent by sendfds() and appends them.
+// returns 0 on failure.
+static int recvfds(int sd, HandoffBuf *hb) {
+	char cbuf[CMSG_SPACE(HANDOFF_FDS * sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t n = 0;
+	int got = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &n;
+	iov.iov_len = sizeof(n);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(sd, &msg, MSG_CMSG_CLOEXEC) != (ssize_t) sizeof(n) ||
+			(msg.msg_flags & MSG_CTRUNC))
+		return (0);
+
+	if (hb->nfds + HANDOFF_FDS > hb->fdcap) {
+		hb->fdcap = hb->fdcap ? hb->fdcap * 2 : 1024;
+		hb->fds = (int *) realloc(hb->fds, hb->fdcap * sizeof(int));
+		if (!hb->fds) {
+			fprintf(stderr, "error : unable to realloc handoff descriptors\n");
+			exit(0);
+		}
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			got = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(hb->fds + hb->nfds, CMSG_DATA(cmsg), got * sizeof(int));
+			hb->nfds += got;
+		}
+	}
+	return (got == (int) n);
+}
+
+// makes either side give up on the other after HANDOFF_TIMEOUT seconds.
+static void settimeouts(int sd) {
+	struct timeval tv;
+
+	tv.tv_sec = HANDOFF_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// frees the state and its descriptor list, without closing descriptors.
+static void freestate(HandoffBuf *hb) {
+	free(hb->data);
+	free(hb->fds);
+	memset(hb, 0, sizeof(*hb));
+}
+
+// listens for a new server to hand over to at the given path.
+// returns the socket, or -1 on error.
+int starthandoff(char *path) {
+	return (startlocal(path, SOCK_SEQPACKET, S_IRUSR | S_IWUSR, 1));
+}
+
+// hands everything over to the new server connecting on the handoff
+// socket, and exits once it took over. returns 0 if the new server failed,
+// in which case this one goes on serving.
+int handoff(int handsock, int servsock, int unixsock, int adminsock) {
+	HandoffBuf hb;
+	uint32_t total;
+	char ack;
+	int sd, memfd;
+
+	sd = accept4(handsock, NULL, NULL, SOCK_CLOEXEC);
+	if (sd == -1)
+		return (0);
+	settimeouts(sd);
+
+	// fetches waiting for mail are answered, the client fetches again
+	// from the new server. the less output is pending, the less there is
+	// to copy.
+	endfetches();
+	flushall();
+
+	memset(&hb, 0, sizeof(hb));
+	savestate(&hb, servsock, unixsock, adminsock);
+
+	memfd = memfd_create("mailserver-handoff", MFD_CLOEXEC);
+	if (memfd == -1 || write(memfd, hb.data, hb.len) != (ssize_t) hb.len) {
+		MAILLOG("error: could not write handoff state: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	// the memfd goes first, with the number of descriptors to follow
+	total = hb.nfds;
+	if (!sendfds(sd, &memfd, 1) ||
+			send(sd, &total, sizeof(total), MSG_NOSIGNAL) != sizeof(total) ||
+			!sendfds(sd, hb.fds, hb.nfds)) {
+		MAILLOG("error: could not send handoff state: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	// the new server tells us it runs everything now
+	if (recv(sd, &ack, sizeof(ack), 0) != sizeof(ack)) {
+		MAILLOG("error: new server did not take over, going on.\n");
+		goto fail;
+	}
+	printf("handed over %zu bytes of state and %d descriptors, exiting.\n",
+			hb.len, hb.nfds);
+	fflush(stdout);
+	exit(0);
+
+fail:
+	if (memfd != -1)
+		close(memfd);
+	close(sd);
+	freestate(&hb);
+	return (0);
+}
+
+// takes over from a server handing over at the given path, if one runs.
+// its listening sockets are returned through the pointers, -1 if it had
+// none. returns 0 if no server answered; exits if the takeover failed.
+int takeover(char *path, int *servsock, int *unixsock, int *adminsock) {
+	struct sockaddr_un addr;
+	struct stat st;
+	HandoffBuf hb;
+	uint32_t total;
+	char ack = 1;
+	int sd, memfd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return (0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sd == -1)
+		return (0);
+	if (connect(sd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		close(sd);
+		return (0);
+	}
+	settimeouts(sd);
+
+	memset(&hb, 0, sizeof(hb));
+	if (!recvfds(sd, &hb) || hb.nfds != 1 ||
+			recv(sd, &total, sizeof(total), 0) != sizeof(total)) {
+		fprintf(stderr, "error: running server did not hand over.\n");
+		exit(1);
+	}
+	memfd = hb.fds[0];
+	hb.nfds = 0;
+	while ((uint32_t) hb.nfds < total) {
+		if (!recvfds(sd, &hb)) {
+			fprintf(stderr, "error: running server did not hand over.\n");
+			exit(1);
+		}
+	}
+
+	if (fstat(memfd, &st) == -1 || st.st_size == 0) {
+		fprintf(stderr, "error: running server sent no state.\n");
+		exit(1);
+	}
+	hb.len = hb.cap = st.st_size;
+	hb.data = mmap(NULL, hb.len, PROT_READ, MAP_PRIVATE, memfd, 0);
+	if (hb.data == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(memfd);
+
+	if (!restorestate(&hb, servsock, unixsock, adminsock)) {
+		fprintf(stderr, "error: could not take over the running server.\n");
+		exit(1);
+	}
+	munmap(hb.data, hb.len);
+	hb.data = NULL;
+	freestate(&hb);
+
+	// the old server exits once told
+	if (send(sd, &ack, sizeof(ack), MSG_NOSIGNAL) != sizeof(ack)) {
+		fprintf(stderr, "error: running server went away during takeover.\n");
+		exit(1);
+	}
+	close(sd);
+	return (1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,785 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: maillib.c
+// Description: This file contains methods for applications to send and
+//				receive emails without blocking, see maillib.h.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "common.h"
+#include "mailshm.h"
+#include "maillib.h"
+
+// Everything the client sends, requests and protocol alike, is appended
+// to one output buffer as whole packets and written when the transport
+// takes it. The buffer is only emptied once all of it is written, so it
+// always starts at a packet. When the connection goes away, the requests
+// among the packets not fully written are kept in their order and the
+// rest is dropped; the requests before them were written and are given
+// up. A new connection puts the greeting in front of what was kept.
+//
+// The application sees one epoll descriptor per client, which watches
+// the socket and, on shared memory, the eventfd the server wakes us on.
+// It stays the same while the socket underneath comes and goes.
+
+// returns a new client for the given user, calling back onmail with the
+// mails it receives and onevent on the events of its connection. it does
+// not connect until told where to.
+MailClient *mcnew(char *user, MailRecvFn onmail, MailEventFn onevent,
+		void *arg) {
+	MailClient *mc;
+	int i;
+
+	mc = (MailClient *) calloc(1, sizeof(MailClient));
+	if (!mc) {
+		fprintf(stderr, "error : unable to calloc mail client\n");
+		exit(0);
+	}
+	mc->user = strdup(user);
+	mc->onmail = onmail;
+	mc->onevent = onevent;
+	mc->arg = arg;
+	mc->sock = -1;
+	mc->backoff = MC_RETRY_MIN;
+	for (i = 0; i < MC_SEEN_IDS; i++)
+		mc->seenhead[i] = -1;
+
+	mc->pollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (mc->pollfd == -1) {
+		fprintf(stderr, "error : unable to create epoll descriptor\n");
+		exit(0);
+	}
+	return (mc);
+}
+
+// makes room for need more bytes of output.
+static void growout(MailClient *mc, size_t need) {
+	size_t cap;
+
+	if (mc->outlen + need <= mc->outcap)
+		return;
+	cap = mc->outcap ? mc->outcap : 4096;
+	while (cap < mc->outlen + need)
+		cap *= 2;
+	mc->outbuf = (char *) realloc(mc->outbuf, cap);
+	if (!mc->outbuf) {
+		fprintf(stderr, "error : unable to realloc\n");
+		exit(0);
+	}
+	mc->outcap = cap;
+}
+
+// appends a packet to the output.
+static void putpkt(MailClient *mc, uint8_t typ, uint32_t len, char *buf) {
+	uint32_t siz = htonl(len);
+	char *out;
+
+	growout(mc, PKT_HEADER_LEN + len);
+	out = mc->outbuf + mc->outlen;
+	out[0] = typ;
+	memcpy(out + 1, &siz, sizeof(siz));
+	if (len > 0)
+		memcpy(out + PKT_HEADER_LEN, buf, len);
+	mc->outlen += PKT_HEADER_LEN + len;
+}
+
+// remembers a request which waits for its answer.
+static void pushpending(MailClient *mc, MailDoneFn done, void *arg) {
+	MailPending *pend;
+	uint32_t cap, i;
+
+	if (mc->pendcount == mc->pendcap) {
+		cap = mc->pendcap ? mc->pendcap * 2 : 64;
+		pend = (MailPending *) malloc(cap * sizeof(MailPending));
+		if (!pend) {
+			fprintf(stderr, "error : unable to malloc\n");
+			exit(0);
+		}
+		for (i = 0; i < mc->pendcount; i++)
+			pend[i] = mc->pend[(mc->pendfirst + i) % mc->pendcap];
+		free(mc->pend);
+		mc->pend = pend;
+		mc->pendcap = cap;
+		mc->pendfirst = 0;
+	}
+	mc->pend[(mc->pendfirst + mc->pendcount) % mc->pendcap].done = done;
+	mc->pend[(mc->pendfirst + mc->pendcount) % mc->pendcap].arg = arg;
+	mc->pendcount++;
+}
+
+// completes the oldest request with the given answer.
+static void poppending(MailClient *mc, uint64_t mailid, int state,
+		char *error) {
+	MailPending pend;
+
+	if (mc->pendcount == 0)
+		return;
+	pend = mc->pend[mc->pendfirst];
+	mc->pendfirst = (mc->pendfirst + 1) % mc->pendcap;
+	mc->pendcount--;
+	if (pend.done)
+		pend.done(mc, mailid, state, error, pend.arg);
+}
+
+// returns 1 if the mail with given id was already received, and
+// remembers it otherwise.
+static int seenmail(MailClient *mc, uint64_t mailid) {
+	int i, slot;
+	int16_t *head;
+
+	for (i = mc->seenhead[mailid % MC_SEEN_IDS]; i != -1; i = mc->seennext[i]) {
+		if (mc->seenids[i] == mailid)
+			return (1);
+	}
+
+	// the oldest id makes room
+	slot = mc->nextseen;
+	mc->nextseen = (mc->nextseen + 1) % MC_SEEN_IDS;
+	if (mc->seenids[slot] != 0) {
+		head = &mc->seenhead[mc->seenids[slot] % MC_SEEN_IDS];
+		if (*head == slot) {
+			*head = mc->seennext[slot];
+		} else {
+			for (i = *head; mc->seennext[i] != slot; i = mc->seennext[i])
+				;
+			mc->seennext[i] = mc->seennext[slot];
+		}
+	}
+	mc->seenids[slot] = mailid;
+	mc->seennext[slot] = mc->seenhead[mailid % MC_SEEN_IDS];
+	mc->seenhead[mailid % MC_SEEN_IDS] = slot;
+	return (0);
+}
+
+// forgets the ids of the mails received.
+static void forgetseen(MailClient *mc) {
+	int i;
+
+	memset(mc->seenids, 0, sizeof(mc->seenids));
+	for (i = 0; i < MC_SEEN_IDS; i++)
+		mc->seenhead[i] = -1;
+	mc->nextseen = 0;
+}
+
+// watches the socket for what we wait for: the connect, room for output,
+// and input. on shared memory output goes through the rings.
+static void watchsock(MailClient *mc) {
+	struct epoll_event ev;
+	uint32_t events;
+
+	if (mc->sock == -1)
+		return;
+	events = EPOLLIN;
+	if (mc->connecting ||
+			(!mc->shm && !mc->shmwait && mc->outoff < mc->outlen))
+		events |= EPOLLOUT;
+	if (events == mc->events)
+		return;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = mc->sock;
+	epoll_ctl(mc->pollfd, EPOLL_CTL_MOD, mc->sock, &ev);
+	mc->events = events;
+}
+
+// closes the descriptors the server passed along for shared memory, and
+// stops waiting for them.
+static void dropshmfds(MailClient *mc) {
+	while (mc->nshmfds > 0)
+		close(mc->shmfds[--mc->nshmfds]);
+	mc->shmwait = 0;
+}
+
+// ends the connection, and the client with it.
+static void finishclose(MailClient *mc) {
+	uint32_t lost = mc->pendcount;
+
+	if (mc->sock != -1) {
+		epoll_ctl(mc->pollfd, EPOLL_CTL_DEL, mc->sock, NULL);
+		close(mc->sock);
+		mc->sock = -1;
+	}
+	if (mc->shm) {
+		shmclose(mc->shm);
+		mc->shm = NULL;
+	}
+	dropshmfds(mc);
+	mc->closed = 1;
+	mc->up = mc->connecting = 0;
+	while (lost-- > 0)
+		poppending(mc, 0, MC_LOST, "connection closed");
+	if (mc->onevent)
+		mc->onevent(mc, MC_CLOSED, NULL, mc->arg);
+}
+
+// drops the connection, keeps the requests which were not written, and
+// connects again after a while.
+static void godown(MailClient *mc, char *why) {
+	size_t off = 0, end, kept = 0;
+	uint32_t len, nkept = 0, lost;
+	int acklost = 0;
+	uint8_t typ;
+
+	if (mc->sock != -1) {
+		epoll_ctl(mc->pollfd, EPOLL_CTL_DEL, mc->sock, NULL);
+		close(mc->sock);
+		mc->sock = -1;
+	}
+	if (mc->shm) {
+		shmclose(mc->shm);
+		mc->shm = NULL;
+	}
+	dropshmfds(mc);
+	mc->up = mc->connecting = 0;
+	mc->inlen = 0;
+
+	// a request not fully written never reached the server
+	while (off + PKT_HEADER_LEN <= mc->outlen) {
+		typ = mc->outbuf[off];
+		memcpy(&len, mc->outbuf + off + 1, sizeof(len));
+		end = off + PKT_HEADER_LEN + ntohl(len);
+		if (end > mc->outoff && typ == MAIL_ACK)
+			acklost = 1;
+		if (end > mc->outoff && (typ == EMAIL_MSG_TO_SERVER ||
+					typ == URGENT_MSG_TO_SERVER ||
+					(typ == MAIL_STATUS && ntohl(len) == sizeof(uint64_t)))) {
+			memmove(mc->outbuf + kept, mc->outbuf + off, end - off);
+			kept += end - off;
+			nkept++;
+		}
+		off = end;
+	}
+	mc->outlen = kept;
+	mc->outoff = 0;
+
+	// only mails whose acknowledgement was lost come again. the ids of
+	// others may be handed out anew by a server which started afresh.
+	if (!acklost)
+		forgetseen(mc);
+
+	// the others may or may not have been taken
+	lost = mc->pendcount - nkept;
+	while (lost-- > 0)
+		poppending(mc, 0, MC_LOST, "connection lost");
+
+	if (mc->closing) {
+		finishclose(mc);
+		return;
+	}
+	mc->retryat = nowusec() + (uint64_t) mc->backoff * 1000000;
+	mc->backoff = mc->backoff * 2 > MC_RETRY_MAX ? MC_RETRY_MAX : mc->backoff * 2;
+	if (mc->onevent)
+		mc->onevent(mc, MC_DOWN, why, mc->arg);
+}
+
+// puts the greeting in front of the output: we take mail in batches which
+// we acknowledge, want the id of every mail we send, and log in.
+static void sayhello(MailClient *mc) {
+	char *old = mc->outbuf;
+	size_t oldlen = mc->outlen;
+
+	mc->outbuf = NULL;
+	mc->outoff = mc->outlen = mc->outcap = 0;
+	putpkt(mc, MAIL_ACK, 0, NULL);
+	putpkt(mc, MAIL_STATUS, 0, NULL);
+	putpkt(mc, USER_NAME, strlen(mc->user) + 1, mc->user);
+	growout(mc, oldlen);
+	if (oldlen > 0)
+		memcpy(mc->outbuf + mc->outlen, old, oldlen);
+	mc->outlen += oldlen;
+	free(old);
+}
+
+// asks the server to move to shared memory, once connected. the greeting
+// waits until it answered. returns 0 if the connection is gone.
+static int askshm(MailClient *mc) {
+	char pkt[PKT_HEADER_LEN];
+	uint32_t len = 0;
+
+	pkt[0] = SHM_HELLO;
+	memcpy(pkt + 1, &len, sizeof(len));
+	if (write(mc->sock, pkt, sizeof(pkt)) != (ssize_t) sizeof(pkt)) {
+		godown(mc, "unable to ask for shared memory");
+		return (0);
+	}
+	return (1);
+}
+
+// moves to the rings the server answered SHM_HELLO with, and greets it
+// through them.
+static void joinshm(MailClient *mc, char *text, uint32_t len) {
+	struct epoll_event ev;
+
+	mc->shm = shmjoin(mc->sock, mc->shmfds, mc->nshmfds, text, len);
+	mc->nshmfds = 0;
+	mc->shmwait = 0;
+	if (mc->shm == NULL) {
+		godown(mc, "server refused shared memory");
+		return;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = mc->shm->notifyfd;
+	epoll_ctl(mc->pollfd, EPOLL_CTL_ADD, mc->shm->notifyfd, &ev);
+
+	// the server may have written to the rings already, wake up to look
+	shmpoke(mc->shm);
+	sayhello(mc);
+	watchsock(mc);
+}
+
+// opens the connection to the server and greets it. with shared memory
+// the greeting waits until the server handed over the rings.
+static void startconn(MailClient *mc) {
+	struct sockaddr_un un;
+	struct sockaddr_in in;
+	struct epoll_event ev;
+	int sd, optval = 1;
+
+	mc->retryat = 0;
+	if (mc->path) {
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		strncpy(un.sun_path, mc->path, sizeof(un.sun_path) - 1);
+		sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (sd == -1) {
+			godown(mc, strerror(errno));
+			return;
+		}
+
+		// a unix socket whose backlog is full refuses at once rather
+		// than making us wait
+		if (connect(sd, (struct sockaddr *) &un, sizeof(un)) == -1) {
+			if (errno != EINPROGRESS) {
+				close(sd);
+				godown(mc, errno == EAGAIN ? "server is busy" : strerror(errno));
+				return;
+			}
+			mc->connecting = 1;
+		}
+		mc->shmwait = mc->useshm;
+	} else {
+		memset(&in, 0, sizeof(in));
+		in.sin_family = AF_INET;
+		in.sin_port = htons(mc->port);
+		inet_pton(AF_INET, mc->host, &in.sin_addr);
+		sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (sd == -1) {
+			godown(mc, strerror(errno));
+			return;
+		}
+		setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+		if (connect(sd, (struct sockaddr *) &in, sizeof(in)) == -1) {
+			if (errno != EINPROGRESS) {
+				close(sd);
+				godown(mc, strerror(errno));
+				return;
+			}
+			mc->connecting = 1;
+		}
+	}
+
+	mc->sock = sd;
+	mc->events = EPOLLIN | EPOLLOUT;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = mc->events;
+	ev.data.fd = sd;
+	epoll_ctl(mc->pollfd, EPOLL_CTL_ADD, sd, &ev);
+	if (!mc->shmwait)
+		sayhello(mc);
+	else if (!mc->connecting && !askshm(mc))
+		return;
+	watchsock(mc);
+}
+
+// connects the client to the server at the given address and port.
+// returns 0 if the address is not valid.
+int mcconnect(MailClient *mc, char *host, unsigned short port) {
+	struct in_addr in;
+
+	if (inet_pton(AF_INET, host, &in) != 1 || mc->host || mc->path)
+		return (0);
+	mc->host = strdup(host);
+	mc->port = port;
+	startconn(mc);
+	return (1);
+}
+
+// connects the client to a server on this host through its unix socket,
+// moving to shared memory if useshm is set. returns 0 if the path is not
+// valid.
+int mcconnectlocal(MailClient *mc, char *path, int useshm) {
+	struct sockaddr_un un;
+
+	if (strlen(path) >= sizeof(un.sun_path) || mc->host || mc->path)
+		return (0);
+	mc->path = strdup(path);
+	mc->useshm = useshm;
+	startconn(mc);
+	return (1);
+}
+
+// returns the descriptor to watch for reading.
+int mcfd(MailClient *mc) {
+	return (mc->pollfd);
+}
+
+// returns how many milliseconds until mchandle() must be called even if
+// mcfd() is not readable, -1 for no limit.
+int mctimeout(MailClient *mc) {
+	uint64_t now = nowusec();
+
+	if (mc->closed || mc->sock != -1 || mc->retryat == 0)
+		return (-1);
+	if (mc->retryat <= now)
+		return (0);
+	return ((int) ((mc->retryat - now + 999) / 1000));
+}
+
+// takes action on a packet from the server.
+static void takepkt(MailClient *mc, uint8_t typ, char *text, uint32_t len) {
+	uint32_t off = 0, n;
+	uint64_t mailid = 0, last = 0;
+
+	// the server ends its texts with a '\0', make sure they do
+	if (len > 0 && (typ == WELCOME_MSG || typ == EMAIL_MSG_TO_CLIENT ||
+				typ == SERVER_ERROR))
+		text[len - 1] = '\0';
+
+	switch (typ) {
+		case WELCOME_MSG:
+			mc->up = 1;
+			mc->backoff = MC_RETRY_MIN;
+			if (mc->onevent)
+				mc->onevent(mc, MC_WELCOME, len ? text : "", mc->arg);
+			break;
+		case MAIL_BATCH:
+
+			// several mails, each preceded by its id and its length. the
+			// whole batch is acknowledged once taken.
+			while (len - off >= sizeof(mailid) + sizeof(n)) {
+				memcpy(&mailid, text + off, sizeof(mailid));
+				mailid = be64toh(mailid);
+				memcpy(&n, text + off + sizeof(mailid), sizeof(n));
+				n = ntohl(n);
+				off += sizeof(mailid) + sizeof(n);
+				if (n == 0 || n > len - off)
+					break;
+				text[off + n - 1] = '\0';
+				if (!seenmail(mc, mailid) && mc->onmail)
+					mc->onmail(mc, mailid, text + off, mc->arg);
+				off += n;
+				last = mailid;
+			}
+			if (last != 0) {
+				last = htobe64(last);
+				putpkt(mc, MAIL_ACK, sizeof(last), (char *) &last);
+			}
+			break;
+		case EMAIL_MSG_TO_CLIENT:
+			if (mc->onmail)
+				mc->onmail(mc, 0, len ? text : "", mc->arg);
+			break;
+		case MAIL_STATUS:
+			if (len != sizeof(mailid) + 1)
+				break;
+			memcpy(&mailid, text, sizeof(mailid));
+			poppending(mc, be64toh(mailid), (uint8_t) text[sizeof(mailid)], NULL);
+			break;
+		case SERVER_ERROR:
+
+			// a refused mail is answered with the reason, and a refused
+			// SHM_HELLO ends the connection
+			if (mc->shmwait)
+				godown(mc, len ? text : "server refused shared memory");
+			else if (((len > 10 && strncmp(text, "throttled:", 10) == 0) ||
+						(len > 9 && strncmp(text, "filtered:", 9) == 0)) &&
+					mc->pendcount > 0)
+				poppending(mc, 0, MC_REFUSED, text);
+			else if (mc->onevent)
+				mc->onevent(mc, MC_ERROR, len ? text : "", mc->arg);
+			break;
+		case SHM_HELLO:
+			if (mc->shmwait)
+				joinshm(mc, text, len);
+			break;
+		case PING:
+			// the server checks that we are alive
+			putpkt(mc, PONG, 0, NULL);
+			break;
+	}
+}
+
+// reads what arrived on the socket and takes its packets. returns 0 if
+// the connection is gone.
+static int readsock(MailClient *mc) {
+	uint32_t len;
+	size_t used = 0;
+	ssize_t n;
+
+	if (mc->incap - mc->inlen < MC_READ_CHUNK) {
+		mc->incap = mc->incap ? mc->incap * 2 : 2 * MC_READ_CHUNK;
+		mc->inbuf = (char *) realloc(mc->inbuf, mc->incap);
+		if (!mc->inbuf) {
+			fprintf(stderr, "error : unable to realloc\n");
+			exit(0);
+		}
+	}
+	if (mc->shmwait)
+		n = shmrecvfds(mc->sock, mc->inbuf + mc->inlen, mc->incap - mc->inlen,
+				mc->shmfds, &mc->nshmfds);
+	else
+		n = read(mc->sock, mc->inbuf + mc->inlen, mc->incap - mc->inlen);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return (1);
+	if (n <= 0) {
+		godown(mc, n == 0 ? "server closed the connection" : strerror(errno));
+		return (0);
+	}
+
+	// on shared memory the socket only tells us the server went away
+	if (mc->shm)
+		return (1);
+	mc->inlen += n;
+
+	while (mc->inlen - used >= PKT_HEADER_LEN) {
+		memcpy(&len, mc->inbuf + used + 1, sizeof(len));
+		len = ntohl(len);
+		if (len > MC_MAX_FRAME) {
+			godown(mc, "server sent an oversized packet");
+			return (0);
+		}
+		if (mc->inlen - used < PKT_HEADER_LEN + len)
+			break;
+		takepkt(mc, mc->inbuf[used], mc->inbuf + used + PKT_HEADER_LEN, len);
+		used += PKT_HEADER_LEN + len;
+		if (mc->closed || mc->sock == -1)
+			return (0);
+	}
+	memmove(mc->inbuf, mc->inbuf + used, mc->inlen - used);
+	mc->inlen -= used;
+	return (1);
+}
+
+// takes the packets which arrived through the rings, until the server
+// knows to wake us for more.
+static void readshm(MailClient *mc) {
+	Packet *pkt;
+
+	do {
+		while (mc->shm && (pkt = shmrecvpkt(mc->shm, MC_MAX_FRAME)) != NULL) {
+			takepkt(mc, pkt->type, pkt->text, pkt->lent);
+			freepkt(pkt);
+		}
+		if (mc->shm && mc->shm->broken) {
+			godown(mc, "server corrupted the shared memory ring or sent "
+					"an oversized packet");
+			return;
+		}
+	} while (mc->shm && !shmarm(mc->shm));
+}
+
+// writes the output the transport takes. returns 0 if the connection is
+// gone.
+static int writeout(MailClient *mc) {
+	ssize_t n;
+
+	while (mc->outoff < mc->outlen) {
+		if (mc->shm) {
+			n = shmwrite(mc->shm, mc->outbuf + mc->outoff, mc->outlen - mc->outoff);
+			if (n == -1) {
+				godown(mc, "server corrupted the shared memory ring");
+				return (0);
+			}
+			mc->outoff += n;
+
+			// wait to be woken once the server made room
+			if (mc->outoff < mc->outlen && shmwaitroom(mc->shm))
+				break;
+			continue;
+		}
+		n = write(mc->sock, mc->outbuf + mc->outoff, mc->outlen - mc->outoff);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0) {
+			godown(mc, strerror(errno));
+			return (0);
+		}
+		mc->outoff += n;
+	}
+	if (mc->outoff == mc->outlen)
+		mc->outoff = mc->outlen = 0;
+	return (1);
+}
+
+// writes what was queued, as far as the transport takes it now. returns 0
+// if the connection is gone.
+int mcflush(MailClient *mc) {
+	if (mc->sock == -1 || mc->connecting || mc->shmwait)
+		return (mc->sock != -1);
+	if (!writeout(mc))
+		return (0);
+	if (mc->closing && mc->outlen == 0) {
+		finishclose(mc);
+		return (0);
+	}
+	watchsock(mc);
+	return (1);
+}
+
+// does what the connection is ready for: completes the connect, takes
+// what arrived, writes what is queued, and reconnects when it is time.
+// returns 0 once the client is closed.
+int mchandle(MailClient *mc) {
+	struct epoll_event events[2];
+	int n, i, err;
+	socklen_t errlen = sizeof(err);
+
+	if (mc->closed)
+		return (0);
+	if (mc->sock == -1) {
+		if ((mc->host || mc->path) && nowusec() >= mc->retryat)
+			startconn(mc);
+		return (!mc->closed);
+	}
+
+	n = epoll_wait(mc->pollfd, events, 2, 0);
+	for (i = 0; i < n && mc->sock != -1; i++) {
+		if (mc->shm && events[i].data.fd == mc->shm->notifyfd) {
+			shmclearnotify(mc->shm);
+			continue;
+		}
+		if (mc->connecting) {
+			if (getsockopt(mc->sock, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1)
+				err = errno;
+			if (err != 0) {
+				godown(mc, strerror(err));
+				break;
+			}
+			mc->connecting = 0;
+			if (mc->shmwait && !askshm(mc))
+				break;
+			watchsock(mc);
+		}
+		if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			readsock(mc);
+	}
+	if (mc->shm)
+		readshm(mc);
+	mcflush(mc);
+	return (!mc->closed);
+}
+
+// queues a mail with given text to the recipient to, "<user>@<ip-addr>".
+// done is called back with its id once the server took it, or why it did
+// not. returns 0 if the recipient is not valid.
+int mcsubmit(MailClient *mc, char *to, char *text, int urgent,
+		MailDoneFn done, void *arg) {
+	char ip[INET_ADDRSTRLEN];
+	struct in_addr in;
+	char *at;
+	size_t tolen = strlen(to), textlen = strlen(text);
+	uint32_t siz;
+	char *out;
+
+	// the server drops mail it cannot parse without an answer
+	at = strchr(to, '@');
+	if (mc->closing || mc->closed || at == NULL || at == to ||
+			strchr(to, ' ') != NULL || strlen(at + 1) >= sizeof(ip))
+		return (0);
+	strcpy(ip, at + 1);
+	if (inet_pton(AF_INET, ip, &in) != 1)
+		return (0);
+
+	// "<user>@<ip-addr> <text>" and its '\0', written in place
+	siz = htonl(tolen + 1 + textlen + 1);
+	growout(mc, PKT_HEADER_LEN + tolen + 1 + textlen + 1);
+	out = mc->outbuf + mc->outlen;
+	out[0] = urgent ? URGENT_MSG_TO_SERVER : EMAIL_MSG_TO_SERVER;
+	memcpy(out + 1, &siz, sizeof(siz));
+	memcpy(out + PKT_HEADER_LEN, to, tolen);
+	out[PKT_HEADER_LEN + tolen] = ' ';
+	memcpy(out + PKT_HEADER_LEN + tolen + 1, text, textlen + 1);
+	mc->outlen += PKT_HEADER_LEN + tolen + 1 + textlen + 1;
+
+	pushpending(mc, done, arg);
+	watchsock(mc);
+	return (1);
+}
+
+// queues a query of what became of the mail with given id. done is called
+// back with its state. returns 0 if the client is closing.
+int mcstatus(MailClient *mc, uint64_t mailid, MailDoneFn done, void *arg) {
+	uint64_t id = htobe64(mailid);
+
+	if (mc->closing || mc->closed)
+		return (0);
+	putpkt(mc, MAIL_STATUS, sizeof(id), (char *) &id);
+	pushpending(mc, done, arg);
+	watchsock(mc);
+	return (1);
+}
+
+// returns the bytes queued and not yet written.
+size_t mcpending(MailClient *mc) {
+	return (mc->outlen - mc->outoff);
+}
+
+// says goodbye to the server once what is queued is written, and closes
+// the connection. requests still unanswered then complete with MC_LOST.
+void mcclose(MailClient *mc) {
+	if (mc->closing || mc->closed)
+		return;
+	mc->closing = 1;
+	if (mc->sock == -1) {
+		finishclose(mc);
+		return;
+	}
+	putpkt(mc, CLOSE_CON, 0, NULL);
+	watchsock(mc);
+}
+
+// frees the client, closing its connection without a goodbye if it is
+// still open. its callbacks are not called any more.
+void mcfree(MailClient *mc) {
+	if (mc->sock != -1)
+		close(mc->sock);
+	if (mc->shm)
+		shmclose(mc->shm);
+	while (mc->nshmfds > 0)
+		close(mc->shmfds[--mc->nshmfds]);
+	close(mc->pollfd);
+	free(mc->user);
+	free(mc->host);
+	free(mc->path);
+	free(mc->outbuf);
+	free(mc->inbuf);
+	free(mc->pend);
+	free(mc);
+}
+
+///////////////////////////////////////////////////////////////////////////////
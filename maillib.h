@@ -0,0 +1,158 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: maillib.h
+// Description: This file contains the interface of the client library
+//				which talks to the mail server without blocking.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// A MailClient is one user's connection to the server. It never blocks:
+// the application watches mcfd() for reading in its own event loop, along
+// with as many other clients as it likes, and calls mchandle() when it is
+// readable or when mctimeout() runs out. mcfd() stays the same across
+// reconnects and transports.
+//
+// Mails and status queries are pipelined: mcsubmit() and mcstatus() only
+// queue the request, which goes out with the others queued before the
+// next mchandle() or mcflush(). The server answers requests in order, and
+// each answer calls the request's completion callback. Mails received are
+// handed to the receive callback, acknowledged once it returns, and mails
+// the server sends again after a reconnect are dropped by their ids.
+//
+// When the connection goes away the client connects again, waiting
+// longer after each failure. Requests which were not yet written go out
+// on the new connection; the ones written without an answer complete
+// with MC_LOST, since the server may or may not have taken them.
+//
+// Callbacks may queue requests and call mcclose(), but must not free the
+// client.
+
+// reconnect delays
+#define MC_RETRY_MIN     1              // first reconnect delay in seconds
+#define MC_RETRY_MAX     60             // longest reconnect delay in seconds
+
+// buffer limits
+#define MC_READ_CHUNK    65536          // bytes read from the socket at once
+#define MC_MAX_FRAME     (1 << 20)      // largest packet taken from the server
+#define MC_SEEN_IDS      512            // ids of mails received remembered
+
+// states passed to a completion callback besides the MAIL_* states
+#define MC_REFUSED       -1             // the server refused the mail
+#define MC_LOST          -2             // the connection went away first
+
+// events passed to the event callback
+#define MC_WELCOME       1              // the server greeted us, text is its welcome
+#define MC_ERROR         2              // the server reports an error, text says what
+#define MC_DOWN          3              // the connection is gone, text says why
+#define MC_CLOSED        4              // mcclose() finished
+
+typedef struct _mailclient MailClient;
+
+// called with each mail received, its id and its text
+typedef void (*MailRecvFn)(MailClient *mc, uint64_t mailid, char *text,
+		void *arg);
+
+// called when a mail or a status query is answered, with the mail id and
+// its MAIL_* state, or MC_REFUSED and the reason or MC_LOST
+typedef void (*MailDoneFn)(MailClient *mc, uint64_t mailid, int state,
+		char *error, void *arg);
+
+// called on the events of the connection
+typedef void (*MailEventFn)(MailClient *mc, int event, char *text,
+		void *arg);
+
+// a request waiting for its answer
+typedef struct _mailpending {
+	MailDoneFn done;
+	void * arg;
+} MailPending;
+
+// one user's connection to the server
+struct _mailclient {
+
+	// user name, and what to call back with what
+	char * user;
+	MailRecvFn onmail;
+	MailEventFn onevent;
+	void * arg;
+
+	// where the server is: an address and port, or a unix socket path and
+	// whether to move to shared memory there
+	char * host;
+	unsigned short port;
+	char * path;
+	int useshm;
+
+	// epoll descriptor handed to the application, watching the socket and
+	// the shared memory wakeups
+	int pollfd;
+
+	// socket to the server, -1 while down, and the rings once on shared
+	// memory
+	int sock;
+	struct _shm * shm;
+
+	// set while the server has yet to answer SHM_HELLO, and the
+	// descriptors which came with its answer so far
+	int shmwait;
+	int shmfds[3];
+	int nshmfds;
+
+	// events watched on the socket
+	uint32_t events;
+
+	// set while the connect is in progress, once the server greeted us,
+	// while closing and once closed
+	int connecting;
+	int up;
+	int closing;
+	int closed;
+
+	// bytes to write, from outoff to outlen, starting at a packet
+	char * outbuf;
+	size_t outoff;
+	size_t outlen;
+	size_t outcap;
+
+	// bytes read that do not make up a packet yet
+	char * inbuf;
+	size_t inlen;
+	size_t incap;
+
+	// requests waiting for their answers, oldest first
+	MailPending * pend;
+	uint32_t pendfirst;
+	uint32_t pendcount;
+	uint32_t pendcap;
+
+	// when to reconnect, and the current reconnect delay in seconds
+	uint64_t retryat;
+	int backoff;
+
+	// ids of the last mails received, with a hash index on them
+	uint64_t seenids[MC_SEEN_IDS];
+	int16_t seennext[MC_SEEN_IDS];
+	int16_t seenhead[MC_SEEN_IDS];
+	int nextseen;
+};
+
+extern MailClient *mcnew(char *user, MailRecvFn onmail, MailEventFn onevent,
+		void *arg);
+extern int mcconnect(MailClient *mc, char *host, unsigned short port);
+extern int mcconnectlocal(MailClient *mc, char *path, int useshm);
+extern int mcfd(MailClient *mc);
+extern int mctimeout(MailClient *mc);
+extern int mchandle(MailClient *mc);
+extern int mcsubmit(MailClient *mc, char *to, char *text, int urgent,
+		MailDoneFn done, void *arg);
+extern int mcstatus(MailClient *mc, uint64_t mailid, MailDoneFn done,
+		void *arg);
+extern int mcflush(MailClient *mc);
+extern size_t mcpending(MailClient *mc);
+extern void mcclose(MailClient *mc);
+extern void mcfree(MailClient *mc);
+
+///////////////////////////////////////////////////////////////////////////////
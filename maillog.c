@@ -0,0 +1,455 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: maillog.c
+// Description: This file contains methods to log from the event loop
+//				without waiting on the terminal or disk.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include "maillog.h"
+
+// The ring has a single producer, the event loop, and a single consumer,
+// the log thread. The producer owns loghead and the consumer owns logtail;
+// each publishes its index with a release store once it is done with a
+// record, so neither ever takes a lock. Only the event loop thread may
+// call logrecord().
+
+// length modifiers of an argument
+#define LEN_NONE 0
+#define LEN_HH   1
+#define LEN_H    2
+#define LEN_L    3
+#define LEN_LL   4
+#define LEN_Z    5
+#define LEN_J    6
+
+#define LOG_LINE_MAX 1024
+#define LOG_OUT_MAX  65536
+
+// the arguments of one call, as the log thread will format them
+typedef struct _logrecord {
+	LogSite *site;
+	uint64_t time;				// nanoseconds since the epoch
+	uint32_t suppressed;		// records of the site dropped by the burst limit
+	uint16_t textlen;
+	union {
+		intmax_t i;
+		uintmax_t u;
+		double d;
+		void *p;
+		uint16_t str;			// offset of the string in text
+	} args[LOG_MAX_ARGS];
+	char text[LOG_TEXT_MAX];
+} LogRecord;
+
+// Global Variables
+LogRecord logring[LOG_RING_RECORDS];
+
+// indices of the next record to write and to format, on their own cache
+// lines so the two threads do not share one
+_Alignas(64) atomic_uint_fast64_t loghead = 0;
+_Alignas(64) atomic_uint_fast64_t logtail = 0;
+
+// records formatted, suppressed by the burst limit, and lost to a full ring
+_Alignas(64) atomic_uint_fast64_t logwritten = 0;
+atomic_uint_fast64_t logsuppressed = 0;
+atomic_uint_fast64_t logdropped = 0;
+
+atomic_int logstopping = 0;
+pthread_t logthreadid;
+int logstarted = 0;
+
+// formatted lines waiting to be written, only used by the log thread
+char logout[LOG_OUT_MAX];
+size_t logoutlen = 0;
+
+// returns the end of the conversion starting at the '%' at fmt, and its
+// length modifier and conversion character.
+static const char *parsespec(const char *fmt, int *len, char *conv) {
+	fmt++;
+	while (*fmt && strchr("-+ #0'", *fmt))
+		fmt++;
+	while (*fmt >= '0' && *fmt <= '9')
+		fmt++;
+	if (*fmt == '.') {
+		fmt++;
+		while (*fmt >= '0' && *fmt <= '9')
+			fmt++;
+	}
+
+	*len = LEN_NONE;
+	if (fmt[0] == 'h' && fmt[1] == 'h') {
+		*len = LEN_HH;
+		fmt += 2;
+	} else if (fmt[0] == 'l' && fmt[1] == 'l') {
+		*len = LEN_LL;
+		fmt += 2;
+	} else if (*fmt == 'h') {
+		*len = LEN_H;
+		fmt++;
+	} else if (*fmt == 'l') {
+		*len = LEN_L;
+		fmt++;
+	} else if (*fmt == 'z') {
+		*len = LEN_Z;
+		fmt++;
+	} else if (*fmt == 'j') {
+		*len = LEN_J;
+		fmt++;
+	}
+
+	*conv = *fmt;
+	return (*fmt ? fmt + 1 : fmt);
+}
+
+// returns the kind of argument a conversion character takes, or -1.
+static int argkind(char conv) {
+	switch (conv) {
+		case 'd':
+		case 'i':
+		case 'c':
+			return (LOGARG_INT);
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+			return (LOGARG_UINT);
+		case 'f':
+		case 'e':
+		case 'g':
+			return (LOGARG_DOUBLE);
+		case 's':
+			return (LOGARG_STR);
+		case 'p':
+			return (LOGARG_PTR);
+	}
+	return (-1);
+}
+
+// works out the kinds of arguments of a call site from its format, once.
+static void parsesite(LogSite *site) {
+	const char *fmt = site->fmt;
+	int len, kind, n = 0;
+	char conv;
+
+	while ((fmt = strchr(fmt, '%')) != NULL && n < LOG_MAX_ARGS) {
+		if (fmt[1] == '%') {
+			fmt += 2;
+			continue;
+		}
+		fmt = parsespec(fmt, &len, &conv);
+		if ((kind = argkind(conv)) == -1)
+			break;
+		site->kinds[n] = kind;
+		site->lengths[n] = len;
+		n++;
+	}
+	site->nargs = n;
+}
+
+// copies a string argument into the record, cut short if the record is
+// full.
+static uint16_t copystr(LogRecord *rec, const char *str) {
+	uint16_t off = rec->textlen;
+	size_t room = LOG_TEXT_MAX - off;
+	size_t n;
+
+	if (str == NULL)
+		str = "(null)";
+	// the last byte of a full record ends the previous string
+	if (room == 0)
+		return (LOG_TEXT_MAX - 1);
+	n = strnlen(str, room - 1);
+	memcpy(rec->text + off, str, n);
+	rec->text[off + n] = '\0';
+	rec->textlen += n + 1;
+	return (off);
+}
+
+// logs a record for the call site. the arguments are copied into the
+// ring as they are, formatting is left to the log thread.
+void logrecord(LogSite *site, ...) {
+	struct timespec ts;
+	LogRecord *rec;
+	uint64_t head, tail;
+	va_list ap;
+	int i;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	// let each site log a burst a second and count the rest
+	if (site->window != (uint64_t) ts.tv_sec) {
+		site->window = ts.tv_sec;
+		site->burst = 0;
+	}
+	if (site->burst >= LOG_BURST) {
+		site->suppressed++;
+		atomic_fetch_add_explicit(&logsuppressed, 1, memory_order_relaxed);
+		return;
+	}
+
+	head = atomic_load_explicit(&loghead, memory_order_relaxed);
+	tail = atomic_load_explicit(&logtail, memory_order_acquire);
+	if (head - tail == LOG_RING_RECORDS) {
+		atomic_fetch_add_explicit(&logdropped, 1, memory_order_relaxed);
+		return;
+	}
+	site->burst++;
+
+	if (site->nargs < 0)
+		parsesite(site);
+
+	rec = &logring[head & (LOG_RING_RECORDS - 1)];
+	rec->site = site;
+	rec->time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	rec->suppressed = site->suppressed;
+	rec->textlen = 0;
+	site->suppressed = 0;
+
+	va_start(ap, site);
+	for (i = 0; i < site->nargs; i++) {
+		switch (site->kinds[i]) {
+			case LOGARG_INT:
+				switch (site->lengths[i]) {
+					case LEN_L:  rec->args[i].i = va_arg(ap, long); break;
+					case LEN_LL: rec->args[i].i = va_arg(ap, long long); break;
+					case LEN_Z:  rec->args[i].i = va_arg(ap, ssize_t); break;
+					case LEN_J:  rec->args[i].i = va_arg(ap, intmax_t); break;
+					default:     rec->args[i].i = va_arg(ap, int); break;
+				}
+				break;
+			case LOGARG_UINT:
+				switch (site->lengths[i]) {
+					case LEN_L:  rec->args[i].u = va_arg(ap, unsigned long); break;
+					case LEN_LL: rec->args[i].u = va_arg(ap, unsigned long long); break;
+					case LEN_Z:  rec->args[i].u = va_arg(ap, size_t); break;
+					case LEN_J:  rec->args[i].u = va_arg(ap, uintmax_t); break;
+					default:     rec->args[i].u = va_arg(ap, unsigned int); break;
+				}
+				break;
+			case LOGARG_DOUBLE:
+				rec->args[i].d = va_arg(ap, double);
+				break;
+			case LOGARG_STR:
+				rec->args[i].str = copystr(rec, va_arg(ap, const char *));
+				break;
+			case LOGARG_PTR:
+				rec->args[i].p = va_arg(ap, void *);
+				break;
+		}
+	}
+	va_end(ap);
+
+	atomic_store_explicit(&loghead, head + 1, memory_order_release);
+}
+
+// writes the formatted lines to stderr.
+static void flushlog() {
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < logoutlen) {
+		n = write(2, logout + off, logoutlen - off);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		off += n;
+	}
+	logoutlen = 0;
+}
+
+// adds a formatted line to the output.
+static void appendlog(const char *line, size_t len) {
+	if (len > LOG_OUT_MAX - logoutlen)
+		flushlog();
+	if (len > LOG_OUT_MAX)
+		len = LOG_OUT_MAX;
+	memcpy(logout + logoutlen, line, len);
+	logoutlen += len;
+}
+
+// puts the local time of a record at the start of a line, returns its
+// length.
+static int formattime(char *line, size_t size, uint64_t time) {
+	struct tm tm;
+	time_t sec = time / 1000000000;
+	size_t n;
+
+	localtime_r(&sec, &tm);
+	n = strftime(line, size, "%Y-%m-%d %H:%M:%S", &tm);
+	return (n + snprintf(line + n, size - n, ".%03d ",
+				(int) (time / 1000000 % 1000)));
+}
+
+// formats one argument with the conversion spec, returns its length.
+static int formatarg(char *out, size_t size, const char *spec, LogRecord *rec,
+		int i) {
+	LogSite *site = rec->site;
+
+	switch (site->kinds[i]) {
+		case LOGARG_INT:
+			switch (site->lengths[i]) {
+				case LEN_L:  return (snprintf(out, size, spec, (long) rec->args[i].i));
+				case LEN_LL: return (snprintf(out, size, spec, (long long) rec->args[i].i));
+				case LEN_Z:  return (snprintf(out, size, spec, (ssize_t) rec->args[i].i));
+				case LEN_J:  return (snprintf(out, size, spec, rec->args[i].i));
+				default:     return (snprintf(out, size, spec, (int) rec->args[i].i));
+			}
+		case LOGARG_UINT:
+			switch (site->lengths[i]) {
+				case LEN_L:  return (snprintf(out, size, spec, (unsigned long) rec->args[i].u));
+				case LEN_LL: return (snprintf(out, size, spec, (unsigned long long) rec->args[i].u));
+				case LEN_Z:  return (snprintf(out, size, spec, (size_t) rec->args[i].u));
+				case LEN_J:  return (snprintf(out, size, spec, rec->args[i].u));
+				default:     return (snprintf(out, size, spec, (unsigned int) rec->args[i].u));
+			}
+		case LOGARG_DOUBLE:
+			return (snprintf(out, size, spec, rec->args[i].d));
+		case LOGARG_STR:
+			return (snprintf(out, size, spec, rec->text + rec->args[i].str));
+		case LOGARG_PTR:
+			return (snprintf(out, size, spec, rec->args[i].p));
+	}
+	return (0);
+}
+
+// formats a record into the output.
+static void formatrecord(LogRecord *rec) {
+	char line[LOG_LINE_MAX];
+	char spec[32];
+	const char *fmt, *end;
+	size_t n = 0, speclen;
+	int len, i = 0;
+	char conv;
+
+	if (rec->suppressed) {
+		n = formattime(line, sizeof(line), rec->time);
+		n += snprintf(line + n, sizeof(line) - n,
+				"log: %u records like the next one were suppressed.\n",
+				rec->suppressed);
+		appendlog(line, n);
+	}
+
+	n = formattime(line, sizeof(line), rec->time);
+	for (fmt = rec->site->fmt; *fmt && n < sizeof(line) - 1; ) {
+		if (*fmt != '%') {
+			line[n++] = *fmt++;
+			continue;
+		}
+		if (fmt[1] == '%') {
+			line[n++] = '%';
+			fmt += 2;
+			continue;
+		}
+		end = parsespec(fmt, &len, &conv);
+		speclen = end - fmt;
+		if (i >= rec->site->nargs || speclen >= sizeof(spec)) {
+			// more conversions than the record holds, keep them as text
+			line[n++] = *fmt++;
+			continue;
+		}
+		memcpy(spec, fmt, speclen);
+		spec[speclen] = '\0';
+		len = formatarg(line + n, sizeof(line) - n, spec, rec, i++);
+		if (len > 0)
+			n += len;
+		if (n > sizeof(line) - 1)
+			n = sizeof(line) - 1;
+		fmt = end;
+	}
+	appendlog(line, n);
+}
+
+// formats records as they arrive and writes them out. naps while the ring
+// is empty, longer the longer it stays empty.
+static void *logthread(void *arg) {
+	char line[LOG_LINE_MAX];
+	uint64_t head, tail, dropped, reported = 0;
+	useconds_t nap = LOG_IDLE_MIN_USEC;
+	struct timespec ts;
+	int stopping, n;
+
+	while (1) {
+		// read the flag first: once it is set every record is in the ring
+		stopping = atomic_load(&logstopping);
+		head = atomic_load_explicit(&loghead, memory_order_acquire);
+		tail = atomic_load_explicit(&logtail, memory_order_relaxed);
+
+		if (head == tail) {
+			dropped = atomic_load_explicit(&logdropped, memory_order_relaxed);
+			if (dropped != reported) {
+				clock_gettime(CLOCK_REALTIME, &ts);
+				n = formattime(line, sizeof(line),
+						(uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+				n += snprintf(line + n, sizeof(line) - n,
+						"log: %llu records dropped, the log could not keep up.\n",
+						(unsigned long long) (dropped - reported));
+				appendlog(line, n);
+				reported = dropped;
+			}
+			flushlog();
+			if (stopping)
+				break;
+			usleep(nap);
+			nap = nap * 2 > LOG_IDLE_MAX_USEC ? LOG_IDLE_MAX_USEC : nap * 2;
+			continue;
+		}
+
+		nap = LOG_IDLE_MIN_USEC;
+		while (tail != head) {
+			formatrecord(&logring[tail & (LOG_RING_RECORDS - 1)]);
+			tail++;
+			atomic_store_explicit(&logtail, tail, memory_order_release);
+			atomic_fetch_add_explicit(&logwritten, 1, memory_order_relaxed);
+		}
+	}
+	return (NULL);
+}
+
+// starts the log thread. records logged before are kept in the ring.
+void startlog() {
+	if (pthread_create(&logthreadid, NULL, logthread, NULL) != 0) {
+		fprintf(stderr, "error : unable to start log thread\n");
+		exit(0);
+	}
+	logstarted = 1;
+	atexit(stoplog);
+}
+
+// writes out every record logged so far and stops the log thread.
+void stoplog() {
+	if (!logstarted)
+		return;
+	logstarted = 0;
+	atomic_store(&logstopping, 1);
+	pthread_join(logthreadid, NULL);
+}
+
+// displays the counters of the log.
+void listlog() {
+	printf("log records: %llu written, %llu suppressed, %llu dropped\n",
+			(unsigned long long) atomic_load(&logwritten),
+			(unsigned long long) atomic_load(&logsuppressed),
+			(unsigned long long) atomic_load(&logdropped));
+}
+
+///////////////////////////////////////////////////////////////////////////////
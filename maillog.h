@@ -0,0 +1,57 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: maillog.h
+// Description: This file contains the asynchronous logger of the mail
+//				server.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// MAILLOG(fmt, ...) takes a printf style format and its arguments. The
+// event loop only copies the arguments into a binary record of a lock
+// free ring, the log thread formats the records and writes them to
+// stderr. Each call site may log LOG_BURST records a second, the rest are
+// counted and reported with its next record. When the ring is full the
+// record is dropped and counted, the event loop never waits for the log.
+//
+// Formats may use the conversions d i u x X o c s p and f e g, with the
+// length modifiers hh h l ll z j. '*' widths are not supported.
+
+#define LOG_RING_RECORDS 4096		// records in the ring, a power of two
+#define LOG_MAX_ARGS     6			// arguments of a record
+#define LOG_TEXT_MAX     192		// bytes of string arguments of a record
+#define LOG_BURST        10			// records a call site may log a second
+#define LOG_IDLE_MIN_USEC 1000		// log thread naps between checks of
+#define LOG_IDLE_MAX_USEC 50000		// an empty ring
+
+// kinds of arguments
+#define LOGARG_INT    0
+#define LOGARG_UINT   1
+#define LOGARG_DOUBLE 2
+#define LOGARG_STR    3
+#define LOGARG_PTR    4
+
+// a place in the code which logs, with the kinds of its arguments
+typedef struct _logsite {
+	const char *fmt;
+	int nargs;					// -1 until the format is parsed
+	uint8_t kinds[LOG_MAX_ARGS];
+	uint8_t lengths[LOG_MAX_ARGS];
+	uint64_t window;			// second the burst is counted in
+	uint32_t burst;
+	uint32_t suppressed;
+} LogSite;
+
+#define MAILLOG(fmt, ...) do { \
+		static LogSite _logsite = { fmt, -1 }; \
+		logrecord(&_logsite, ##__VA_ARGS__); \
+	} while (0)
+
+extern void startlog();
+extern void stoplog();
+extern void logrecord(LogSite *site, ...);
+extern void listlog();
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,172 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailmux.c
+// Description: This file contains methods to carry the sessions of many
+//				users over one client connection.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "common.h"
+#include "mailserver.h"
+
+// A gateway which proxies many users sends MUX_HELLO after the welcome.
+// The server answers with MUX_HELLO and from then on every frame in both
+// directions carries a session id between its type and its length
+// (MUX_HEADER_LEN bytes of header). Session 0 is the connection itself.
+// Any other session is opened by its USER_NAME and is a member of its own
+// with a name and a mailbox, but without a socket: its packets go into
+// the output buffer of the connection, so mail for all sessions goes out
+// in one write per pass of the event loop. CLOSE_CON on a session ends
+// just that session; the server sends CLOSE_CON on a session it ends by
+// itself. When the connection closes all its sessions end with it.
+
+// returns the bucket of the connection's session table for a session id.
+static uint32_t sessbucket(Member *conn, uint32_t session) {
+	return ((session * 2654435761u) & (conn->sessbuckets - 1));
+}
+
+// find the session with given id on the connection.
+Member *findsession(Member *conn, uint32_t session) {
+	Member *sess;
+
+	if (conn->sesstab == NULL)
+		return (NULL);
+	for (sess = conn->sesstab[sessbucket(conn, session)]; sess; sess = sess->hnext) {
+		if (sess->session == session)
+			return (sess);
+	}
+	return (NULL);
+}
+
+// doubles the session table of the connection.
+static void growsessions(Member *conn) {
+	Member **oldtab = conn->sesstab;
+	uint32_t oldbuckets = conn->sessbuckets;
+	Member *sess, *next;
+	uint32_t i, bucket;
+
+	conn->sessbuckets *= 2;
+	conn->sesstab = (Member **) calloc(conn->sessbuckets, sizeof(Member *));
+	if (!conn->sesstab) {
+		fprintf(stderr, "error : unable to calloc session table\n");
+		exit(0);
+	}
+	for (i = 0; i < oldbuckets; i++) {
+		for (sess = oldtab[i]; sess; sess = next) {
+			next = sess->hnext;
+			bucket = sessbucket(conn, sess->session);
+			sess->hnext = conn->sesstab[bucket];
+			conn->sesstab[bucket] = sess;
+		}
+	}
+	free(oldtab);
+}
+
+// opens a session with given id on the connection. returns NULL, after
+// telling the session why, if the connection has too many.
+Member *opensession(Member *conn, uint32_t session) {
+	Member *sess;
+	uint32_t bucket;
+
+	if (conn->nsessions >= MUX_MAX_SESSIONS) {
+		char bufr[] = "too many sessions on this connection.";
+		queueframe(conn, session, SERVER_ERROR, sizeof(bufr), bufr);
+		return (NULL);
+	}
+	if ((uint32_t) conn->nsessions >= conn->sessbuckets)
+		growsessions(conn);
+
+	sess = newmember(conn->sock, conn->ipaddr);
+	sess->mux = conn;
+	sess->session = session;
+
+	// a gateway which takes batches, acknowledges or pulls mail, does so
+	// on every session
+	sess->batching = conn->batching;
+	sess->acking = conn->acking;
+	sess->pulling = conn->pulling;
+
+	bucket = sessbucket(conn, session);
+	sess->hnext = conn->sesstab[bucket];
+	conn->sesstab[bucket] = sess;
+	conn->nsessions++;
+	return (sess);
+}
+
+// takes the session out of its connection's table.
+void unlinksession(Member *sess) {
+	Member *conn = sess->mux;
+	Member **link;
+
+	for (link = &conn->sesstab[sessbucket(conn, sess->session)]; *link;
+			link = &(*link)->hnext) {
+		if (*link == sess) {
+			*link = sess->hnext;
+			conn->nsessions--;
+			break;
+		}
+	}
+	sess->hnext = NULL;
+}
+
+// ends every session of a connection which is going away.
+void closesessions(Member *conn) {
+	uint32_t i;
+
+	if (conn->sesstab == NULL)
+		return;
+	for (i = 0; i < conn->sessbuckets; i++) {
+		while (conn->sesstab[i] != NULL)
+			removemember(conn->sesstab[i]);
+	}
+}
+
+// resumes delivery to the sessions which were held back while their
+// connection's output buffer was full.
+void resumesessions(Member *conn) {
+	Member *sess;
+	uint32_t i;
+
+	for (i = 0; i < conn->sessbuckets; i++) {
+		for (sess = conn->sesstab[i]; sess; sess = sess->hnext) {
+			if (sess->blocked)
+				resumemailbox(sess);
+		}
+	}
+}
+
+// handles a MUX_HELLO: from now on the connection carries sessions.
+void handlemuxhello(Member *memb) {
+	if (memb->mux || memb->muxed || memb->peer || memb->relay) {
+		char bufr[] = "this connection cannot carry sessions.";
+		queuepkt(memb, SERVER_ERROR, sizeof(bufr), bufr);
+		return;
+	}
+
+	// the answer is the last frame without a session id
+	queuepkt(memb, MUX_HELLO, 0, NULL);
+	startsessions(memb);
+}
+
+// makes the connection carry sessions, with an empty session table.
+void startsessions(Member *conn) {
+	conn->muxed = 1;
+	conn->sessbuckets = MUX_BUCKETS;
+	conn->sesstab = (Member **) calloc(conn->sessbuckets, sizeof(Member *));
+	if (!conn->sesstab) {
+		fprintf(stderr, "error : unable to calloc session table\n");
+		exit(0);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,815 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailnet.c
+// Description: This file contains methods to accept clients and to move
+//				packets to and from their non-blocking sockets.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include "common.h"
+#include "mailserver.h"
+#include "mailshm.h"
+#include "mailtrace.h"
+#include "maillog.h"
+
+// All client sockets are non-blocking and watched by one epoll instance.
+// Packets for a client are appended to its output buffer and written when
+// the event loop calls flushall(), so everything queued for a client in
+// one pass goes out in a single write. Whatever a client sends is read
+// into a stack buffer and cut into packets there; only the tail of a
+// packet that has not fully arrived is kept with the member. In dense mode
+// both buffers are given back once they are empty, see maildense.c.
+//
+// Clients on the same host may connect on the unix socket instead and then
+// move their packets to shared memory, see mailshm.h. Such a member is
+// found in the member table under its socket and under the eventfd its
+// client wakes it on. Its output buffer is copied into a ring rather than
+// written to the socket, and when the ring is full the member waits for
+// its client to make room instead of for EPOLLOUT.
+
+// Global Variables
+int epfd = -1;
+
+// members indexed by socket descriptor
+Member ** membtab = NULL;
+int membtabsize = 0;
+
+// sockets with output waiting for flushall()
+int * flushlist = NULL;
+int flushcount = 0;
+int flushsize = 0;
+
+// spare descriptor, given up to accept and drop a client when out of fds
+int sparefd = -1;
+
+// members by the time they were last heard from, oldest first, and
+// members pinged but not yet answered, by the time of the ping. both lists
+// stay sorted because members are only ever appended with the current
+// time.
+Member * idlehead = NULL;
+Member * idletail = NULL;
+Member * pinghead = NULL;
+Member * pingtail = NULL;
+
+// creates the epoll instance used by the event loop.
+int startreactor() {
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		perror("epoll_create1");
+		return (0);
+	}
+	sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	return (1);
+}
+
+// starts watching the given descriptor for the given events.
+int watchsock(int sd, uint32_t events) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = sd;
+	return (epoll_ctl(epfd, EPOLL_CTL_ADD, sd, &ev) == 0);
+}
+
+// changes the events watched on the member's socket.
+static void rewatchmember(Member *memb, uint32_t events) {
+	struct epoll_event ev;
+
+	if (memb->events == events)
+		return;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = memb->sock;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, memb->sock, &ev) == 0)
+		memb->events = events;
+}
+
+// remembers the member under the given descriptor.
+static void indexfd(int fd, Member *memb) {
+	int size;
+
+	if (fd >= membtabsize) {
+		size = membtabsize ? membtabsize : 1024;
+		while (size <= fd)
+			size *= 2;
+		membtab = (Member **) realloc(membtab, size * sizeof(Member *));
+		if (!membtab) {
+			fprintf(stderr, "error : unable to realloc member table\n");
+			exit(0);
+		}
+		memset(membtab + membtabsize, 0,
+				(size - membtabsize) * sizeof(Member *));
+		membtabsize = size;
+	}
+	membtab[fd] = memb;
+}
+
+// forgets the member under the given descriptor.
+static void unindexfd(int fd, Member *memb) {
+	if (fd < membtabsize && membtab[fd] == memb)
+		membtab[fd] = NULL;
+}
+
+// remembers the member under its socket descriptor.
+void indexmember(Member *memb) {
+	indexfd(memb->sock, memb);
+}
+
+// forgets the member under its socket descriptor.
+void unindexmember(Member *memb) {
+	unindexfd(memb->sock, memb);
+}
+
+// find the member connected on the given socket descriptor.
+Member *lookupmember(int sock) {
+	if (sock < 0 || sock >= membtabsize)
+		return (NULL);
+	return (membtab[sock]);
+}
+
+// returns the number of bytes queued for the member but not yet written.
+// a session shares the output of its connection.
+size_t outpending(Member *memb) {
+	if (memb->mux)
+		memb = memb->mux;
+	return (memb->outlen - memb->outoff);
+}
+
+// makes room for need more bytes at the end of the member's output
+// buffer.
+static void reserveout(Member *memb, size_t need) {
+
+	// reclaim space already written before growing the buffer
+	if (memb->outoff > 0 && memb->outlen + need > memb->outcap) {
+		memmove(memb->outbuf, memb->outbuf + memb->outoff, outpending(memb));
+		memb->outlen -= memb->outoff;
+		memb->outoff = 0;
+	}
+
+	if (memb->outbuf == NULL && need <= OUTBUF_INITIAL) {
+		memb->outbuf = takebuf(OUTBUF_INITIAL);
+		memb->outcap = OUTBUF_INITIAL;
+	}
+	if (memb->outlen + need > memb->outcap) {
+		size_t cap = memb->outcap ? memb->outcap : OUTBUF_INITIAL;
+		while (cap < memb->outlen + need)
+			cap *= 2;
+		memb->outbuf = (char *) realloc(memb->outbuf, cap);
+		if (!memb->outbuf) {
+			fprintf(stderr, "error : unable to realloc output buffer\n");
+			exit(0);
+		}
+		memb->outcap = cap;
+	}
+}
+
+// puts the member on the flush list unless it is already there.
+static void markflush(Member *memb) {
+	if (!memb->flushing) {
+		memb->flushing = 1;
+		if (flushcount == flushsize) {
+			flushsize = flushsize ? flushsize * 2 : 1024;
+			flushlist = (int *) realloc(flushlist, flushsize * sizeof(int));
+			if (!flushlist) {
+				fprintf(stderr, "error : unable to realloc flush list\n");
+				exit(0);
+			}
+		}
+		flushlist[flushcount++] = memb->sock;
+	}
+}
+
+// appends the header of a packet for the given session to the
+// connection's output buffer, with room for len bytes of text after it.
+// it is written by the next flushall(), together with everything else
+// queued on the connection. the session id is only written once the
+// connection carries sessions. returns where the text goes, which stays
+// valid until more is queued on the connection, or NULL if the connection
+// is already going away.
+static char *reserveframe(Member *conn, uint32_t session, uint8_t typ,
+		uint32_t len) {
+	size_t hdr, need;
+	uint32_t siz;
+	char *out;
+
+	if (conn->closing)
+		return (NULL);
+
+	MAILPROBE(sendpkt, conn->sock, typ, len);
+	hdr = conn->muxed ? MUX_HEADER_LEN : PKT_HEADER_LEN;
+	need = hdr + len;
+	reserveout(conn, need);
+
+	// write type, session, lent and text
+	out = conn->outbuf + conn->outlen;
+	out[0] = typ;
+	if (conn->muxed) {
+		siz = htonl(session);
+		memcpy(out + sizeof(typ), &siz, sizeof(siz));
+	}
+	siz = htonl(len);
+	memcpy(out + hdr - sizeof(siz), &siz, sizeof(siz));
+	conn->outlen += need;
+	markflush(conn);
+	return (out + hdr);
+}
+
+// appends a packet for the given session to the connection's output
+// buffer. returns 0 if the connection is already going away.
+int queueframe(Member *conn, uint32_t session, uint8_t typ, uint32_t len,
+		char *buf) {
+	char *text;
+
+	text = reserveframe(conn, session, typ, len);
+	if (text == NULL)
+		return (0);
+	if (len > 0)
+		memcpy(text, buf, len);
+	return (1);
+}
+
+// appends a packet to the member's output buffer, or to the connection of
+// a session. returns 0 if the member is already going away.
+int queuepkt(Member *memb, uint8_t typ, uint32_t len, char *buf) {
+	if (memb->mux)
+		return (queueframe(memb->mux, memb->session, typ, len, buf));
+	return (queueframe(memb, 0, typ, len, buf));
+}
+
+// appends the header of a packet to the member's output buffer, or to the
+// connection of a session, and returns where its len bytes of text go so
+// that the caller can fill them in place. returns NULL if the member is
+// already going away.
+char *reservepkt(Member *memb, uint8_t typ, uint32_t len) {
+	if (memb->mux)
+		return (reserveframe(memb->mux, memb->session, typ, len));
+	return (reserveframe(memb, 0, typ, len));
+}
+
+// appends unframed text to the member's output buffer, for connections
+// which do not speak packets. returns 0 if the member is going away.
+int queuetext(Member *memb, char *buf, size_t len) {
+	if (memb->closing)
+		return (0);
+	reserveout(memb, len);
+	memcpy(memb->outbuf + memb->outlen, buf, len);
+	memb->outlen += len;
+	markflush(memb);
+	return (1);
+}
+
+// writes as much of the member's output buffer as the socket, or the ring
+// of a member on shared memory, takes. returns 0 if the member is gone.
+int flushmember(Member *memb) {
+	ssize_t n;
+
+	memb->flushing = 0;
+	while (outpending(memb) > 0) {
+		if (memb->shm) {
+			n = shmwrite(memb->shm, memb->outbuf + memb->outoff,
+					outpending(memb));
+			if (n == -1) {
+				MAILLOG("error: %s@%s corrupted its shared memory ring.\n",
+						memb->name ? memb->name : "unknown", memb->ipaddr);
+				closemember(memb);
+				return (0);
+			}
+			if (n > 0) {
+				memb->outoff += n;
+				tracewritten(memb, n);
+				continue;
+			}
+			// shmevent() flushes again once the client made room
+			if (shmwaitroom(memb->shm))
+				return (1);
+			continue;
+		}
+		n = write(memb->sock, memb->outbuf + memb->outoff, outpending(memb));
+		if (n > 0) {
+			memb->outoff += n;
+			tracewritten(memb, n);
+			continue;
+		}
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// a small send buffer is widened before waiting on it
+			if (config.dense && densebusy(memb))
+				continue;
+			// wait until the socket can take more
+			rewatchmember(memb, memb->closing ? EPOLLOUT : EPOLLIN | EPOLLOUT);
+			return (1);
+		}
+		closemember(memb);
+		return (0);
+	}
+
+	memb->outoff = memb->outlen = 0;
+	if (config.dense) {
+		givebuf(memb->outbuf, memb->outcap);
+		memb->outbuf = NULL;
+		memb->outcap = 0;
+	}
+	if (memb->closing) {
+		closemember(memb);
+		return (0);
+	}
+	rewatchmember(memb, EPOLLIN);
+
+	// the scheduler holds back mail while the buffer is full
+	if (memb->blocked)
+		resumemailbox(memb);
+	return (1);
+}
+
+// writes the output of every member that had packets queued since the
+// last call.
+void flushall() {
+	Member *memb;
+	int i;
+
+	// flushing may queue more packets, so walk the list by index
+	for (i = 0; i < flushcount; i++) {
+		memb = lookupmember(flushlist[i]);
+		if (memb && memb->flushing)
+			flushmember(memb);
+	}
+	flushcount = 0;
+}
+
+// closes the member's connection once its queued output is written. mail
+// is no longer delivered to it. a session is told it is closed and ends
+// right away.
+void lingermember(Member *memb) {
+	if (memb->mux) {
+		queuepkt(memb, CLOSE_CON, 0, NULL);
+		removemember(memb);
+		return;
+	}
+	detachmailbox(memb);
+	closesessions(memb);
+	memb->closing = 1;
+
+	// only a hangup matters on the socket of a member on shared memory
+	rewatchmember(memb, memb->shm ? 0 : EPOLLOUT);
+	if (!memb->flushing)
+		flushmember(memb);
+}
+
+// takes the member off the idle or the ping list.
+void untrackidle(Member *memb) {
+	Member **head = memb->pingsent ? &pinghead : &idlehead;
+	Member **tail = memb->pingsent ? &pingtail : &idletail;
+
+	if (memb->iprev == NULL && *head != memb)
+		return;
+	if (memb->inext)
+		memb->inext->iprev = memb->iprev;
+	else
+		*tail = memb->iprev;
+	if (memb->iprev)
+		memb->iprev->inext = memb->inext;
+	else
+		*head = memb->inext;
+	memb->inext = memb->iprev = NULL;
+}
+
+// appends the member to the given list.
+static void appendidle(Member *memb, Member **head, Member **tail) {
+	memb->inext = NULL;
+	memb->iprev = *tail;
+	if (*tail)
+		(*tail)->inext = memb;
+	else
+		*head = memb;
+	*tail = memb;
+}
+
+// notes that the client was just heard from.
+void trackidle(Member *memb) {
+	// admin connections are not pinged, they do not speak packets
+	if (config.idletimeout == 0 || memb->admin)
+		return;
+	untrackidle(memb);
+	memb->pingsent = 0;
+	memb->lastseen = nowusec();
+	appendidle(memb, &idlehead, &idletail);
+}
+
+// pings members which have been silent for idletimeout seconds and evicts
+// members which did not answer a ping within pongtimeout seconds.
+void checkidle() {
+	uint64_t now, idle, pong;
+	Member *memb;
+
+	if (config.idletimeout == 0)
+		return;
+	now = nowusec();
+	idle = (uint64_t) config.idletimeout * 1000000;
+	pong = (uint64_t) config.pongtimeout * 1000000;
+
+	while ((memb = pinghead) != NULL && now - memb->pingsent >= pong) {
+		MAILLOG("error: %s@%s did not answer ping, evicting.\n",
+				memb->name ? memb->name : "unknown", memb->ipaddr);
+		closemember(memb);
+	}
+
+	while ((memb = idlehead) != NULL && now - memb->lastseen >= idle) {
+		untrackidle(memb);
+		memb->pingsent = now;
+		appendidle(memb, &pinghead, &pingtail);
+		queuepkt(memb, PING, 0, NULL);
+	}
+}
+
+// returns how many milliseconds may pass before checkidle() has work, or
+// -1 if there is nothing to watch.
+int idletimeout() {
+	uint64_t now, due, wait = UINT64_MAX;
+
+	if (config.idletimeout == 0)
+		return (-1);
+	now = nowusec();
+	if (pinghead) {
+		due = pinghead->pingsent + (uint64_t) config.pongtimeout * 1000000;
+		wait = due > now ? due - now : 0;
+	}
+	if (idlehead) {
+		due = idlehead->lastseen + (uint64_t) config.idletimeout * 1000000;
+		due = due > now ? due - now : 0;
+		if (due < wait)
+			wait = due;
+	}
+	if (wait == UINT64_MAX)
+		return (-1);
+	return ((int) ((wait + 999) / 1000));
+}
+
+// stores the unread tail of a packet with the member.
+void keeppartial(Member *memb, char *data, size_t len) {
+	if (memb->inbuf == NULL && len <= INBUF_INITIAL) {
+		memb->inbuf = takebuf(INBUF_INITIAL);
+		memb->incap = INBUF_INITIAL;
+	}
+	if (memb->inlen + len > memb->incap) {
+		size_t cap = memb->incap ? memb->incap : INBUF_INITIAL;
+		while (cap < memb->inlen + len)
+			cap *= 2;
+		memb->inbuf = (char *) realloc(memb->inbuf, cap);
+		if (!memb->inbuf) {
+			fprintf(stderr, "error : unable to realloc input buffer\n");
+			exit(0);
+		}
+		memb->incap = cap;
+	}
+	memcpy(memb->inbuf + memb->inlen, data, len);
+	memb->inlen += len;
+}
+
+// drops the first used bytes kept with the member. in dense mode the
+// buffer is given back once it is empty.
+void dropinput(Member *memb, size_t used) {
+	memmove(memb->inbuf, memb->inbuf + used, memb->inlen - used);
+	memb->inlen -= used;
+	if (config.dense && memb->inlen == 0) {
+		givebuf(memb->inbuf, memb->incap);
+		memb->inbuf = NULL;
+		memb->incap = 0;
+	}
+}
+
+// cuts the given bytes into packets and hands each one to handlepkt(),
+// on behalf of its session if the connection carries sessions. returns
+// the number of bytes used, or -1 if the member is gone.
+static ssize_t parsepkts(Member *memb, char *data, size_t len) {
+	size_t used = 0, hdr;
+	uint32_t lent, limit, session = 0;
+	Member *target;
+	Packet *pkt;
+
+	while (used < len) {
+
+		// skip the text of a refused packet
+		if (memb->discard > 0) {
+			size_t skip = len - used < memb->discard ? len - used : memb->discard;
+			memb->discard -= skip;
+			used += skip;
+			continue;
+		}
+
+		// wait for the type, the session and the length
+		hdr = memb->muxed ? MUX_HEADER_LEN : PKT_HEADER_LEN;
+		if (len - used < hdr)
+			break;
+		if (memb->muxed) {
+			memcpy(&session, data + used + 1, sizeof(session));
+			session = ntohl(session);
+		}
+		memcpy(&lent, data + used + hdr - sizeof(lent), sizeof(lent));
+		lent = ntohl(lent);
+
+		// refuse oversized packets without reading them into memory.
+		// relay batches from peer servers may be larger.
+		limit = memb->relay ? PEER_MAX_FRAME : maxpktlen;
+		if (lent > limit) {
+			char bufr[MAXPKTLEN];
+			snprintf(bufr, sizeof(bufr),
+					"throttled: packet longer than %u bytes. retry after %d seconds.",
+					limit, config.retryafter);
+			queueframe(memb, session, SERVER_ERROR, strlen(bufr) + 1, bufr);
+			memb->discard = lent;
+			used += hdr;
+			continue;
+		}
+
+		// wait for the text
+		if (len - used < hdr + lent)
+			break;
+
+		pkt = (Packet *) calloc(1, sizeof(Packet));
+		if (!pkt) {
+			fprintf(stderr, "error : unable to calloc\n");
+			exit(0);
+		}
+		pkt->type = (uint8_t) data[used];
+		pkt->lent = lent;
+		if (lent > 0) {
+			pkt->text = (char *) malloc(lent + 1);
+			if (!pkt->text) {
+				fprintf(stderr, "error : unable to malloc\n");
+				exit(0);
+			}
+			memcpy(pkt->text, data + used + hdr, lent);
+			pkt->text[lent] = '\0';
+		}
+		used += hdr + lent;
+		MAILPROBE(recvpkt, memb->sock, pkt->type, pkt->lent);
+		if (memb->connid)
+			captureframe(memb, session, pkt->type, pkt->text, lent);
+
+		// a session starts with its login
+		target = memb;
+		if (session != 0) {
+			target = findsession(memb, session);
+			if (target == NULL && pkt->type == USER_NAME)
+				target = opensession(memb, session);
+			if (target == NULL) {
+				// opensession() explains itself when it refuses a session
+				char bufr[] = "no such session.";
+				if (pkt->type != USER_NAME)
+					queueframe(memb, session, SERVER_ERROR, sizeof(bufr), bufr);
+				freepkt(pkt);
+				continue;
+			}
+		}
+
+		// whatever happens to a session, its connection goes on
+		if (!handlepkt(target, pkt) && target == memb)
+			return (-1);
+		if (memb->closing)
+			return (len);
+	}
+	return (used);
+}
+
+// hands every complete packet in the bytes the client sent to handlepkt(),
+// or every command line of an admin connection to parseadmin(). returns 0
+// if the member is gone.
+static int takeinput(Member *memb, char *buf, size_t n) {
+	ssize_t used;
+	ssize_t (*parse)(Member *, char *, size_t);
+
+	trackidle(memb);
+	tracereceive();
+	parse = memb->admin ? parseadmin : parsepkts;
+
+	if (memb->inlen == 0) {
+		// common case: parse straight out of the stack buffer
+		used = parse(memb, buf, n);
+		if (used < 0)
+			return (0);
+		if (used < n && !memb->closing)
+			keeppartial(memb, buf + used, n - used);
+		return (1);
+	}
+
+	// complete the packet left over from the last read
+	keeppartial(memb, buf, n);
+	used = parse(memb, memb->inbuf, memb->inlen);
+	if (used < 0)
+		return (0);
+	dropinput(memb, used);
+	return (1);
+}
+
+// reads what the client sent and takes its packets. returns 0 if the
+// member is gone.
+int readmember(Member *memb) {
+	char buf[READ_CHUNK];
+	ssize_t n;
+
+	n = read(memb->sock, buf, sizeof(buf));
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return (1);
+	if (n <= 0) {
+		closemember(memb);
+		return (0);
+	}
+	if (config.busypoll)
+		quickack(memb);
+	return (takeinput(memb, buf, n));
+}
+
+// handles a SHM_HELLO: a client on the unix socket moves its packets to
+// shared memory. everything queued so far must be on the socket before
+// the answer, so the client sees it first. returns 0 if the member is gone.
+int handleshmhello(Member *memb) {
+	char *why = NULL;
+	Shm *shm = NULL;
+
+	if (!memb->local || memb->shm || memb->mux || memb->muxed ||
+			memb->peer || memb->relay)
+		why = "shared memory is only for clients on the unix socket.";
+	else if (!flushmember(memb))
+		return (0);
+	else if (outpending(memb) > 0)
+		why = "shared memory not available while output is pending.";
+	else if ((shm = shmcreate()) == NULL)
+		why = "shared memory not available.";
+	else if (!shmsendhello(memb->sock, shm))
+		why = "shared memory not available.";
+	if (why) {
+		if (shm)
+			shmclose(shm);
+		queuepkt(memb, SERVER_ERROR, strlen(why) + 1, why);
+		return (1);
+	}
+
+	// the client has its rings now, there is no way back to the socket
+	if (!attachshm(memb, shm)) {
+		closemember(memb);
+		return (0);
+	}
+	return (1);
+}
+
+// moves the member to the given rings and starts watching the eventfd its
+// client wakes it on. returns 0 if the eventfd cannot be watched.
+int attachshm(Member *memb, Shm *shm) {
+	memb->shm = shm;
+	if (!watchsock(shm->notifyfd, EPOLLIN)) {
+		MAILLOG("epoll_ctl: %s\n", strerror(errno));
+		return (0);
+	}
+	indexfd(shm->notifyfd, memb);
+	return (1);
+}
+
+// handles a wakeup of a member on shared memory: its client wrote packets
+// or made room for ours. a busy client gets at most SHM_CHUNKS reads per
+// wakeup and then waits for its turn like everyone else. returns 0 if the
+// member is gone.
+int shmevent(Member *memb) {
+	char buf[READ_CHUNK];
+	ssize_t n;
+	int i;
+
+	shmclearnotify(memb->shm);
+	for (i = 0; i < SHM_CHUNKS && !memb->closing; i++) {
+		n = shmread(memb->shm, buf, sizeof(buf));
+		if (n == -1) {
+			MAILLOG("error: %s@%s corrupted its shared memory ring.\n",
+					memb->name ? memb->name : "unknown", memb->ipaddr);
+			closemember(memb);
+			return (0);
+		}
+		if (n == 0)
+			break;
+		if (!takeinput(memb, buf, n))
+			return (0);
+	}
+
+	// come back right away if the client wrote more meanwhile
+	if (!memb->closing && !shmarm(memb->shm))
+		shmpoke(memb->shm);
+	if (outpending(memb) > 0)
+		return (flushmember(memb));
+	return (1);
+}
+
+// gives up the rings of a member on shared memory which is going away.
+void dropshm(Member *memb) {
+	unindexfd(memb->shm->notifyfd, memb);
+	shmclose(memb->shm);
+	memb->shm = NULL;
+}
+
+// sets the options every client socket gets. TCP keepalive, if enabled,
+// catches dead peers even when heartbeats are turned off.
+static void tunesock(int sd) {
+	int optval = 1;
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+	if (config.keepalive > 0) {
+		int idle = config.keepalive;
+		int intvl = config.keepalive / KEEPALIVE_PROBES > 0 ?
+			config.keepalive / KEEPALIVE_PROBES : 1;
+		int cnt = KEEPALIVE_PROBES;
+		setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
+		setsockopt(sd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+		setsockopt(sd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+		setsockopt(sd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+	}
+	if (config.busypoll)
+		busysock(sd);
+}
+
+// accepts every pending connection on the listening TCP or unix socket, up
+// to ACCEPT_BATCH per call. each new client is queued a welcome message.
+// clients on the unix socket are on this host and get its loopback
+// address.
+int acceptclients(int servsock) {
+	struct sockaddr_storage remoteaddr;
+	socklen_t addrlen;
+	char str[INET_ADDRSTRLEN];
+	char bufr[MAXPKTLEN];
+	Member *memb;
+	int csd, accepted;
+
+	for (accepted = 0; accepted < ACCEPT_BATCH; accepted++) {
+		addrlen = sizeof remoteaddr;
+		csd = accept4(servsock, (struct sockaddr *) &remoteaddr, &addrlen,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (csd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if ((errno == EMFILE || errno == ENFILE) && sparefd != -1) {
+				// out of descriptors: drop the client instead of spinning
+				// on a listening socket that stays readable.
+				close(sparefd);
+				csd = accept(servsock, NULL, NULL);
+				if (csd != -1)
+					close(csd);
+				sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+				MAILLOG("error: out of file descriptors, dropped a client.\n");
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				MAILLOG("accept: %s\n", strerror(errno));
+			break;
+		}
+
+		MAILPROBE(accept, csd);
+		if (remoteaddr.ss_family == AF_INET)
+			tunesock(csd);
+		if (config.dense)
+			densesock(csd);
+		if (!watchsock(csd, EPOLLIN)) {
+			MAILLOG("epoll_ctl: %s\n", strerror(errno));
+			close(csd);
+			continue;
+		}
+
+		if (remoteaddr.ss_family == AF_INET)
+			inet_ntop(AF_INET, &((struct sockaddr_in *) &remoteaddr)->sin_addr,
+					str, INET_ADDRSTRLEN);
+		else
+			strcpy(str, "127.0.0.1");
+
+		// Add client to member list. We will update member name later.
+		memb = addmember(csd, str);
+		memb->local = remoteaddr.ss_family == AF_UNIX;
+		memb->events = EPOLLIN;
+		trackidle(memb);
+		captureopen(memb);
+
+		snprintf(bufr, sizeof(bufr),
+				"Welcome to Santosh\'s Email Server, running on port %hu.",
+				config.port);
+		queuepkt(memb, WELCOME_MSG, strlen(bufr) + 1, bufr);
+	}
+	return (accepted);
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,516 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailpeer.c
+// Description: This file contains methods to relay emails addressed to
+//				ip-address ranges served by peer mail servers.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "common.h"
+#include "mailserver.h"
+#include "maillog.h"
+
+// A route sends mail for an ip-address range to a peer server. Each peer
+// has one persistent connection, opened like a client connection that
+// introduces itself with PEER_HELLO. Mail for the peer waits in its queue
+// and is sent in RELAY_BATCH packets of up to RELAY_BATCH_MAILS mails;
+// the peer answers each batch with a RELAY_ACK carrying its sequence
+// number. Mail stays charged to its sender until it is acknowledged. When
+// the connection drops, unacknowledged batches go back to the head of the
+// queue and the connection is retried with exponential backoff.
+
+// an ip-address range
+typedef struct _cidr {
+	uint32_t net;
+	uint32_t mask;
+	int bits;
+} Cidr;
+
+// a range routed to a peer
+typedef struct _route {
+	Cidr range;
+	Peer * peer;
+} Route;
+
+// Global Variables
+Peer * peerlist = NULL;
+Route * routes = NULL;
+int nroutes = 0;
+Cidr * relayfrom = NULL;
+int nrelayfrom = 0;
+
+// parses "a.b.c.d/n" into a range. a missing /n means a single address.
+// returns 0 if invalid.
+static int parsecidr(char *str, Cidr *cidr) {
+	char buf[INET_ADDRSTRLEN + 4];
+	struct in_addr in;
+	char *slash, *end;
+	long bits = 32;
+
+	if (strlen(str) >= sizeof(buf))
+		return (0);
+	strcpy(buf, str);
+	if ((slash = strchr(buf, '/')) != NULL) {
+		*slash = '\0';
+		bits = strtol(slash + 1, &end, 10);
+		if (end == slash + 1 || *end != '\0' || bits < 0 || bits > 32)
+			return (0);
+	}
+	if (inet_pton(AF_INET, buf, &in) != 1)
+		return (0);
+
+	cidr->bits = bits;
+	cidr->mask = bits == 0 ? 0 : htonl(0xffffffffu << (32 - bits));
+	cidr->net = in.s_addr & cidr->mask;
+	return (1);
+}
+
+// checks whether the ip-address lies in the range.
+static int incidr(Cidr *cidr, char *ip) {
+	struct in_addr in;
+
+	if (inet_pton(AF_INET, ip, &in) != 1)
+		return (0);
+	return ((in.s_addr & cidr->mask) == cidr->net);
+}
+
+// adds a route given as "<range>=<ip-addr>:<port>". routes are kept
+// longest prefix first. returns 0 if invalid.
+int addroute(char *spec) {
+	char buf[MAXNAMELEN];
+	char *eq, *colon, *end;
+	struct in_addr in;
+	long port;
+	Cidr range;
+	Peer *peer;
+	int i;
+
+	if (strlen(spec) >= sizeof(buf))
+		return (0);
+	strcpy(buf, spec);
+	if ((eq = strchr(buf, '=')) == NULL || (colon = strchr(eq, ':')) == NULL)
+		return (0);
+	*eq = '\0';
+	*colon = '\0';
+	port = strtol(colon + 1, &end, 10);
+	if (!parsecidr(buf, &range) || inet_pton(AF_INET, eq + 1, &in) != 1 ||
+			end == colon + 1 || *end != '\0' || port <= 0 || port > 65535)
+		return (0);
+
+	// routes to the same server share its connection
+	for (peer = peerlist; peer; peer = peer->next) {
+		if (strcmp(peer->address, eq + 1) == 0 && peer->port == port)
+			break;
+	}
+	if (peer == NULL) {
+		peer = (Peer *) calloc(1, sizeof(Peer));
+		if (!peer) {
+			fprintf(stderr, "error : unable to calloc peer\n");
+			exit(0);
+		}
+		peer->address = strdup(eq + 1);
+		peer->port = port;
+		peer->backoff = PEER_RETRY_MIN;
+		peer->next = peerlist;
+		peerlist = peer;
+	}
+
+	routes = (Route *) realloc(routes, (nroutes + 1) * sizeof(Route));
+	if (!routes) {
+		fprintf(stderr, "error : unable to realloc routes\n");
+		exit(0);
+	}
+	for (i = nroutes; i > 0 && routes[i - 1].range.bits < range.bits; i--)
+		routes[i] = routes[i - 1];
+	routes[i].range = range;
+	routes[i].peer = peer;
+	nroutes++;
+	return (1);
+}
+
+// allows peers in the given range to relay mail to us. returns 0 if
+// invalid.
+int addrelayfrom(char *spec) {
+	Cidr range;
+
+	if (!parsecidr(spec, &range))
+		return (0);
+	relayfrom = (Cidr *) realloc(relayfrom, (nrelayfrom + 1) * sizeof(Cidr));
+	if (!relayfrom) {
+		fprintf(stderr, "error : unable to realloc relay ranges\n");
+		exit(0);
+	}
+	relayfrom[nrelayfrom++] = range;
+	return (1);
+}
+
+// find the peer serving the given ip-address, NULL if it is ours.
+Peer *findroute(char *ip) {
+	int i;
+
+	for (i = 0; i < nroutes; i++) {
+		if (incidr(&routes[i].range, ip))
+			return (routes[i].peer);
+	}
+	return (NULL);
+}
+
+// appends the mail to the tail of the list.
+static void appendmail(Mail **head, Mail **tail, Mail *mail) {
+	mail->next = NULL;
+	mail->prev = *tail;
+	if (*tail)
+		(*tail)->next = mail;
+	else
+		*head = mail;
+	*tail = mail;
+}
+
+// queues the mail for the peer. it goes out with the next batch.
+void relaymail(Peer *peer, Mail *mail) {
+	mail->mbox = NULL;
+	appendmail(&peer->head, &peer->tail, mail);
+	peer->queued++;
+}
+
+// opens the connection to the peer and introduces us.
+static void connectpeer(Peer *peer) {
+	struct sockaddr_in address;
+	Member *memb;
+	int sd;
+
+	sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd == -1) {
+		MAILLOG("socket: %s\n", strerror(errno));
+		return;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(peer->port);
+	inet_pton(AF_INET, peer->address, &address.sin_addr);
+
+	if (connect(sd, (struct sockaddr *) &address, sizeof(address)) == -1 &&
+			errno != EINPROGRESS) {
+		close(sd);
+		peer->retryat = nowusec() + (uint64_t) peer->backoff * 1000000;
+		return;
+	}
+	if (!watchsock(sd, EPOLLIN)) {
+		MAILLOG("epoll_ctl: %s\n", strerror(errno));
+		close(sd);
+		return;
+	}
+
+	// the connection is a member like any client, but never logs in
+	memb = addmember(sd, peer->address);
+	memb->events = EPOLLIN;
+	memb->peer = peer;
+	peer->link = memb;
+	trackidle(memb);
+
+	// queued packets are written once the connect completes
+	queuepkt(memb, PEER_HELLO, 0, NULL);
+}
+
+// puts unacknowledged mail of a peer whose connection went away back on
+// its queue and schedules a reconnect.
+void peerdown(Member *memb) {
+	Peer *peer = memb->peer;
+
+	if (peer == NULL || peer->link != memb)
+		return;
+	peer->link = NULL;
+	memb->peer = NULL;
+
+	if (peer->sent) {
+		peer->senttail->next = peer->head;
+		if (peer->head)
+			peer->head->prev = peer->senttail;
+		else
+			peer->tail = peer->senttail;
+		peer->head = peer->sent;
+		peer->queued += peer->inflight;
+		peer->sent = peer->senttail = NULL;
+		peer->inflight = 0;
+	}
+	peer->batches = 0;
+
+	if (!peer->acked)
+		peer->backoff = peer->backoff * 2 > PEER_RETRY_MAX ?
+			PEER_RETRY_MAX : peer->backoff * 2;
+	peer->acked = 0;
+	peer->retryat = nowusec() + (uint64_t) peer->backoff * 1000000;
+	MAILLOG("error: lost peer %s:%hu, %d mails requeued, retry in %d seconds.\n",
+			peer->address, peer->port, peer->queued, peer->backoff);
+}
+
+// opens connections to peers which are down and due for a retry.
+void checkpeers() {
+	uint64_t now = nowusec();
+	Peer *peer;
+
+	for (peer = peerlist; peer; peer = peer->next) {
+		if (peer->link == NULL && peer->retryat <= now)
+			connectpeer(peer);
+	}
+}
+
+// returns how many milliseconds may pass before a peer is due for a
+// retry, or -1 if none is.
+int peertimeout() {
+	uint64_t now = nowusec(), wait = UINT64_MAX;
+	Peer *peer;
+
+	for (peer = peerlist; peer; peer = peer->next) {
+		if (peer->link == NULL) {
+			uint64_t due = peer->retryat > now ? peer->retryat - now : 0;
+			if (due < wait)
+				wait = due;
+		}
+	}
+	if (wait == UINT64_MAX)
+		return (-1);
+	return ((int) ((wait + 999) / 1000));
+}
+
+// appends a string with its terminator to the batch.
+static size_t putstr(char *buf, size_t off, char *str) {
+	size_t len = strlen(str) + 1;
+	memcpy(buf + off, str, len);
+	return (off + len);
+}
+
+// returns the bytes the mail takes in a batch.
+static size_t recordsize(Mail *mail) {
+	return (1 + strlen(mail->message) + strlen(mail->name) +
+			strlen(mail->ipaddr) + 5 +
+			(mail->sendername ? strlen(mail->sendername) + strlen(mail->senderip) : 0));
+}
+
+// sends a batch of queued mail to the peer. returns 0 if there was
+// nothing to send.
+static int sendbatch(Peer *peer) {
+	char *buf;
+	size_t off, len;
+	uint32_t val;
+	int count, i;
+	Mail *mail;
+
+	// size up the batch: seq and count, then one record per mail
+	len = 2 * sizeof(uint32_t);
+	count = 0;
+	for (mail = peer->head; mail && count < RELAY_BATCH_MAILS; mail = mail->next) {
+		if (count > 0 && len + recordsize(mail) > RELAY_BATCH_BYTES)
+			break;
+		len += recordsize(mail);
+		count++;
+	}
+	if (count == 0)
+		return (0);
+
+	buf = (char *) malloc(len);
+	if (!buf) {
+		fprintf(stderr, "error : unable to malloc batch\n");
+		exit(0);
+	}
+	val = htonl(peer->nextseq);
+	memcpy(buf, &val, sizeof(val));
+	val = htonl(count);
+	memcpy(buf + sizeof(val), &val, sizeof(val));
+
+	// urgent, sender, sender ip, recipient, recipient ip, message
+	off = 2 * sizeof(uint32_t);
+	for (i = 0; i < count; i++) {
+		mail = peer->head;
+		buf[off++] = mail->urgent ? 1 : 0;
+		off = putstr(buf, off, mail->sendername ? mail->sendername : "");
+		off = putstr(buf, off, mail->senderip ? mail->senderip : "");
+		off = putstr(buf, off, mail->name);
+		off = putstr(buf, off, mail->ipaddr);
+		off = putstr(buf, off, mail->message);
+
+		// move the mail to the list waiting for the ack
+		peer->head = mail->next;
+		if (peer->head)
+			peer->head->prev = NULL;
+		else
+			peer->tail = NULL;
+		peer->queued--;
+		mail->relayseq = peer->nextseq;
+		appendmail(&peer->sent, &peer->senttail, mail);
+		peer->inflight++;
+	}
+
+	queuepkt(peer->link, RELAY_BATCH, off, buf);
+	peer->nextseq++;
+	peer->batches++;
+	free(buf);
+	return (1);
+}
+
+// sends queued mail to every connected peer, keeping at most PEER_WINDOW
+// batches unacknowledged per peer.
+void relaymails() {
+	Peer *peer;
+
+	for (peer = peerlist; peer; peer = peer->next) {
+		while (peer->link && !peer->link->closing && peer->head &&
+				peer->batches < PEER_WINDOW &&
+				outpending(peer->link) < OUTBUF_HIGHWATER) {
+			if (!sendbatch(peer))
+				break;
+		}
+	}
+}
+
+// handles a RELAY_ACK from the peer: every batch up to the acknowledged
+// one has been queued there, so its mail is done with.
+void handlerelayack(Member *memb, Packet *pkt) {
+	Peer *peer = memb->peer;
+	uint32_t seq;
+	Mail *mail;
+
+	if (peer == NULL || pkt->lent < sizeof(seq)) {
+		MAILLOG("error: unexpected relay ack.\n");
+		return;
+	}
+	memcpy(&seq, pkt->text, sizeof(seq));
+	seq = ntohl(seq);
+
+	while ((mail = peer->sent) != NULL && (int32_t) (seq - mail->relayseq) >= 0) {
+		peer->sent = mail->next;
+		if (peer->sent)
+			peer->sent->prev = NULL;
+		else
+			peer->senttail = NULL;
+		peer->inflight--;
+		refundmail(mail);
+		mail->delivered = 1;
+		freemail(mail);
+	}
+	peer->batches = (int32_t) (peer->nextseq - seq - 1);
+	if (peer->batches < 0)
+		peer->batches = 0;
+
+	// a working connection resets the backoff
+	peer->acked = 1;
+	peer->backoff = PEER_RETRY_MIN;
+}
+
+// handles a PEER_HELLO: the connection is a peer server which may relay
+// mail to us if its address is allowed. returns 0 if it is refused.
+int handlepeerhello(Member *memb) {
+	int i;
+
+	for (i = 0; i < nrelayfrom; i++) {
+		if (incidr(&relayfrom[i], memb->ipaddr)) {
+			memb->relay = 1;
+			return (1);
+		}
+	}
+
+	MAILLOG("error: relay from %s not allowed.\n", memb->ipaddr);
+	char bufr[MAXPKTLEN] = "relaying from this address is not allowed.";
+	queuepkt(memb, SERVER_ERROR, strlen(bufr) + 1, bufr);
+	lingermember(memb);
+	return (0);
+}
+
+// returns the string at off in the batch and moves off past it, or NULL
+// if the batch ends first.
+static char *getstr(Packet *pkt, uint32_t *off) {
+	char *str = pkt->text + *off;
+	char *end;
+
+	if (*off >= pkt->lent)
+		return (NULL);
+	end = memchr(str, '\0', pkt->lent - *off);
+	if (end == NULL)
+		return (NULL);
+	*off += end - str + 1;
+	return (str);
+}
+
+// handles a RELAY_BATCH from a peer: queues its mail here and acks it.
+void handlerelay(Member *memb, Packet *pkt) {
+	char *sendername, *senderip, *name, *ipaddr, *mailmsg;
+	char why[MAXPKTLEN];
+	uint32_t seq, count, off, i;
+	int urgent;
+
+	if (!memb->relay || pkt->lent < 2 * sizeof(uint32_t)) {
+		MAILLOG("error: unexpected relay batch from %s.\n", memb->ipaddr);
+		return;
+	}
+	memcpy(&seq, pkt->text, sizeof(seq));
+	memcpy(&count, pkt->text + sizeof(seq), sizeof(count));
+	seq = ntohl(seq);
+	count = ntohl(count);
+
+	off = 2 * sizeof(uint32_t);
+	for (i = 0; i < count; i++) {
+		if (off >= pkt->lent)
+			break;
+		urgent = pkt->text[off++];
+		sendername = getstr(pkt, &off);
+		senderip = getstr(pkt, &off);
+		name = getstr(pkt, &off);
+		ipaddr = getstr(pkt, &off);
+		mailmsg = getstr(pkt, &off);
+		if (mailmsg == NULL) {
+			MAILLOG("error: malformed relay batch from %s.\n", memb->ipaddr);
+			break;
+		}
+		if (sendername[0] == '\0')
+			sendername = NULL;
+
+		// the original sender is charged, or the peer if it is unknown.
+		// mail over quota is dropped since the peer cannot take it back.
+		if (!admitmail(sendername ? senderip : memb->ipaddr, name, ipaddr,
+					mailcost(sendername, senderip, name, ipaddr, mailmsg),
+					why, sizeof(why))) {
+			MAILLOG("error: relayed mail dropped, %s\n", why);
+			continue;
+		}
+		addmailfrom(sendername, senderip, sendername ? senderip : memb->ipaddr,
+				name, ipaddr, mailmsg, urgent, 1);
+	}
+
+	seq = htonl(seq);
+	queuepkt(memb, RELAY_ACK, sizeof(seq), (char *) &seq);
+}
+
+// displays the peers and how much mail each one holds.
+void listpeers() {
+	Peer *peer;
+
+	if (peerlist == NULL)
+		return;
+	printf("================\nList of peers\n================\n");
+	for (peer = peerlist; peer; peer = peer->next) {
+		printf("%s:%hu %s, %d queued, %d unacknowledged\n", peer->address,
+				peer->port, peer->link ? "connected" : "down",
+				peer->queued, peer->inflight);
+	}
+	printf("================\n");
+}
+
+///////////////////////////////////////////////////////////////////////////////
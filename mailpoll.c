@@ -0,0 +1,163 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailpoll.c
+// Description: This file contains methods to run the event loop in
+//				busy-poll mode, trading a core for lower latency.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "common.h"
+#include "mailserver.h"
+#include "mailtrace.h"
+#include "maillog.h"
+
+// In busy-poll mode the event loop owns a core. It is pinned to it and
+// never sleeps: epoll is polled without a timeout, so a packet is taken
+// as soon as the kernel has it rather than after a wakeup. The log and
+// capture threads are started before the pinning and keep running on the
+// other cores. Client sockets ask the kernel to busy poll the device
+// queue when a read finds nothing (SO_BUSY_POLL), and to acknowledge what
+// they receive at once rather than delay the ACK (TCP_QUICKACK, which the
+// kernel turns off again, so it is set after every read). Mail for a
+// connected recipient is delivered as soon as it is queued instead of at
+// the next sweep.
+//
+// To check what this buys, every mail delivered as it is queued is timed
+// until its connection's output has drained at the end of a pass of the
+// event loop, and 'stats' shows the percentiles.
+
+// a mail handed to a connection, waiting for the connection's output to
+// drain
+typedef struct _pollstamp {
+	Member * conn;
+	uint64_t queued;
+} PollStamp;
+
+// Global Variables
+PollStamp * pollstamps = NULL;
+int npollstamps = 0;
+int cappollstamps = 0;
+
+// nanoseconds from queued to written of the mails delivered as queued
+Histogram pollhist;
+
+// cleared once the kernel refused SO_BUSY_POLL
+int busypolled = 1;
+
+// pins the event loop to the configured cpu. returns 0 if it cannot be.
+int startbusypoll() {
+	cpu_set_t cpus;
+
+	if (config.busycpu >= CPU_SETSIZE) {
+		fprintf(stderr, "error: no cpu %d.\n", config.busycpu);
+		return (0);
+	}
+	CPU_ZERO(&cpus);
+	CPU_SET(config.busycpu, &cpus);
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+		perror("sched_setaffinity");
+		return (0);
+	}
+	printf("busy poll: event loop pinned to cpu %d.\n", config.busycpu);
+	return (1);
+}
+
+// sets the busy-poll options of a client TCP socket. raising SO_BUSY_POLL
+// above net.core.busy_read takes CAP_NET_ADMIN; without it the loop still
+// spins, only the reads do not poll the device.
+void busysock(int sd) {
+	int usec = BUSY_POLL_USEC, on = 1;
+
+	if (busypolled && setsockopt(sd, SOL_SOCKET, SO_BUSY_POLL, &usec,
+				sizeof(usec)) == -1) {
+		busypolled = 0;
+		MAILLOG("warning: SO_BUSY_POLL refused, %s.\n", strerror(errno));
+	}
+	setsockopt(sd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+}
+
+// asks for the next ACK of the member's socket to go out at once.
+void quickack(Member *memb) {
+	int on = 1;
+
+	if (!memb->local)
+		setsockopt(memb->sock, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+}
+
+// notes that a mail queued at the given time, in nanoseconds, was handed
+// to the member.
+void pollattempt(Member *memb, uint64_t queued) {
+	if (npollstamps == cappollstamps) {
+		cappollstamps = cappollstamps ? cappollstamps * 2 : 256;
+		pollstamps = (PollStamp *) realloc(pollstamps,
+				cappollstamps * sizeof(PollStamp));
+		if (!pollstamps) {
+			fprintf(stderr, "error : unable to realloc poll stamps\n");
+			exit(0);
+		}
+	}
+	pollstamps[npollstamps].conn = memb->mux ? memb->mux : memb;
+	pollstamps[npollstamps].queued = queued;
+	npollstamps++;
+}
+
+// times the mails whose connections have written all their output.
+void pollwritten() {
+	uint64_t now;
+	int i, kept = 0;
+
+	if (npollstamps == 0)
+		return;
+	now = nownsec();
+	for (i = 0; i < npollstamps; i++) {
+		if (outpending(pollstamps[i].conn) == 0)
+			histrecord(&pollhist, now - pollstamps[i].queued);
+		else
+			pollstamps[kept++] = pollstamps[i];
+	}
+	npollstamps = kept;
+}
+
+// forgets the mails handed to a member which is going away.
+void pollforget(Member *memb) {
+	int i, kept = 0;
+
+	for (i = 0; i < npollstamps; i++) {
+		if (pollstamps[i].conn != memb)
+			pollstamps[kept++] = pollstamps[i];
+	}
+	npollstamps = kept;
+}
+
+// displays the latency of the mails delivered as they were queued.
+void listpollstats() {
+	if (!config.busypoll)
+		return;
+	printf("busy poll: cpu %d, SO_BUSY_POLL %s\n", config.busycpu,
+			busypolled ? "on" : "refused");
+	printf("busy poll queued -> written (usec): %llu mails, p50 %.1f, "
+			"p99 %.1f, p999 %.1f, max %.1f\n",
+			(unsigned long long) pollhist.total,
+			histpercentile(&pollhist, 50) / 1000.0,
+			histpercentile(&pollhist, 99) / 1000.0,
+			histpercentile(&pollhist, 99.9) / 1000.0,
+			pollhist.max / 1000.0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
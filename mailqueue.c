@@ -0,0 +1,988 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailqueue.c
+// Description: This file contains methods to queue pending emails per
+//				recipient and to schedule their delivery.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include "common.h"
+#include "mailserver.h"
+#include "mailtrace.h"
+
+// Every recipient (name@ip) has a mailbox holding its pending mail in
+// arrival order. Mailboxes whose recipient is connected and which have
+// mail waiting sit on the ready ring. A sweep walks the ring in deficit
+// round robin order: each visit credits the mailbox DRR_QUANTUM bytes and
+// delivers mails from its head while the credit covers them, so a
+// recipient with a large backlog cannot starve the others. Urgent mail is
+// delivered as soon as the recipient is reachable and never waits for a
+// sweep.
+//
+// The text a recipient receives is serialized into the mail's frame once,
+// when the mail is queued for a mailbox. A client which sent MAIL_BATCH
+// gets the mails of one visit together in a single MAIL_BATCH packet,
+// each frame preceded by its length, assembled in place in the output
+// buffer so the whole batch goes out in the next write. Each entry of a
+// batch carries the mail's id.
+//
+// A client which sent MAIL_ACK always gets batches and acknowledges each
+// one with the id of its last mail. Its mails are not freed once written
+// but wait on the mailbox's sent list, still charged to the quotas, until
+// an acknowledgement covers them. At most config.window mails wait like
+// that; a mailbox with a full window leaves the ready ring until the next
+// acknowledgement. When the recipient goes away its unacknowledged mails
+// go back to the head of the mailbox, in their old order, and are sent
+// again on its next login. The client drops the ones it has already seen
+// by their ids.
+//
+// A client which sent an empty MAIL_FETCH pulls its mail instead: nothing
+// is pushed to it, and each MAIL_FETCH names a cursor, the id of the last
+// mail it took, and gets the mails after it as one MAIL_BATCH of at most
+// the count and bytes it asked for. The cursor acknowledges the mails up
+// to it; whatever was fetched after it is fetched again, so a page lost
+// with the connection is not lost with it. A fetch finding nothing waits,
+// up to the time it asked for, on a list ordered by deadline and is
+// answered by the next mail for the mailbox, or empty when its time is up.
+//
+// Mail ids are 64-bit and only ever grow. Every mail in the server is in
+// a hash table by id. Since ids are handed out in sequence, the low bits
+// spread them evenly over the buckets, and the table doubles when it holds
+// more mails than buckets. When a mail leaves the server its id and fate
+// are written to a ring of the last STATUS_HISTORY outcomes, so a sender
+// asking about a mail gets its state from the table or the ring.
+
+// Global Variables
+Mailbox * mailboxlist = NULL;
+Mailbox * mailboxtab[MAILBOX_BUCKETS];
+Mailbox * readyring = NULL;
+uint64_t globalmailid = 0;
+
+// every mail in the server by id
+Mail ** mailidtab = NULL;
+uint64_t mailidbuckets = 0;
+uint64_t mailidcount = 0;
+
+// what became of a mail which left the server, kept under its id modulo
+// STATUS_HISTORY
+typedef struct _mailstatus {
+	uint64_t mailid;
+	int state;
+} MailStatus;
+MailStatus statushistory[STATUS_HISTORY];
+
+// every mail in the server, whether in a mailbox or waiting for a peer,
+// oldest first
+Mail * mailagehead = NULL;
+Mail * mailagetail = NULL;
+
+// members with a fetch waiting for mail, soonest deadline first
+Member * fetchhead = NULL;
+Member * fetchtail = NULL;
+
+// in busy-poll mode, the mail being queued and when, in nanoseconds
+Mail * busymail = NULL;
+uint64_t busyat = 0;
+
+// hash a recipient name and ip into a mailbox bucket.
+static unsigned int hashnameip(char *name, char *ip) {
+	unsigned int h = 5381;
+	for (; *name; name++)
+		h = (h * 33) ^ (unsigned char) *name;
+	h = (h * 33) ^ '@';
+	for (; *ip; ip++)
+		h = (h * 33) ^ (unsigned char) *ip;
+	return (h % MAILBOX_BUCKETS);
+}
+
+// find the mailbox of the given recipient.
+Mailbox *findmailbox(char *name, char *ip) {
+	Mailbox *mbox;
+	for (mbox = mailboxtab[hashnameip(name, ip)]; mbox; mbox = mbox->hnext) {
+		if ((strcmp(mbox->name, name) == 0) && (strcmp(mbox->ipaddr, ip) == 0))
+			return (mbox);
+	}
+	return (NULL);
+}
+
+// find the mailbox of the given recipient, creating it if needed.
+static Mailbox *getmailbox(char *name, char *ip) {
+	Mailbox *mbox;
+	unsigned int bucket;
+
+	if ((mbox = findmailbox(name, ip)) != NULL)
+		return (mbox);
+
+	mbox = (Mailbox *) calloc(1, sizeof(Mailbox));
+	if (!mbox) {
+		fprintf(stderr, "error : unable to calloc mailbox\n");
+		exit(0);
+	}
+	mbox->name = strdup(name);
+	mbox->ipaddr = strdup(ip);
+
+	bucket = hashnameip(name, ip);
+	mbox->hnext = mailboxtab[bucket];
+	if (mailboxtab[bucket])
+		mailboxtab[bucket]->hprev = mbox;
+	mailboxtab[bucket] = mbox;
+
+	mbox->next = mailboxlist;
+	if (mailboxlist)
+		mailboxlist->prev = mbox;
+	mailboxlist = mbox;
+	return (mbox);
+}
+
+// returns 1 if the mailbox's recipient has as many unacknowledged mails
+// as it may have.
+static int windowfull(Mailbox *mbox) {
+	return (mbox->memb && mbox->memb->acking && mbox->inflight >= config.window);
+}
+
+// returns 1 if mail is pushed to the mailbox's recipient, which is not the
+// case for one which pulls its mail.
+static int pushing(Mailbox *mbox) {
+	return (mbox->memb && !mbox->memb->pulling);
+}
+
+// put the mailbox on the ready ring, just behind the current position so
+// that mailboxes already waiting are served first.
+static void markready(Mailbox *mbox) {
+	if (mbox->ready || windowfull(mbox) || !pushing(mbox))
+		return;
+	mbox->ready = 1;
+	mbox->deficit = 0;
+	if (readyring == NULL) {
+		mbox->rnext = mbox->rprev = mbox;
+		readyring = mbox;
+	} else {
+		mbox->rnext = readyring;
+		mbox->rprev = readyring->rprev;
+		readyring->rprev->rnext = mbox;
+		readyring->rprev = mbox;
+	}
+}
+
+// take the mailbox off the ready ring.
+static void unmarkready(Mailbox *mbox) {
+	if (!mbox->ready)
+		return;
+	mbox->ready = 0;
+	mbox->deficit = 0;
+	if (mbox->rnext == mbox) {
+		readyring = NULL;
+	} else {
+		mbox->rprev->rnext = mbox->rnext;
+		mbox->rnext->rprev = mbox->rprev;
+		if (readyring == mbox)
+			readyring = mbox->rnext;
+	}
+	mbox->rnext = mbox->rprev = NULL;
+}
+
+// free the mailbox once it has no mail and no connected recipient.
+static void releasemailbox(Mailbox *mbox) {
+	if (mbox->count > 0 || mbox->inflight > 0 || mbox->memb != NULL)
+		return;
+
+	unmarkready(mbox);
+
+	if (mbox->hnext)
+		mbox->hnext->hprev = mbox->hprev;
+	if (mbox->hprev)
+		mbox->hprev->hnext = mbox->hnext;
+	else
+		mailboxtab[hashnameip(mbox->name, mbox->ipaddr)] = mbox->hnext;
+
+	if (mbox->next)
+		mbox->next->prev = mbox->prev;
+	if (mbox->prev)
+		mbox->prev->next = mbox->next;
+	else
+		mailboxlist = mbox->next;
+
+	free(mbox->name);
+	free(mbox->ipaddr);
+	free(mbox);
+}
+
+// append the mail to the tail of its class in the mailbox.
+static void enqueuemail(Mailbox *mbox, Mail *mail) {
+	Mail **head = mail->urgent ? &mbox->urgenthead : &mbox->head;
+	Mail **tail = mail->urgent ? &mbox->urgenttail : &mbox->tail;
+
+	mail->mbox = mbox;
+	mail->next = NULL;
+	mail->prev = *tail;
+	if (*tail)
+		(*tail)->next = mail;
+	else
+		*head = mail;
+	*tail = mail;
+	mbox->count++;
+
+	if (mbox->memb && !mbox->memb->blocked)
+		markready(mbox);
+}
+
+// put the mail back at the head of its class in the mailbox.
+static void requeuemail(Mailbox *mbox, Mail *mail) {
+	Mail **head = mail->urgent ? &mbox->urgenthead : &mbox->head;
+	Mail **tail = mail->urgent ? &mbox->urgenttail : &mbox->tail;
+
+	mail->prev = NULL;
+	mail->next = *head;
+	if (*head)
+		(*head)->prev = mail;
+	else
+		*tail = mail;
+	*head = mail;
+	mbox->count++;
+}
+
+// unlink the mail from the queues of its mailbox. it stays charged to the
+// quotas and owned by the mailbox.
+static void unqueuemail(Mail *mail) {
+	Mailbox *mbox = mail->mbox;
+	Mail **head = mail->urgent ? &mbox->urgenthead : &mbox->head;
+	Mail **tail = mail->urgent ? &mbox->urgenttail : &mbox->tail;
+
+	adminunlinkmail(mail, ADMIN_BY_RCPT);
+	if (mail->next)
+		mail->next->prev = mail->prev;
+	else
+		*tail = mail->prev;
+	if (mail->prev)
+		mail->prev->next = mail->next;
+	else
+		*head = mail->next;
+	mbox->count--;
+
+	if (mbox->count == 0)
+		unmarkready(mbox);
+}
+
+// unlink the mail from its mailbox.
+static void dequeuemail(Mail *mail) {
+	unqueuemail(mail);
+	refundmail(mail);
+	mail->mbox = NULL;
+}
+
+// moves the mail from the queues to the end of the mailbox's sent list,
+// where it waits for its recipient's acknowledgement.
+static void sentmail(Mail *mail) {
+	Mailbox *mbox = mail->mbox;
+
+	unqueuemail(mail);
+	mail->inflight = 1;
+	mail->next = NULL;
+	mail->prev = mbox->senttail;
+	if (mbox->senttail)
+		mbox->senttail->next = mail;
+	else
+		mbox->sent = mail;
+	mbox->senttail = mail;
+	mbox->inflight++;
+}
+
+// returns the mail delivered after the given one, urgent mail first.
+static Mail *nextdelivery(Mailbox *mbox, Mail *mail, int urgentonly) {
+	if (mail->next || !mail->urgent || urgentonly)
+		return (mail->next);
+	return (mbox->head);
+}
+
+// sends the mails at the head of the mailbox, at most most of them and as
+// many as fit into budget bytes and a batch of maxlen bytes, to its
+// connected recipient. several mails go out as one MAIL_BATCH if the
+// recipient takes batches. the mails are freed, or kept until acknowledged
+// if the recipient acknowledges. returns the bytes sent, 0 if the first
+// mail does not fit.
+static uint32_t sendbatch(Mailbox *mbox, uint32_t budget, int most,
+		uint32_t maxlen, int urgentonly) {
+	Member *memb = mbox->memb;
+	uint32_t bytes = 0, len = 0, siz;
+	uint64_t id;
+	int count = 0, i;
+	Mail *mail, *next;
+	char *out;
+
+	// pick the mails of this batch
+	mail = mbox->urgenthead ? mbox->urgenthead : (urgentonly ? NULL : mbox->head);
+	for (next = mail; next && count < most; next = nextdelivery(mbox, next, urgentonly)) {
+		if (next->size > budget - bytes)
+			break;
+		if (count > 0 && len + BATCH_ENTRY_LEN + next->size > maxlen)
+			break;
+		bytes += next->size;
+		len += BATCH_ENTRY_LEN + next->size;
+		count++;
+	}
+	if (count == 0)
+		return (0);
+
+	if (count == 1 && !memb->acking) {
+		queuepkt(memb, EMAIL_MSG_TO_CLIENT, mail->size, mail->frame);
+	} else if ((out = reservepkt(memb, MAIL_BATCH, len)) != NULL) {
+		next = mail;
+		for (i = 0; i < count; i++) {
+			id = htobe64(next->mailid);
+			memcpy(out, &id, sizeof(id));
+			siz = htonl(next->size);
+			memcpy(out + sizeof(id), &siz, sizeof(siz));
+			memcpy(out + BATCH_ENTRY_LEN, next->frame, next->size);
+			out += BATCH_ENTRY_LEN + next->size;
+			next = nextdelivery(mbox, next, urgentonly);
+		}
+	}
+
+	// the batch is queued, now let go of its mails
+	for (i = 0; i < count; i++) {
+		next = nextdelivery(mbox, mail, urgentonly);
+		if (mail == busymail)
+			pollattempt(memb, busyat);
+		traceattempt(memb, mail);
+		MAILPROBE(deliver, mail->mailid, memb->sock);
+		if (memb->acking) {
+			sentmail(mail);
+		} else {
+			mail->delivered = 1;
+			dequeuemail(mail);
+			freemail(mail);
+		}
+		mail = next;
+	}
+	if (windowfull(mbox))
+		unmarkready(mbox);
+	return (bytes);
+}
+
+// sends the mails at the head of the mailbox, as many as fit into budget
+// bytes and the recipient's window, to its connected recipient. returns
+// the bytes sent, 0 if the first mail does not fit.
+static uint32_t delivermails(Mailbox *mbox, uint32_t budget, int urgentonly) {
+	Member *memb = mbox->memb;
+	int most;
+
+	most = memb->batching ? BATCH_MAX_MAILS : 1;
+	if (memb->acking && most > config.window - mbox->inflight)
+		most = config.window - mbox->inflight;
+	return (sendbatch(mbox, budget, most, BATCH_MAX_BYTES, urgentonly));
+}
+
+// deliver all urgent mail of the mailbox right away, as far as the
+// recipient's window allows.
+static void sendurgent(Mailbox *mbox) {
+	while (pushing(mbox) && mbox->urgenthead != NULL &&
+			delivermails(mbox, UINT32_MAX, 1) > 0)
+		;
+}
+
+// stop feeding a recipient that is not reading its mail; the mailbox
+// comes back once its output buffer drains.
+static void blockmailbox(Mailbox *mbox) {
+	mbox->memb->blocked = 1;
+	if (mbox->memb->mux)
+		mbox->memb->mux->blocked = 1;
+	unmarkready(mbox);
+}
+
+// in busy-poll mode, deliver all mail of the mailbox right away instead of
+// at the next sweep, as far as the recipient's window and output buffer
+// allow.
+static void sendbusy(Mailbox *mbox) {
+	if (!config.busypoll)
+		return;
+	while (pushing(mbox) && mbox->count > 0 && !mbox->memb->blocked &&
+			delivermails(mbox, UINT32_MAX, 0) > 0) {
+		if (outpending(mbox->memb) >= OUTBUF_HIGHWATER)
+			blockmailbox(mbox);
+	}
+}
+
+// frees the mails the member acknowledged, which are the ones on its
+// mailbox's sent list up to and including the mail with given id, and
+// sends more if its window was full. returns 0 if no such mail was sent.
+int ackmails(Member *memb, uint64_t mailid) {
+	Mailbox *mbox = memb->mbox;
+	Mail *mail, *last;
+
+	if (mbox == NULL)
+		return (0);
+	for (last = mbox->sent; last && last->mailid != mailid; last = last->next)
+		;
+	if (last == NULL)
+		return (0);
+
+	do {
+		mail = mbox->sent;
+		mbox->sent = mail->next;
+		mbox->inflight--;
+		mail->inflight = 0;
+		mail->delivered = 1;
+		refundmail(mail);
+		mail->mbox = NULL;
+		freemail(mail);
+	} while (mail != last);
+	if (mbox->sent)
+		mbox->sent->prev = NULL;
+	else
+		mbox->senttail = NULL;
+
+	if (mbox->count > 0 && !memb->blocked)
+		markready(mbox);
+	sendurgent(mbox);
+	sendbusy(mbox);
+	return (1);
+}
+
+// puts the mails a recipient which is going away did not acknowledge back
+// at the head of its mailbox, in the order they were first sent.
+static void unsendmails(Mailbox *mbox) {
+	Mail *mail;
+
+	while ((mail = mbox->senttail) != NULL) {
+		mbox->senttail = mail->prev;
+		mbox->inflight--;
+		mail->inflight = 0;
+		requeuemail(mbox, mail);
+	}
+	mbox->sent = NULL;
+}
+
+// takes the member's waiting fetch off the fetch list.
+static void unparkfetch(Member *memb) {
+	if (memb->fetchuntil == 0)
+		return;
+	if (memb->fnext)
+		memb->fnext->fprev = memb->fprev;
+	else
+		fetchtail = memb->fprev;
+	if (memb->fprev)
+		memb->fprev->fnext = memb->fnext;
+	else
+		fetchhead = memb->fnext;
+	memb->fnext = memb->fprev = NULL;
+	memb->fetchuntil = 0;
+}
+
+// puts the member's fetch on the fetch list until the given time. most
+// fetches wait about as long as the ones before them, so the place is
+// looked for from the tail.
+static void parkfetch(Member *memb, uint64_t until) {
+	Member *prev;
+
+	for (prev = fetchtail; prev && prev->fetchuntil > until; prev = prev->fprev)
+		;
+	memb->fetchuntil = until;
+	memb->fprev = prev;
+	memb->fnext = prev ? prev->fnext : fetchhead;
+	if (memb->fnext)
+		memb->fnext->fprev = memb;
+	else
+		fetchtail = memb;
+	if (prev)
+		prev->fnext = memb;
+	else
+		fetchhead = memb;
+}
+
+// answers the member's fetch with the mails at the head of its mailbox, as
+// many as it asked for. returns 0, and sends nothing, if there are none.
+static int answerfetch(Member *memb) {
+	Mailbox *mbox = memb->mbox;
+
+	if (mbox->count == 0 ||
+			sendbatch(mbox, UINT32_MAX, memb->fetchmails, memb->fetchbytes, 0) == 0)
+		return (0);
+	unparkfetch(memb);
+	return (1);
+}
+
+// answers the member's waiting fetch with an empty MAIL_BATCH.
+static void endfetch(Member *memb) {
+	unparkfetch(memb);
+	queuepkt(memb, MAIL_BATCH, 0, NULL);
+}
+
+// handles a fetch of a member which pulls its mail: acknowledges the mails
+// up to the cursor, puts back the ones fetched after it, and sends at most
+// maxmails mails in at most maxbytes. if there are none, the fetch waits
+// up to wait milliseconds for mail.
+void fetchmails(Member *memb, uint64_t cursor, uint32_t maxmails,
+		uint32_t maxbytes, uint32_t wait) {
+	Mailbox *mbox = memb->mbox;
+
+	// a fetch which still waits is answered before the next one
+	if (memb->fetchuntil)
+		endfetch(memb);
+
+	if (cursor != 0)
+		ackmails(memb, cursor);
+	unsendmails(mbox);
+
+	memb->fetchmails = maxmails < (uint32_t) config.window ? maxmails : config.window;
+	memb->fetchbytes = maxbytes < FETCH_MAX_BYTES ? maxbytes : FETCH_MAX_BYTES;
+	if (memb->fetchmails == 0)
+		memb->fetchmails = 1;
+	if (answerfetch(memb))
+		return;
+	if (wait == 0) {
+		queuepkt(memb, MAIL_BATCH, 0, NULL);
+		return;
+	}
+	parkfetch(memb, nowusec() + (uint64_t) (wait < FETCH_MAX_WAIT ? wait :
+				FETCH_MAX_WAIT) * 1000);
+}
+
+// answers the fetches whose time is up with an empty MAIL_BATCH.
+void checkfetches() {
+	uint64_t now = nowusec();
+
+	while (fetchhead && fetchhead->fetchuntil <= now)
+		endfetch(fetchhead);
+}
+
+// returns how many milliseconds until the next waiting fetch is due, -1
+// if none waits.
+int fetchtimeout() {
+	uint64_t now = nowusec();
+
+	if (fetchhead == NULL)
+		return (-1);
+	if (fetchhead->fetchuntil <= now)
+		return (0);
+	return ((int) ((fetchhead->fetchuntil - now + 999) / 1000));
+}
+
+// answers every waiting fetch with an empty MAIL_BATCH.
+void endfetches() {
+	while (fetchhead)
+		endfetch(fetchhead);
+}
+
+// puts the mail into the id index, doubling the table when it is full.
+static void indexmail(Mail *mail) {
+	Mail **oldtab = mailidtab, *next;
+	uint64_t oldbuckets = mailidbuckets, i, bucket;
+
+	if (mailidcount >= mailidbuckets) {
+		mailidbuckets = mailidbuckets ? mailidbuckets * 2 : MAILID_BUCKETS;
+		mailidtab = (Mail **) calloc(mailidbuckets, sizeof(Mail *));
+		if (!mailidtab) {
+			fprintf(stderr, "error : unable to calloc mail id table\n");
+			exit(0);
+		}
+		for (i = 0; i < oldbuckets; i++) {
+			for (; oldtab[i]; oldtab[i] = next) {
+				next = oldtab[i]->idnext;
+				bucket = oldtab[i]->mailid & (mailidbuckets - 1);
+				oldtab[i]->idnext = mailidtab[bucket];
+				mailidtab[bucket] = oldtab[i];
+			}
+		}
+		free(oldtab);
+	}
+
+	bucket = mail->mailid & (mailidbuckets - 1);
+	mail->idnext = mailidtab[bucket];
+	mailidtab[bucket] = mail;
+	mailidcount++;
+}
+
+// takes the mail out of the id index and remembers what became of it.
+static void unindexmail(Mail *mail) {
+	MailStatus *status;
+	Mail **link;
+
+	for (link = &mailidtab[mail->mailid & (mailidbuckets - 1)]; *link;
+			link = &(*link)->idnext) {
+		if (*link == mail) {
+			*link = mail->idnext;
+			mailidcount--;
+			break;
+		}
+	}
+
+	status = &statushistory[mail->mailid % STATUS_HISTORY];
+	status->mailid = mail->mailid;
+	status->state = mail->delivered ? MAIL_DELIVERED : MAIL_EXPIRED;
+}
+
+// free up the given mail.
+void freemail(Mail *mail) {
+	Mail *next;
+
+	unindexmail(mail);
+	adminunlinkmail(mail, ADMIN_BY_AGE);
+	if (mail->anext)
+		mail->anext->aprev = mail->aprev;
+	else
+		mailagetail = mail->aprev;
+	if (mail->aprev)
+		mail->aprev->anext = mail->anext;
+	else
+		mailagehead = mail->anext;
+
+	free(mail->name);
+	free(mail->ipaddr);
+
+	// a mail still queued with the same message or frame is charged for
+	// it now
+	if ((next = dropbody(mail, 0)) != NULL)
+		movecharge(next, strlen(next->message));
+	if ((next = dropbody(mail, 1)) != NULL)
+		movecharge(next, next->size);
+	free(mail->sendername);
+	free(mail->senderip);
+	free(mail);
+}
+
+// returns the length, with its '\0', of what the recipient of a mail from
+// sendername@senderip with given message is sent.
+uint32_t framesize(char *sendername, char *senderip, char *mailmsg) {
+
+	// "From: " + sender + "@" + ip + "\n" + message + '\0'
+	return (strlen(mailmsg) + 9 + (sendername ? strlen(sendername) : 7) +
+			(senderip ? strlen(senderip) : 7));
+}
+
+// serializes what the recipient of a mail from sendername@senderip with
+// given message is sent into a buffer reused by the next call, size bytes
+// as framesize() says, and returns it.
+char *buildframe(char *sendername, char *senderip, char *mailmsg,
+		uint32_t size) {
+	static char *framebuf = NULL;
+	static uint32_t framecap = 0;
+
+	if (size > framecap) {
+		framecap = size;
+		framebuf = (char *) realloc(framebuf, framecap);
+		if (!framebuf) {
+			fprintf(stderr, "error : unable to realloc mail frame\n");
+			exit(0);
+		}
+	}
+	snprintf(framebuf, size, "From: %s@%s\n%s",
+			sendername ? sendername : "unknown",
+			senderip ? senderip : "unknown", mailmsg);
+	return (framebuf);
+}
+
+// creates a mail with the given id and age and puts it at the tail of the
+// list of all mails.
+static Mail *newmail(uint64_t mailid, uint64_t queuedat, char *sendername,
+		char *senderip, char *mname, char *ipaddr, char *mailmsg, int urgent) {
+
+	// printf("addmail(%s, %s, %s)\n", mname, ipaddr, mailmsg);
+
+	Mail * mail;
+	mail = (Mail *) calloc(1, sizeof(Mail));
+	if (!mail) {
+		fprintf(stderr, "error : unable to calloc mail\n");
+		exit(0);
+	}
+
+	mail->mailid = mailid;
+	indexmail(mail);
+	mail->name = strdup(mname);
+
+	// the mail which stores the message is charged for it
+	mail->cost = envelopecost(sendername, senderip, mname, ipaddr);
+	if (keepbody(mail, 0, mailmsg, strlen(mailmsg) + 1))
+		mail->cost += strlen(mailmsg);
+	mail->ipaddr = strdup(ipaddr);
+	mail->urgent = urgent;
+
+	if(sendername != NULL)
+	{
+		mail->sendername = strdup(sendername);
+		mail->senderip = strdup(senderip);
+	}
+	else
+	{
+		// It can be the case that sender got disconnected
+		// before the mail details are updated.
+		mail->sendername = NULL;
+		mail->senderip = NULL;
+	}
+
+	mail->size = framesize(sendername, senderip, mail->message);
+
+	mail->queuedat = queuedat;
+	mail->aprev = mailagetail;
+	if (mailagetail)
+		mailagetail->anext = mail;
+	else
+		mailagehead = mail;
+	mailagetail = mail;
+	return (mail);
+}
+
+// queues the new mail for its peer server or its mailbox and charges it to
+// chargeip. mail for an address routed to a peer server is handed to that
+// peer unless it was relayed to us.
+static void placemail(Mail *mail, char *chargeip, int relayed) {
+	char *frame;
+	Peer * peer;
+	if (!relayed && (peer = findroute(mail->ipaddr)) != NULL) {
+		relaymail(peer, mail);
+		chargemail(mail, chargeip);
+		return;
+	}
+
+	// serialize what the recipient gets once, not on every delivery, and
+	// share it with the mails carrying the same frame. the mail which
+	// stores the frame is charged for it, before it is charged at all.
+	frame = buildframe(mail->sendername, mail->senderip, mail->message,
+			mail->size);
+	if (keepbody(mail, 1, frame, mail->size))
+		mail->cost += mail->size;
+
+	Mailbox * mbox;
+	mbox = getmailbox(mail->name, mail->ipaddr);
+	if (config.busypoll) {
+		busymail = mail;
+		busyat = nownsec();
+	}
+	enqueuemail(mbox, mail);
+	chargemail(mail, chargeip);
+
+	if (mail->urgent)
+		sendurgent(mbox);
+	sendbusy(mbox);
+	busymail = NULL;
+
+	// a fetch waiting for mail gets it now
+	if (mbox->memb && mbox->memb->fetchuntil)
+		answerfetch(mbox->memb);
+}
+
+// add the mail from sendername@senderip to the list with given name, ip
+// and message, charging it to chargeip. mail for an address routed to a
+// peer server is handed to that peer unless it was relayed to us. returns
+// the id of the mail.
+uint64_t addmailfrom(char *sendername, char *senderip, char *chargeip,
+		char *mname, char *ipaddr, char *mailmsg, int urgent, int relayed) {
+	uint64_t mailid;
+	Mail * mail;
+
+	// urgent mail may be delivered and freed before placemail() returns
+	mailid = ++globalmailid;
+	mail = newmail(mailid, nowusec(), sendername, senderip, mname, ipaddr,
+			mailmsg, urgent);
+	traceenqueue(mail);
+	MAILPROBE(addmail, mail->mailid, mail->size, urgent);
+
+	placemail(mail, chargeip, relayed);
+	return (mailid);
+}
+
+// puts back a mail handed over by the server this one replaced, under its
+// old id and age. mails must come back oldest first. mail which waited in
+// a mailbox stays there, mail which waited for a peer goes back to the
+// peer if the address is still routed to one.
+void restoremail(uint64_t mailid, uint64_t queuedat, char *sendername,
+		char *senderip, char *chargeip, char *mname, char *ipaddr,
+		char *mailmsg, int urgent, int topeer) {
+	Mail * mail;
+
+	if (mailid > globalmailid)
+		globalmailid = mailid;
+	mail = newmail(mailid, queuedat, sendername, senderip, mname, ipaddr,
+			mailmsg, urgent);
+	placemail(mail, chargeip, !topeer);
+}
+
+// returns the id and the state of the outcome remembered in the given slot
+// of the status history, or MAIL_UNKNOWN if the slot is empty.
+int laststatus(uint32_t slot, uint64_t *mailid) {
+	MailStatus *status = &statushistory[slot % STATUS_HISTORY];
+
+	*mailid = status->mailid;
+	return (status->mailid ? status->state : MAIL_UNKNOWN);
+}
+
+// remembers what became of the mail with given id.
+void setstatus(uint64_t mailid, int state) {
+	MailStatus *status = &statushistory[mailid % STATUS_HISTORY];
+
+	status->mailid = mailid;
+	status->state = state;
+}
+
+// add the mail from the given member to the list with given name, ip and
+// message. returns the id of the mail.
+uint64_t addmail(Member *sender, char *mname, char* ipaddr, char* mailmsg,
+		int urgent) {
+
+	if (sender != NULL && sender->name != NULL)
+		return (addmailfrom(sender->name, sender->ipaddr, sender->ipaddr,
+					mname, ipaddr, mailmsg, urgent, 0));
+	return (addmailfrom(NULL, NULL, sender ? sender->ipaddr : "0.0.0.0",
+				mname, ipaddr, mailmsg, urgent, 0));
+}
+
+// find the mail with given mail id
+Mail *findmailbyid(uint64_t mailid) {
+	Mail *mail;
+
+	if (mailidtab == NULL)
+		return (NULL);
+	for (mail = mailidtab[mailid & (mailidbuckets - 1)]; mail; mail = mail->idnext) {
+		if (mail->mailid == mailid)
+			return (mail);
+	}
+	return (NULL);
+}
+
+// returns the state of the mail with given id, see MAIL_STATUS.
+int mailstate(uint64_t mailid) {
+	MailStatus *status;
+
+	if (findmailbyid(mailid) != NULL)
+		return (MAIL_QUEUED);
+	status = &statushistory[mailid % STATUS_HISTORY];
+	if (status->mailid == mailid && mailid != 0)
+		return (status->state);
+	return (MAIL_UNKNOWN);
+}
+
+// delete the email with given mail id from its mailbox.
+int deletemail(uint64_t mailid) {
+	// printf("deletemail(%d)", mailid);
+	Mail * mail;
+	Mailbox * mbox;
+
+	// get hold of the mail. mail on its way to a peer is the peer's, and
+	// mail sent to its recipient waits for the acknowledgement.
+	mail = findmailbyid(mailid);
+	if (!mail || !mail->mbox || mail->inflight) {
+		return (0);
+	}
+	MAILPROBE(deletemail, mailid);
+
+	mbox = mail->mbox;
+	dequeuemail(mail);
+	freemail(mail);
+	releasemailbox(mbox);
+	return (1);
+}
+
+// displays all emails available.
+int listmails() {
+	Mailbox * mbox;
+	Mail * mail;
+	printf("\n================\nList of emails\n================\n");
+	for (mbox = mailboxlist; mbox; mbox = mbox->next) {
+		for (mail = mbox->urgenthead; mail; mail = mail->next) {
+			printf("Recipient name: %s\nIP: %s\nMessage Body: %s (urgent)\n================\n",
+					mail->name, mail->ipaddr, mail->message);
+		}
+		for (mail = mbox->head; mail; mail = mail->next) {
+			printf("Recipient name: %s\nIP: %s\nMessage Body: %s\n================\n",
+					mail->name, mail->ipaddr, mail->message);
+		}
+	}
+	printf("================\n");
+	return (1);
+}
+
+// bind the mailbox of a member whose name just became known, and hand it
+// any urgent mail that was waiting.
+void attachmailbox(Member *memb) {
+	Mailbox *mbox;
+
+	mbox = getmailbox(memb->name, memb->ipaddr);
+	mbox->memb = memb;
+	memb->mbox = mbox;
+
+	if (mbox->count > 0 && !memb->blocked)
+		markready(mbox);
+	sendurgent(mbox);
+	sendbusy(mbox);
+}
+
+// unbind the mailbox of a member which is going away.
+void detachmailbox(Member *memb) {
+	Mailbox *mbox = memb->mbox;
+
+	if (!mbox)
+		return;
+	unparkfetch(memb);
+	mbox->memb = NULL;
+	memb->mbox = NULL;
+	unmarkready(mbox);
+
+	// what it did not acknowledge goes out again on its next login
+	unsendmails(mbox);
+	releasemailbox(mbox);
+}
+
+// put the mailbox of a member whose output buffer drained back on the
+// ready ring.
+void resumemailbox(Member *memb) {
+	memb->blocked = 0;
+	if (memb->mbox && memb->mbox->count > 0) {
+		markready(memb->mbox);
+		sendbusy(memb->mbox);
+	}
+	if (memb->nsessions > 0)
+		resumesessions(memb);
+}
+
+// sends pending emails to the connected clients and deletes the email from
+// the email list. Stops once SWEEP_BUDGET_USEC has been spent; returns 1
+// if the ready ring was drained and 0 if the sweep must be resumed.
+int sendmails() {
+	// printf("sendmails(): method entry\n");
+
+	uint64_t deadline = nowusec() + SWEEP_BUDGET_USEC;
+	Mailbox * mbox;
+	uint32_t sent;
+
+	MAILPROBE(sendmails__start);
+
+	while ((mbox = readyring) != NULL) {
+
+		if (nowusec() >= deadline) {
+			MAILPROBE(sendmails__done, 0);
+			return (0);
+		}
+
+		mbox->deficit += DRR_QUANTUM;
+		while ((sent = delivermails(mbox, mbox->deficit, 0)) > 0) {
+			mbox->deficit -= sent;
+
+			if (outpending(mbox->memb) >= OUTBUF_HIGHWATER) {
+				blockmailbox(mbox);
+				break;
+			}
+		}
+
+		// an emptied mailbox has already left the ring; otherwise move on
+		// to the next recipient and keep the remaining credit.
+		if (mbox->ready)
+			readyring = mbox->rnext;
+		else
+			releasemailbox(mbox);
+	}
+	MAILPROBE(sendmails__done, 1);
+	return (1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,220 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailquota.c
+// Description: This file contains methods to account queued emails against
+//				per sender, per recipient and global memory quotas.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "common.h"
+#include "mailserver.h"
+
+// Every queued mail is charged its cost in bytes to the ip-address of the
+// connection that submitted it, to the recipient's mailbox and to the whole
+// queue. A mail which would push any of them over its limit is refused
+// before anything is allocated for it, so the queue never grows past the
+// configured budget however fast mail arrives. A text shared by several
+// mails is charged to one of them only: the mail which stored it, and
+// when that one goes, the next mail holding the text.
+
+// Global Variables
+Sender * sendertab[SENDER_BUCKETS];
+uint64_t queuebytes = 0;
+int queuemails = 0;
+
+// hash an ip-address into a sender bucket.
+static unsigned int haship(char *ip) {
+	unsigned int h = 5381;
+	for (; *ip; ip++)
+		h = (h * 33) ^ (unsigned char) *ip;
+	return (h % SENDER_BUCKETS);
+}
+
+// find the sender with given ip-address.
+Sender *findsender(char *ip) {
+	Sender *sender;
+	for (sender = sendertab[haship(ip)]; sender; sender = sender->hnext) {
+		if (strcmp(sender->ipaddr, ip) == 0)
+			return (sender);
+	}
+	return (NULL);
+}
+
+// find the sender with given ip-address, creating it if needed.
+static Sender *getsender(char *ip) {
+	Sender *sender;
+	unsigned int bucket;
+
+	if ((sender = findsender(ip)) != NULL)
+		return (sender);
+
+	sender = (Sender *) calloc(1, sizeof(Sender));
+	if (!sender) {
+		fprintf(stderr, "error : unable to calloc sender\n");
+		exit(0);
+	}
+	sender->ipaddr = strdup(ip);
+
+	bucket = haship(ip);
+	sender->hnext = sendertab[bucket];
+	if (sendertab[bucket])
+		sendertab[bucket]->hprev = sender;
+	sendertab[bucket] = sender;
+	return (sender);
+}
+
+// free the sender once none of its mail is queued.
+static void releasesender(Sender *sender) {
+	if (sender->mails > 0)
+		return;
+
+	if (sender->hnext)
+		sender->hnext->hprev = sender->hprev;
+	if (sender->hprev)
+		sender->hprev->hnext = sender->hnext;
+	else
+		sendertab[haship(sender->ipaddr)] = sender->hnext;
+
+	free(sender->ipaddr);
+	free(sender);
+}
+
+// returns the number of bytes a mail from sendername@senderip to
+// name@ipaddr costs while it is queued, leaving out its text.
+uint32_t envelopecost(char *sendername, char *senderip, char *name,
+		char *ipaddr) {
+	uint32_t cost;
+
+	cost = sizeof(Mail) + strlen(name) + strlen(ipaddr) + 3;
+	if (sendername)
+		cost += strlen(sendername) + strlen(senderip) + 2;
+	return (cost);
+}
+
+// returns the number of bytes a mail from sendername@senderip to
+// name@ipaddr costs while it is queued: its envelope, its message and the
+// frame its recipient is sent. a text already queued for another mail is
+// shared rather than stored again, and charged to that mail. mail handed
+// to a peer server has no frame, and costs less than this.
+uint32_t mailcost(char *sendername, char *senderip, char *name, char *ipaddr,
+		char *mailmsg) {
+	size_t len = strlen(mailmsg);
+	uint32_t cost, size;
+
+	cost = envelopecost(sendername, senderip, name, ipaddr);
+	if (!sharedbody(mailmsg, len + 1, 0))
+		return (cost + len + framesize(sendername, senderip, mailmsg));
+
+	// a frame is only there with its message
+	size = framesize(sendername, senderip, mailmsg);
+	if (!sharedbody(buildframe(sendername, senderip, mailmsg, size), size, 1))
+		cost += size;
+	return (cost);
+}
+
+// checks whether a mail of the given cost from senderip to name@ipaddr fits
+// in all quotas. returns 1 if it does; otherwise 0, with the reason for the
+// sender in why.
+int admitmail(char *senderip, char *name, char *ipaddr, uint32_t cost,
+		char *why, size_t whylen) {
+	Sender *sender;
+	Mailbox *mbox;
+
+	if (queuebytes + cost > config.maxqueuebytes) {
+		snprintf(why, whylen, "throttled: server queue is full. retry after %d seconds.",
+				config.retryafter);
+		return (0);
+	}
+
+	sender = findsender(senderip);
+	if (sender && (sender->mails + 1 > config.maxsendermails ||
+				sender->bytes + cost > config.maxsenderbytes)) {
+		snprintf(why, whylen, "throttled: too much mail queued from %s. retry after %d seconds.",
+				senderip, config.retryafter);
+		return (0);
+	}
+
+	mbox = findmailbox(name, ipaddr);
+	if (mbox && (mbox->count + mbox->inflight + 1 > config.maxrcptmails ||
+				mbox->bytes + cost > config.maxrcptbytes)) {
+		snprintf(why, whylen, "throttled: mailbox of %s@%s is full. retry after %d seconds.",
+				name, ipaddr, config.retryafter);
+		return (0);
+	}
+	return (1);
+}
+
+// charges a queued mail to its sender, its mailbox and the whole queue.
+void chargemail(Mail *mail, char *senderip) {
+	Sender *sender;
+
+	sender = getsender(senderip);
+	sender->mails++;
+	sender->bytes += mail->cost;
+	mail->sender = sender;
+	mail->snext = NULL;
+	mail->sprev = sender->tail;
+	if (sender->tail)
+		sender->tail->snext = mail;
+	else
+		sender->head = mail;
+	sender->tail = mail;
+
+	// mail waiting for a peer server has no mailbox here
+	if (mail->mbox)
+		mail->mbox->bytes += mail->cost;
+	queuebytes += mail->cost;
+	queuemails++;
+}
+
+// charges the mail for bytes more, a shared text it takes over from the
+// mail which was charged for it. a mail not charged yet pays them with the
+// rest of its cost.
+void movecharge(Mail *mail, uint32_t bytes) {
+	mail->cost += bytes;
+	if (mail->sender == NULL)
+		return;
+	mail->sender->bytes += bytes;
+	if (mail->mbox)
+		mail->mbox->bytes += bytes;
+	queuebytes += bytes;
+}
+
+// gives back what a mail was charged once it leaves the queue.
+void refundmail(Mail *mail) {
+	Sender *sender = mail->sender;
+
+	if (sender) {
+		adminunlinkmail(mail, ADMIN_BY_SENDER);
+		if (mail->snext)
+			mail->snext->sprev = mail->sprev;
+		else
+			sender->tail = mail->sprev;
+		if (mail->sprev)
+			mail->sprev->snext = mail->snext;
+		else
+			sender->head = mail->snext;
+		mail->snext = mail->sprev = NULL;
+		sender->mails--;
+		sender->bytes -= mail->cost;
+		releasesender(sender);
+		mail->sender = NULL;
+	}
+
+	if (mail->mbox)
+		mail->mbox->bytes -= mail->cost;
+	queuebytes -= mail->cost;
+	queuemails--;
+}
+
+///////////////////////////////////////////////////////////////////////////////
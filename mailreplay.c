@@ -0,0 +1,795 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailreplay.c
+// Description: This file contains methods to replay a traffic capture
+//				against a mail server and measure how it keeps up.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "common.h"
+#include "mailcapture.h"
+
+// Every connection of the capture is opened again over TCP when its
+// CAPTURE_OPEN comes up, and sends its frames in the order they were
+// recorded, across all connections, either at the recorded pace or as
+// fast as the server takes them. Everything runs in one thread on
+// non-blocking sockets, reading whatever the server sends so that it never
+// stalls on us.
+//
+// To keep the replay faithful a few things are rewritten. Each client
+// ip-address of the capture is replayed from an address of its own on the
+// loopback network, 127.0.0.0/8 addresses from themselves and others from
+// 127.64.0.0 upwards, and the addresses mails are sent to are rewritten the
+// same way, so mail still reaches the client it went to. Acknowledgements
+// acknowledge the last mail the replayed connection received, and wait for
+// a batch to arrive, since mail ids differ from the recorded ones. A
+// connection the capture closes stays open until its mails are answered.
+// SHM_HELLO is left out, shared memory clients are replayed over TCP.
+//
+// Latency is measured from sending a mail or a status query to its answer:
+// every replayed connection asks for the id of every mail it sends, and
+// the server answers each in order with MAIL_STATUS, or refuses it with a
+// SERVER_ERROR. Connections which carry sessions count towards
+// throughput but not latency.
+
+#define REPLAY_DEFAULT_DRAIN   2            // seconds to wait for the last answers
+#define REPLAY_OUT_MAX         (16 << 20)   // unwritten bytes before we stop sending
+#define REPLAY_TAKE_BATCH      64           // records taken between polls
+#define REPLAY_MAX_EVENTS      256
+#define REPLAY_MAPPED_BASE     0x7f400000   // 127.64.0.0
+#define REPLAY_ADDR_BUCKETS    4096         // first size of the address table
+
+// one replayed connection
+typedef struct _conn {
+	int sock;
+
+	// its id in the capture
+	uint32_t id;
+
+	// set while it is on the flush list
+	int flushing;
+
+	// set once we, and once the server, use session ids in frames
+	int muxed;
+	int srvmuxed;
+
+	// set while latency of its answers is measured
+	int timing;
+
+	// set once the capture closed it, it closes when its output is out and
+	// its mails are answered
+	int closing;
+
+	// id of the last mail received, batches received and not acknowledged
+	// yet, and acknowledgements of the capture not sent yet
+	uint64_t lastid;
+	uint32_t unacked;
+	uint32_t acksowed;
+
+	// bytes to write, from outoff to outlen
+	char * outbuf;
+	size_t outoff;
+	size_t outlen;
+	size_t outcap;
+
+	// bytes read that do not make up a frame yet
+	char * inbuf;
+	size_t inlen;
+	size_t incap;
+
+	// when each unanswered mail or status query was sent, oldest first
+	uint64_t * sentat;
+	uint32_t sentfirst;
+	uint32_t sentcount;
+	uint32_t sentcap;
+} Conn;
+
+// a client ip-address of the capture and the address it is replayed from
+typedef struct _addrmap {
+	uint32_t orig;
+	uint32_t mapped;
+} AddrMap;
+
+// Global Variables
+char * server = "127.0.0.1";
+unsigned short port = 5945;
+int fast = 0;
+int drain = REPLAY_DEFAULT_DRAIN;
+int epfd = -1;
+
+// connections by their id in the capture
+Conn ** conns = NULL;
+uint32_t nconns = 0;
+
+// ids of connections with output queued since the last flush
+uint32_t * flushlist = NULL;
+uint32_t flushcount = 0;
+uint32_t flushsize = 0;
+
+// client addresses, open addressing on the original address
+AddrMap * addrtab = NULL;
+uint32_t addrbuckets = 0;
+uint32_t naddrs = 0;
+
+// what the replay did
+uint64_t opened = 0, failed = 0, dropped = 0, lost = 0;
+uint64_t framessent = 0, bytessent = 0, mailsent = 0;
+uint64_t delivered = 0, answered = 0, refused = 0;
+size_t outtotal = 0;
+
+// mails and status queries still waiting for their answer
+uint64_t unanswered = 0;
+
+// latency of every answer in microseconds
+uint64_t * latencies = NULL;
+size_t nlatencies = 0, latcap = 0;
+
+// returns the bucket of the address table for an address.
+static uint32_t addrbucket(uint32_t addr) {
+	return ((addr * 2654435761u) & (addrbuckets - 1));
+}
+
+// returns the address the given client address is replayed from, in host
+// byte order.
+uint32_t mapaddr(uint32_t orig) {
+	AddrMap *old;
+	uint32_t i, oldbuckets;
+
+	if ((orig >> 24) == 127)
+		return (orig);
+
+	if (naddrs * 2 >= addrbuckets) {
+		old = addrtab;
+		oldbuckets = addrbuckets;
+		addrbuckets = addrbuckets ? addrbuckets * 2 : REPLAY_ADDR_BUCKETS;
+		addrtab = (AddrMap *) calloc(addrbuckets, sizeof(AddrMap));
+		if (!addrtab) {
+			fprintf(stderr, "error : unable to calloc address table\n");
+			exit(0);
+		}
+		for (i = 0; i < oldbuckets; i++) {
+			uint32_t b;
+			if (old[i].mapped == 0)
+				continue;
+			for (b = addrbucket(old[i].orig); addrtab[b].mapped;
+					b = (b + 1) & (addrbuckets - 1))
+				;
+			addrtab[b] = old[i];
+		}
+		free(old);
+	}
+
+	for (i = addrbucket(orig); addrtab[i].mapped; i = (i + 1) & (addrbuckets - 1)) {
+		if (addrtab[i].orig == orig)
+			return (addrtab[i].mapped);
+	}
+	addrtab[i].orig = orig;
+	addrtab[i].mapped = REPLAY_MAPPED_BASE + ++naddrs;
+	return (addrtab[i].mapped);
+}
+
+// remembers how long an answer took.
+void addlatency(uint64_t usec) {
+	if (nlatencies == latcap) {
+		latcap = latcap ? latcap * 2 : 65536;
+		latencies = (uint64_t *) realloc(latencies, latcap * sizeof(uint64_t));
+		if (!latencies) {
+			fprintf(stderr, "error : unable to realloc latencies\n");
+			exit(0);
+		}
+	}
+	latencies[nlatencies++] = usec;
+}
+
+// notes that the connection sent a mail or a status query just now.
+void pushsent(Conn *c) {
+	if (c->sentcount == c->sentcap) {
+		uint32_t cap = c->sentcap ? c->sentcap * 2 : 64;
+		uint64_t *sentat = (uint64_t *) malloc(cap * sizeof(uint64_t));
+		uint32_t i;
+		if (!sentat) {
+			fprintf(stderr, "error : unable to malloc\n");
+			exit(0);
+		}
+		for (i = 0; i < c->sentcount; i++)
+			sentat[i] = c->sentat[(c->sentfirst + i) % c->sentcap];
+		free(c->sentat);
+		c->sentat = sentat;
+		c->sentcap = cap;
+		c->sentfirst = 0;
+	}
+	c->sentat[(c->sentfirst + c->sentcount) % c->sentcap] = nowusec();
+	c->sentcount++;
+	unanswered++;
+}
+
+// notes that the oldest unanswered mail or query of the connection was
+// answered.
+void popsent(Conn *c) {
+	if (c->sentcount == 0)
+		return;
+	addlatency(nowusec() - c->sentat[c->sentfirst]);
+	c->sentfirst = (c->sentfirst + 1) % c->sentcap;
+	c->sentcount--;
+	unanswered--;
+}
+
+// writes what the connection has queued. returns 0 if it is gone.
+int flushconn(Conn *c) {
+	struct epoll_event ev;
+	ssize_t n;
+
+	while (c->outoff < c->outlen) {
+		n = write(c->sock, c->outbuf + c->outoff, c->outlen - c->outoff);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0)
+			return (0);
+		c->outoff += n;
+		outtotal -= n;
+	}
+	if (c->outoff == c->outlen)
+		c->outoff = c->outlen = 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (c->outlen ? EPOLLOUT : 0);
+	ev.data.u32 = c->id;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &ev);
+	return (1);
+}
+
+// returns 1 once a connection the capture closed has nothing left to do.
+int finished(Conn *c) {
+	return (c->closing && c->outlen == 0 && c->sentcount == 0);
+}
+
+// queues a frame on the connection.
+void queueframe(Conn *c, uint32_t session, uint8_t typ, char *text,
+		uint32_t len) {
+	size_t hdr = c->muxed ? MUX_HEADER_LEN : PKT_HEADER_LEN;
+	uint32_t val;
+	char *out;
+
+	if (c->outlen + hdr + len > c->outcap) {
+		size_t cap = c->outcap ? c->outcap : 4096;
+		while (cap < c->outlen + hdr + len)
+			cap *= 2;
+		c->outbuf = (char *) realloc(c->outbuf, cap);
+		if (!c->outbuf) {
+			fprintf(stderr, "error : unable to realloc\n");
+			exit(0);
+		}
+		c->outcap = cap;
+	}
+	out = c->outbuf + c->outlen;
+	out[0] = typ;
+	if (c->muxed) {
+		val = htonl(session);
+		memcpy(out + 1, &val, sizeof(val));
+	}
+	val = htonl(len);
+	memcpy(out + hdr - sizeof(val), &val, sizeof(val));
+	if (len > 0)
+		memcpy(out + hdr, text, len);
+	c->outlen += hdr + len;
+	outtotal += hdr + len;
+	framessent++;
+	bytessent += hdr + len;
+
+	// everything queued in one pass goes out in one write
+	if (!c->flushing) {
+		if (flushcount == flushsize) {
+			flushsize = flushsize ? flushsize * 2 : 1024;
+			flushlist = (uint32_t *) realloc(flushlist, flushsize * sizeof(uint32_t));
+			if (!flushlist) {
+				fprintf(stderr, "error : unable to realloc flush list\n");
+				exit(0);
+			}
+		}
+		flushlist[flushcount++] = c->id;
+		c->flushing = 1;
+	}
+}
+
+// closes the connection and forgets it.
+void dropconn(uint32_t id) {
+	Conn *c = conns[id];
+
+	outtotal -= c->outlen - c->outoff;
+	unanswered -= c->sentcount;
+	close(c->sock);
+	free(c->outbuf);
+	free(c->inbuf);
+	free(c->sentat);
+	free(c);
+	conns[id] = NULL;
+}
+
+// acknowledges what the connection received, if the capture acknowledged
+// something it has not been sent. the capture acknowledged each batch after
+// it arrived, so an acknowledgement waits for a batch to acknowledge.
+void ackbatches(Conn *c) {
+	uint64_t ackid;
+
+	if (c->acksowed == 0 || c->unacked == 0)
+		return;
+	ackid = htobe64(c->lastid);
+	queueframe(c, 0, MAIL_ACK, (char *) &ackid, sizeof(ackid));
+	c->acksowed -= c->acksowed < c->unacked ? c->acksowed : c->unacked;
+	c->unacked = 0;
+}
+
+// opens the connection of the capture with the given id, from the address
+// its client is replayed from.
+void openconn(uint32_t id, char *ip) {
+	struct sockaddr_in local, remote;
+	struct epoll_event ev;
+	struct in_addr in;
+	int sd, optval = 1;
+	Conn *c;
+
+	if (id >= nconns) {
+		uint32_t size = nconns ? nconns : 1024;
+		while (size <= id)
+			size *= 2;
+		conns = (Conn **) realloc(conns, size * sizeof(Conn *));
+		if (!conns) {
+			fprintf(stderr, "error : unable to realloc connections\n");
+			exit(0);
+		}
+		memset(conns + nconns, 0, (size - nconns) * sizeof(Conn *));
+		nconns = size;
+	}
+	if (conns[id])
+		dropconn(id);
+
+	if (inet_pton(AF_INET, ip, &in) != 1)
+		in.s_addr = htonl(INADDR_LOOPBACK);
+
+	sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd == -1) {
+		failed++;
+		return;
+	}
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(mapaddr(ntohl(in.s_addr)));
+	memset(&remote, 0, sizeof(remote));
+	remote.sin_family = AF_INET;
+	remote.sin_port = htons(port);
+	inet_pton(AF_INET, server, &remote.sin_addr);
+	if (bind(sd, (struct sockaddr *) &local, sizeof(local)) == -1 ||
+			connect(sd, (struct sockaddr *) &remote, sizeof(remote)) == -1) {
+		close(sd);
+		failed++;
+		return;
+	}
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+	fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+
+	c = (Conn *) calloc(1, sizeof(Conn));
+	if (!c) {
+		fprintf(stderr, "error : unable to calloc connection\n");
+		exit(0);
+	}
+	c->sock = sd;
+	c->id = id;
+	c->timing = 1;
+	conns[id] = c;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = id;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sd, &ev);
+	opened++;
+
+	// every mail sent gets its id back, which times it
+	queueframe(c, 0, MAIL_STATUS, NULL, 0);
+}
+
+// returns the text of a mail with its recipient's address rewritten to
+// the one the recipient is replayed from, in buf.
+uint32_t rewritemail(char *text, uint32_t len, char *buf, size_t size) {
+	char ip[INET_ADDRSTRLEN];
+	char *at, *sp;
+	struct in_addr in;
+	size_t n;
+
+	if (len == 0 || text[len - 1] != '\0' ||
+			(at = strchr(text, '@')) == NULL || (sp = strchr(at, ' ')) == NULL ||
+			(size_t) (sp - at - 1) >= sizeof(ip))
+		goto asis;
+	memcpy(ip, at + 1, sp - at - 1);
+	ip[sp - at - 1] = '\0';
+	if (inet_pton(AF_INET, ip, &in) != 1)
+		goto asis;
+	in.s_addr = htonl(mapaddr(ntohl(in.s_addr)));
+	inet_ntop(AF_INET, &in, ip, sizeof(ip));
+
+	n = snprintf(buf, size, "%.*s@%s%s", (int) (at - text), text, ip, sp);
+	if (n + 1 > size)
+		goto asis;
+	return (n + 1);
+
+asis:
+	if (len > size)
+		len = size;
+	memcpy(buf, text, len);
+	return (len);
+}
+
+// replays one record of the capture.
+void takerecord(uint32_t id, uint32_t session, uint8_t typ, char *text,
+		uint32_t len) {
+	char buf[MAXPKTLEN + INET_ADDRSTRLEN];
+	Conn *c;
+
+	if (typ == CAPTURE_OPEN) {
+		char ip[INET_ADDRSTRLEN];
+		snprintf(ip, sizeof(ip), "%.*s", (int) len, text);
+		openconn(id, ip);
+		return;
+	}
+	c = id < nconns ? conns[id] : NULL;
+	if (c == NULL) {
+		lost++;
+		return;
+	}
+	if (typ == CAPTURE_CLOSE) {
+		c->closing = 1;
+		if (finished(c))
+			dropconn(id);
+		return;
+	}
+
+	switch (typ) {
+		case SHM_HELLO:
+			// shared memory clients are replayed over the socket
+			dropped++;
+			return;
+		case MUX_HELLO:
+			queueframe(c, session, typ, text, len);
+			c->muxed = 1;
+			c->timing = 0;
+			return;
+		case MAIL_ACK:
+			if (len != sizeof(uint64_t) || c->muxed)
+				break;
+			// acknowledge what this replay received instead
+			c->acksowed++;
+			ackbatches(c);
+			return;
+		case EMAIL_MSG_TO_SERVER:
+		case URGENT_MSG_TO_SERVER:
+			len = rewritemail(text, len, buf, sizeof(buf));
+			text = buf;
+			mailsent++;
+			if (c->timing && session == 0)
+				pushsent(c);
+			break;
+		case MAIL_STATUS:
+			if (c->timing && session == 0 && len == sizeof(uint64_t))
+				pushsent(c);
+			break;
+	}
+	queueframe(c, session, typ, text, len);
+}
+
+// takes action on a frame the server sent on the connection.
+void takeanswer(Conn *c, uint32_t session, uint8_t typ, char *text,
+		uint32_t len) {
+	uint32_t off = 0, n;
+	uint64_t mailid;
+
+	switch (typ) {
+		case PING:
+			queueframe(c, session, PONG, NULL, 0);
+			break;
+		case MUX_HELLO:
+			c->srvmuxed = 1;
+			break;
+		case MAIL_STATUS:
+			answered++;
+			if (c->timing && session == 0)
+				popsent(c);
+			break;
+		case SERVER_ERROR:
+			if ((len >= 10 && strncmp(text, "throttled:", 10) == 0) ||
+					(len >= 9 && strncmp(text, "filtered:", 9) == 0)) {
+				refused++;
+				if (c->timing && session == 0)
+					popsent(c);
+			}
+			break;
+		case EMAIL_MSG_TO_CLIENT:
+			delivered++;
+			break;
+		case MAIL_BATCH:
+			while (len - off >= sizeof(mailid) + sizeof(n)) {
+				memcpy(&mailid, text + off, sizeof(mailid));
+				memcpy(&n, text + off + sizeof(mailid), sizeof(n));
+				off += sizeof(mailid) + sizeof(n);
+				n = ntohl(n);
+				if (n > len - off)
+					break;
+				off += n;
+				delivered++;
+				if (session == 0)
+					c->lastid = be64toh(mailid);
+			}
+			if (session == 0 && !c->muxed) {
+				c->unacked++;
+				ackbatches(c);
+			}
+			break;
+	}
+}
+
+// reads what the server sent on the connection and takes its frames.
+// returns 0 if the server closed it.
+int readconn(Conn *c) {
+	char buf[65536];
+	uint32_t len, session = 0;
+	size_t used = 0, hdr;
+	ssize_t n;
+
+	n = read(c->sock, buf, sizeof(buf));
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return (1);
+	if (n <= 0)
+		return (0);
+
+	if (c->inlen + n > c->incap) {
+		size_t cap = c->incap ? c->incap : 65536;
+		while (cap < c->inlen + n)
+			cap *= 2;
+		c->inbuf = (char *) realloc(c->inbuf, cap);
+		if (!c->inbuf) {
+			fprintf(stderr, "error : unable to realloc\n");
+			exit(0);
+		}
+		c->incap = cap;
+	}
+	memcpy(c->inbuf + c->inlen, buf, n);
+	c->inlen += n;
+
+	while (1) {
+		hdr = c->srvmuxed ? MUX_HEADER_LEN : PKT_HEADER_LEN;
+		if (c->inlen - used < hdr)
+			break;
+		if (c->srvmuxed) {
+			memcpy(&session, c->inbuf + used + 1, sizeof(session));
+			session = ntohl(session);
+		}
+		memcpy(&len, c->inbuf + used + hdr - sizeof(len), sizeof(len));
+		len = ntohl(len);
+		if (c->inlen - used < hdr + len)
+			break;
+		takeanswer(c, session, c->inbuf[used], c->inbuf + used + hdr, len);
+		used += hdr + len;
+	}
+	memmove(c->inbuf, c->inbuf + used, c->inlen - used);
+	c->inlen -= used;
+	return (1);
+}
+
+// compares two latencies for qsort().
+int cmplatency(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x < y ? -1 : x > y);
+}
+
+// returns the given percentile of the sorted latencies.
+uint64_t percentile(double p) {
+	size_t i;
+
+	if (nlatencies == 0)
+		return (0);
+	i = (size_t) (p / 100.0 * nlatencies);
+	return (latencies[i < nlatencies ? i : nlatencies - 1]);
+}
+
+// prints what the replay did.
+void report(uint64_t elapsed, uint64_t recorded, uint64_t records) {
+	double secs = elapsed / 1e6;
+
+	if (secs <= 0)
+		secs = 1e-6;
+	printf("replayed %llu records in %.3f s, %s (capture spans %.3f s)\n",
+			(unsigned long long) records, secs,
+			fast ? "as fast as possible" : "at recorded speed", recorded / 1e6);
+	printf("connections: %llu opened, %llu failed\n",
+			(unsigned long long) opened, (unsigned long long) failed);
+	printf("frames sent: %llu (%.0f/s), %llu bytes (%.2f MB/s), %llu left out, "
+			"%llu on unknown connections\n",
+			(unsigned long long) framessent, framessent / secs,
+			(unsigned long long) bytessent, bytessent / secs / 1e6,
+			(unsigned long long) dropped, (unsigned long long) lost);
+	printf("mails: %llu sent (%.0f/s), %llu delivered (%.0f/s), %llu answered, "
+			"%llu refused\n",
+			(unsigned long long) mailsent, mailsent / secs,
+			(unsigned long long) delivered, delivered / secs,
+			(unsigned long long) answered, (unsigned long long) refused);
+
+	qsort(latencies, nlatencies, sizeof(uint64_t), cmplatency);
+	printf("answer latency (usec) over %zu answers: p50 %llu p90 %llu "
+			"p99 %llu p99.9 %llu max %llu\n", nlatencies,
+			(unsigned long long) percentile(50), (unsigned long long) percentile(90),
+			(unsigned long long) percentile(99), (unsigned long long) percentile(99.9),
+			(unsigned long long) (nlatencies ? latencies[nlatencies - 1] : 0));
+}
+
+// prints the command line options.
+void usage(char *prog) {
+	fprintf(stderr, "usage : %s [options] <capture-file>\n", prog);
+	fprintf(stderr, "  --address <ip-addr>   server to replay against (127.0.0.1)\n");
+	fprintf(stderr, "  --port <port>         port of the server (5945)\n");
+	fprintf(stderr, "  --fast                send as fast as the server takes it\n");
+	fprintf(stderr, "  --drain <seconds>     wait for the last answers (%d)\n",
+			REPLAY_DEFAULT_DRAIN);
+}
+
+int main(int argc, char *argv[]) {
+	static struct option options[] = {
+		{ "address", required_argument, NULL, 'a' },
+		{ "port",    required_argument, NULL, 'p' },
+		{ "fast",    no_argument,       NULL, 'f' },
+		{ "drain",   required_argument, NULL, 'd' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct epoll_event events[REPLAY_MAX_EVENTS];
+	struct in_addr in;
+	struct stat st;
+	char *cap, *rec;
+	size_t pos, caplen;
+	uint64_t start, now, due, recorded = 0, records = 0, drainend = 0;
+	uint32_t delta, id, session, len, i;
+	int opt, fd, n, timeout, taken;
+
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		if (opt == 'a' && inet_pton(AF_INET, optarg, &in) == 1)
+			server = optarg;
+		else if (opt == 'p' && atoi(optarg) > 0 && atoi(optarg) <= 65535)
+			port = atoi(optarg);
+		else if (opt == 'f')
+			fast = 1;
+		else if (opt == 'd' && atoi(optarg) >= 0)
+			drain = atoi(optarg);
+		else {
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	caplen = st.st_size;
+	cap = caplen ? mmap(NULL, caplen, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	if (cap == MAP_FAILED || caplen < CAPTURE_HEADER_LEN ||
+			memcmp(cap, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+		fprintf(stderr, "error: %s is not a capture.\n", argv[optind]);
+		exit(1);
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	pos = CAPTURE_HEADER_LEN;
+	start = nowusec();
+	due = 0;
+	while (1) {
+		now = nowusec();
+
+		// take the records which are due, unless the server falls behind
+		for (taken = 0; taken < REPLAY_TAKE_BATCH && outtotal < REPLAY_OUT_MAX &&
+				caplen - pos >= CAPTURE_RECORD_LEN; taken++) {
+			rec = cap + pos;
+			memcpy(&delta, rec, sizeof(delta));
+			if (!fast && start + due + ntohl(delta) > now)
+				break;
+			memcpy(&id, rec + 4, sizeof(id));
+			memcpy(&session, rec + 8, sizeof(session));
+			memcpy(&len, rec + 13, sizeof(len));
+			len = ntohl(len);
+			if (caplen - pos - CAPTURE_RECORD_LEN < len) {
+				fprintf(stderr, "warning: capture ends in the middle of a record.\n");
+				pos = caplen;
+				break;
+			}
+			due += ntohl(delta);
+			takerecord(ntohl(id), ntohl(session), (uint8_t) rec[12],
+					rec + CAPTURE_RECORD_LEN, len);
+			pos += CAPTURE_RECORD_LEN + len;
+			records++;
+		}
+
+		// write what the records queued. a connection the capture closed
+		// goes once it has nothing left to do.
+		for (i = 0; i < flushcount; i++) {
+			Conn *c = conns[flushlist[i]];
+			if (c == NULL)
+				continue;
+			c->flushing = 0;
+			if (!flushconn(c) || finished(c))
+				dropconn(c->id);
+		}
+		flushcount = 0;
+
+		// once the capture is through, wait a while for the last answers
+		if (caplen - pos < CAPTURE_RECORD_LEN) {
+			if (drainend == 0) {
+				recorded = due;
+				drainend = nowusec() + (uint64_t) drain * 1000000;
+			}
+			if (nowusec() >= drainend || (outtotal == 0 && unanswered == 0))
+				break;
+			timeout = 10;
+		} else if (fast || outtotal >= REPLAY_OUT_MAX || taken == REPLAY_TAKE_BATCH) {
+			timeout = outtotal >= REPLAY_OUT_MAX ? 10 : 0;
+		} else {
+			memcpy(&delta, cap + pos, sizeof(delta));
+			now = nowusec();
+			timeout = start + due + ntohl(delta) > now ?
+				(int) ((start + due + ntohl(delta) - now + 999) / 1000) : 0;
+		}
+
+		n = epoll_wait(epfd, events, REPLAY_MAX_EVENTS, timeout);
+		for (i = 0; (int) i < n; i++) {
+			id = events[i].data.u32;
+			Conn *c = id < nconns ? conns[id] : NULL;
+
+			if (c == NULL)
+				continue;
+			if ((events[i].events & EPOLLOUT) && !flushconn(c)) {
+				dropconn(id);
+				continue;
+			}
+			if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !readconn(c)) {
+				dropconn(id);
+				continue;
+			}
+			if (finished(c))
+				dropconn(id);
+		}
+	}
+
+	report(nowusec() - start, recorded, records);
+	return (0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
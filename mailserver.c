@@ -16,73 +16,56 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <netdb.h>
 #include <time.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <stdint.h>
+#include <endian.h>
+#include <unistd.h>
+#include <getopt.h>
 #include "common.h"
-
-// info about a client
-typedef struct _member {
-
-	// member name
-	char * name;
-
-	// member socket
-	int sock;
-
-	// member ip-address
-	char * ipaddr;
-
-	// next member
-	struct _member * next;
-
-	// prev member
-	struct _member * prev;
-
-} Member;
-
-// info about a mail
-typedef struct _mail {
-
-	int mailid;
-
-	// recipient name
-	char * name;
-
-	// recipient ip address
-	char * ipaddr;
-
-	// sender name
-	char * sendername;
-
-	// sender ip
-	char * senderip;
-
-	char * message;
-
-	// next member
-	struct _mail * next;
-
-	// prev member
-	struct _mail * prev;
-
-} Mail;
+#include "mailserver.h"
+#include "mailtrace.h"
+#include "maillog.h"
 
 // Global Variables
 Member * memblist = NULL;
-Mail * maillist = NULL;
-int globalmailid = 0;
+
+// server configuration
+Config config = {
+	.maxframe = DEFAULT_MAX_FRAME,
+	.maxsendermails = DEFAULT_SENDER_MAILS,
+	.maxsenderbytes = DEFAULT_SENDER_BYTES,
+	.maxrcptmails = DEFAULT_RCPT_MAILS,
+	.maxrcptbytes = DEFAULT_RCPT_BYTES,
+	.maxqueuebytes = DEFAULT_QUEUE_BYTES,
+	.retryafter = DEFAULT_RETRY_AFTER,
+	.window = DEFAULT_WINDOW,
+	.address = DEFAULT_ADDRESS,
+	.port = DEFAULT_PORT,
+	.backlog = DEFAULT_BACKLOG,
+	.deferaccept = 0,
+	.idletimeout = DEFAULT_IDLE_TIMEOUT,
+	.pongtimeout = DEFAULT_PONG_TIMEOUT,
+	.keepalive = 0,
+	.adminpath = NULL
+};
+
+// time of the next delivery sweep, and whether a sweep ran out of budget
+uint64_t nextsweep = 0;
+int sweeppending = 0;
 
 // find the member with given name
 Member *findmemberbyname(char *name) {
 	Member *memb;
 	// go thru all members
 	for (memb = memblist; memb; memb = memb->next) {
-		if (strcmp(memb->name, name) == 0)
+		if (memb->name && strcmp(memb->name, name) == 0)
 			return (memb);
 	}
 	return (NULL);
@@ -91,37 +74,24 @@ Member *findmemberbyname(char *name) {
 // find the member by name and ip
 Member *findmembbynameip(char *name, char *ip) {
 	// printf("findmembbynameip(%s, %s)\n", name, ip);
-	Member *memb;
-	for (memb = memblist; memb; memb = memb->next) {
-		if(memb->name == NULL){
-			// printf("Software error. Name NULL or yet to be updated.\n");
-		} else if(memb->ipaddr == NULL){
-			// printf("Software error. ipaddr NULL\n.");
-		}
-		else if ((strcmp(memb->name, name) == 0) && (strcmp(memb->ipaddr, ip) == 0))
-			return (memb);
-	}
-	return (NULL);
+	Mailbox *mbox;
+
+	// a logged in member is bound to the mailbox of its name and ip
+	mbox = findmailbox(name, ip);
+	if (mbox == NULL)
+		return (NULL);
+	return (mbox->memb);
 }
 
 // find the member with given sock
 Member *findmemberbysock(int sock) {
 	// printf("findmemberbysock(%d)\n", sock);
-	Member *memb;
-
-	// go thru all members
-	for (memb = memblist; memb; memb = memb->next) {
-		if (memb->sock == sock)
-			return (memb);
-	}
-	return (NULL);
+	return (lookupmember(sock));
 }
 
-// add a member with given sock and ipaddr to the list. name will be added
-// later.
-int addmember(int sock, char * ipaddr) {
-
-	// printf("addmember(%d, %s).\n", sock, ipaddr);
+// add a member with given sock and ipaddr to the list without indexing it
+// by its socket. name will be added later.
+Member *newmember(int sock, char * ipaddr) {
 	Member * memb;
 
 	// make this a member of the group
@@ -132,27 +102,36 @@ int addmember(int sock, char * ipaddr) {
 	}
 	memb->name = NULL;
 	memb->sock = sock;
-	memb->ipaddr = strdup(ipaddr);
+	snprintf(memb->ipaddr, sizeof(memb->ipaddr), "%s", ipaddr);
 	memb->prev = NULL;
 	memb->next = memblist;
 	if (memblist) {
 		memblist->prev = memb;
 	}
 	memblist = memb;
-	return 1;
+	return (memb);
 }
 
-// updated the name of the member connected on the given socket descriptor.
-int updatemember(int sock, char *mname) {
-	// printf("updatemember (%d, %s)\n", sock, mname);
+// add a member with given sock and ipaddr to the list. name will be added
+// later.
+Member *addmember(int sock, char * ipaddr) {
+
+	// printf("addmember(%d, %s).\n", sock, ipaddr);
 	Member * memb;
-	memb = findmemberbysock(sock);
 
-	if (!memb) {
-		return 0;
-	}
+	memb = newmember(sock, ipaddr);
+	indexmember(memb);
+	return (memb);
+}
+
+// updated the name of the given member.
+int updatemember(Member *memb, char *mname) {
+	// printf("updatemember (%d, %s)\n", memb->sock, mname);
 
 	memb->name = strdup(mname);
+
+	// hook up the mailbox so that pending mail can be delivered.
+	attachmailbox(memb);
 	return 1;
 }
 
@@ -166,6 +145,23 @@ int deletemember(int sock) {
 	if (!memb) {
 		return (0);
 	}
+	removemember(memb);
+	return (1);
+}
+
+// delete the given member, which may be a session without a socket of its
+// own.
+void removemember(Member *memb) {
+
+	// pending mail waits for the next login
+	detachmailbox(memb);
+	if (memb->mux)
+		unlinksession(memb);
+	else
+		unindexmember(memb);
+
+	// the sessions of a connection end with it
+	closesessions(memb);
 
 	// exclude from the group
 	if (memb->next) {
@@ -181,11 +177,46 @@ int deletemember(int sock) {
 		memb->prev->next = memb->next;
 	}
 
+	// stop watching it for idleness
+	untrackidle(memb);
+	tracefree(memb);
+	pollforget(memb);
+	denseforget(memb);
+	captureclose(memb);
+
+	// admin queries must not rest on it, nor it be an admin any more
+	adminunlinkmember(memb);
+	freeadmin(memb);
+
+	// a peer connection requeues what it had in flight
+	if (memb->peer)
+		peerdown(memb);
+
+	// a client on shared memory gives up its rings
+	if (memb->shm)
+		dropshm(memb);
+
 	// free up member
 	free(memb->name);
-	free(memb->ipaddr);
+	givebuf(memb->inbuf, memb->incap);
+	givebuf(memb->outbuf, memb->outcap);
+	free(memb->sesstab);
 	free(memb);
-	return (1);
+}
+
+// delete the member and close its connection. a session only ends, the
+// connection it runs over stays open.
+void closemember(Member *memb) {
+	int sock = memb->sock;
+
+	if (memb->mux) {
+		removemember(memb);
+		return;
+	}
+
+	// close the socket, which also takes it out of epoll
+	deletemember(sock);
+	close(sock);
 }
 
 // displays the list of members connected and have their name updated.
@@ -200,444 +231,795 @@ int listmembers() {
 }
 
 
-// find the mail with given mail id
-Mail *findmailbyid(int mailid) {
-	Mail *mail;
+// displays all lists available.
+int listall()
+{
+	listmembers();
+	listmails();
+	listpeers();
+}
 
-	// go thru all members
-	for (mail = maillist; mail; mail = mail->next) {
-		if (mail->mailid == mailid)
-			return (mail);
+// runs a delivery sweep when the timer is due, and again starts the timer
+// once the sweep has delivered everything it could.
+void handletimeout() {
+
+	// printf("handletimeout(): method entry\n");
+
+	if (!sweeppending && nowusec() < nextsweep)
+		return;
+
+	// Look for emails and send them to clients. A sweep that runs out of
+	// its time budget is resumed on the next pass of the event loop.
+	sweeppending = !sendmails();
+	if (sweeppending)
+		return;
+
+	if (!starttimer()) {
+		fprintf(stderr, "could not start timer.");
 	}
-	return (NULL);
+	return;
 }
 
-// add the mail to the list with given name, ip and message.
-int addmail(int sendersock, char *mname, char* ipaddr, char* mailmsg) {
+// starts a timer with SWEEP_INTERVAL seconds.
+int starttimer() {
 
-	// printf("addmail(%s, %s, %s)\n", mname, ipaddr, mailmsg);
+	// printf("starttimer(): method entry\n");
+	nextsweep = nowusec() + (uint64_t) SWEEP_INTERVAL * 1000000;
+	return 1;
+}
 
-	Mail * mail;
-	mail = (Mail *) calloc(1, sizeof(Mail));
-	if (!mail) {
-		fprintf(stderr, "error : unable to calloc mail\n");
-		exit(0);
+// handles a USER_NAME packet: the member logs in under the given name.
+// returns 0 if the member is gone.
+int handlelogin(Member *memb, char *mname) {
+
+	if (memb->name != NULL) {
+		MAILLOG("error: member on socket %d already logged in.\n", memb->sock);
+		return (1);
 	}
 
-	globalmailid++;
-	mail->mailid = globalmailid;
-	mail->name = strdup(mname);
-	mail->message = strdup(mailmsg);
-	mail->ipaddr = strdup(ipaddr);
+	Member * samememb;
+	samememb = findmembbynameip(mname, memb->ipaddr);
+	if ( samememb != NULL )
+	{
+		MAILLOG("error: user %s already connected from %s\n", mname, memb->ipaddr);
+		char bufr[MAXPKTLEN] = "user with same username already connected from this machine.\0";
+		queuepkt(memb, SERVER_ERROR, strlen(bufr) + 1, bufr);
 
-	Member * sender;
-	sender = findmemberbysock(sendersock);
+		// close the socket once the error is written
+		lingermember(memb);
+		return (1);
+	}
 
-	if(sender != NULL)
+	if(!updatemember(memb, mname))
 	{
-		mail->sendername = strdup(sender->name);
-		mail->senderip = strdup(sender->ipaddr);
+		MAILLOG("error: unable to update member name.\n");
 	}
-	else
-	{
-		// It can be the case that sender got disconnected
-		// before the mail details are updated.
-		mail->sendername = NULL;
-		mail->senderip = NULL;
+	return (1);
+}
+
+// tells the member what became of the mail with given id.
+void sendstatus(Member *memb, uint64_t mailid) {
+	char bufr[sizeof(mailid) + 1];
+	uint64_t id = htobe64(mailid);
+
+	memcpy(bufr, &id, sizeof(id));
+	bufr[sizeof(id)] = mailstate(mailid);
+	queuepkt(memb, MAIL_STATUS, sizeof(bufr), bufr);
+}
+
+// handles a MAIL_STATUS packet. without text the client asks to be told
+// the id of every mail it sends from now on; with an 8-byte mail id it
+// asks what became of that mail.
+void handlestatus(Member *memb, Packet *pkt) {
+	uint64_t mailid;
+
+	if (pkt->lent == 0) {
+		memb->wantids = 1;
+		return;
 	}
+	if (pkt->lent != sizeof(mailid)) {
+		MAILLOG("error: malformed mail status query.\n");
+		return;
+	}
+	memcpy(&mailid, pkt->text, sizeof(mailid));
+	sendstatus(memb, be64toh(mailid));
+}
 
-	mail->prev = NULL;
-	mail->next = maillist;
-	if (maillist) {
-		maillist->prev = mail;
+// handles a MAIL_ACK packet. without text the client asks for its mail in
+// batches which it acknowledges; with an 8-byte mail id it acknowledges
+// every mail sent to it up to and including that one.
+void handleack(Member *memb, Packet *pkt) {
+	uint64_t mailid;
+
+	if (pkt->lent == 0) {
+		memb->acking = memb->batching = 1;
+		return;
+	}
+	if (pkt->lent != sizeof(mailid)) {
+		MAILLOG("error: malformed mail acknowledgement.\n");
+		return;
 	}
-	maillist = mail;
+	memcpy(&mailid, pkt->text, sizeof(mailid));
+	if (!ackmails(memb, be64toh(mailid)))
+		MAILLOG("error: %s@%s acknowledged a mail it was not sent.\n",
+				memb->name ? memb->name : "unknown", memb->ipaddr);
 }
 
-// delete the email with given mail id from the list.
-int deletemail(int mailid) {
-	// printf("deletemail(%d)", mailid);
-	Mail * mail;
+// handles a MAIL_FETCH packet. without text the client asks to pull its
+// mail from now on; otherwise it fetches a page of it, see fetchmails().
+void handlefetch(Member *memb, Packet *pkt) {
+	uint32_t maxmails, maxbytes, wait;
+	uint64_t cursor;
 
-	// get hold of the mail
-	mail = findmailbyid(mailid);
-	if (!mail) {
-		return (0);
+	if (pkt->lent == 0) {
+		memb->pulling = memb->acking = memb->batching = 1;
+		return;
+	}
+	if (pkt->lent != FETCH_REQUEST_LEN || !memb->pulling) {
+		MAILLOG("error: malformed mail fetch.\n");
+		return;
 	}
+	if (memb->mbox == NULL) {
+		char bufr[] = "log in before fetching mail.";
+		queuepkt(memb, SERVER_ERROR, sizeof(bufr), bufr);
+		return;
+	}
+	memcpy(&cursor, pkt->text, sizeof(cursor));
+	memcpy(&maxmails, pkt->text + 8, sizeof(maxmails));
+	memcpy(&maxbytes, pkt->text + 12, sizeof(maxbytes));
+	memcpy(&wait, pkt->text + 16, sizeof(wait));
+	fetchmails(memb, be64toh(cursor), ntohl(maxmails), ntohl(maxbytes),
+			ntohl(wait));
+}
 
-	// exclude from the group
-	if (mail->next) {
-		mail->next->prev = mail->prev;
+// handles an EMAIL_MSG_TO_SERVER or URGENT_MSG_TO_SERVER packet of the
+// form "<user>@<ip-addr> <message>" and queues the mail.
+void handlemail(Member *memb, char *msg, int urgent) {
+	char * pch1, *pch2, *user, *ipaddr, *mailmsg;
+
+	if (msg == NULL) {
+		MAILLOG("error: empty e-mail. ignoring mail.\n");
+		return;
 	}
 
-	// remove from list
-	if (maillist == mail) {
-		// the head of list
-		maillist = mail->next;
+	pch1 = strstr(msg, " ");
+	pch2 = strstr(msg, "@");
+
+	// All these checks are already available on
+	// client but making sure so that we don't run
+	// into any issues.
+
+	if (pch1 == NULL || pch2 == NULL) {
+		MAILLOG("error: invalid e-mail format. ignoring mail.\n");
+		return;
+	}
+
+	if (pch1 < pch2)
+	{
+		MAILLOG("error: user name cannot contain spaces.\n");
+		MAILLOG("error: invalid e-mail format. ignoring mail.\n");
+		return;
+	}
+
+
+	user = (char *) malloc((strlen(msg) - strlen(pch2) + 1)*sizeof(char));
+	strncpy(user, msg, (strlen(msg) - strlen(pch2))*sizeof(char));
+	user[strlen(msg) - strlen(pch2)] = '\0';
+
+	// fprintf(stderr, "server: user: %s", user);
+
+	ipaddr = (char *) malloc(
+			(strlen(pch2) - strlen(pch1))* sizeof(char));
+	strncpy(ipaddr, msg + strlen(user) + 1,
+			(strlen(pch2) - strlen(pch1) - 1) * sizeof(char));
+	ipaddr[strlen(pch2) - strlen(pch1) - 1] = '\0';
+
+	// fprintf(stderr, "server: ip: %s", ipaddr);
+
+	struct sockaddr_in sa;
+	int result = inet_pton(AF_INET, ipaddr, &(sa.sin_addr));
+	if(result == 0){
+		MAILLOG("error: Invalid IP address format. Ignoring email.\n");
+		free(user);
+		free(ipaddr);
+		return;
+	}
+
+
+	mailmsg = (char *) malloc(strlen(pch1) * sizeof(char));
+	strncpy(mailmsg,
+			msg + strlen(user) + strlen(ipaddr) + 2,
+			(strlen(pch1) - 1) * sizeof(char));
+	mailmsg[strlen(pch1)-1] = '\0';
+
+	// fprintf(stderr, "server: mailmsg: %s", mailmsg);
+
+	// the content filter refuses the mail or holds it back before it is
+	// charged to any quota. otherwise refuse the mail if it does not fit
+	// in the sender's, recipient's or global quota.
+	char why[MAXPKTLEN];
+	uint64_t mailid;
+	int verdict = filtermail(memb, user, ipaddr, mailmsg, &mailid);
+	if (verdict == FILTER_DROP) {
+		snprintf(why, sizeof(why), "filtered: mail refused by the content filter.");
+		queuepkt(memb, SERVER_ERROR, strlen(why) + 1, why);
+	} else if (verdict == FILTER_QUARANTINE) {
+		if (memb->wantids)
+			sendstatus(memb, mailid);
+	} else if (!admitmail(memb->ipaddr, user, ipaddr,
+				mailcost(memb->name, memb->ipaddr, user, ipaddr, mailmsg),
+				why, sizeof(why))) {
+		queuepkt(memb, SERVER_ERROR, strlen(why) + 1, why);
 	} else {
-		// the middle of list
-		mail->prev->next = mail->next;
+		mailid = addmail(memb, user, ipaddr, mailmsg, urgent);
+		if (memb->wantids)
+			sendstatus(memb, mailid);
 	}
 
-	// free up mail
-	free(mail->name);
-	free(mail->ipaddr);
-	free(mail->message);
-	free(mail->sendername);
-	free(mail->senderip);
-	free(mail);
-	return (1);
+	// make sure all temporary char arrays are freed.
+	free(user);
+	free(ipaddr);
+	free(mailmsg);
 }
 
-// displays all emails available.
-int listmails() {
-	Mail * mail;
-	printf("\n================\nList of emails\n================\n");
-	for (mail = maillist; mail; mail = mail->next) {
-		printf("Recipient name: %s\nIP: %s\nMessage Body: %s\n================\n",
-				mail->name, mail->ipaddr, mail->message);
+// takes action based on the type of a packet received from a member, and
+// frees the packet. returns 0 if the member is gone.
+int handlepkt(Member *memb, Packet *pkt) {
+	int alive = 1;
+
+	// take action based on messge type
+	switch (pkt->type) {
+		case USER_NAME:
+			if (pkt->text == NULL || pkt->text[0] == '\0') {
+				MAILLOG("error: empty user name.\n");
+				break;
+			}
+			alive = handlelogin(memb, pkt->text);
+			break;
+		case EMAIL_MSG_TO_SERVER:
+		case URGENT_MSG_TO_SERVER:
+			handlemail(memb, pkt->text, pkt->type == URGENT_MSG_TO_SERVER);
+			break;
+		case PING:
+			// answer the client's heartbeat
+			queuepkt(memb, PONG, 0, NULL);
+			break;
+		case PONG:
+			// reading the packet already marked the member as alive
+			break;
+		case WELCOME_MSG:
+			// a peer server greets our connection to it
+			if (!memb->peer)
+				MAILLOG("Unexpected message type. Dont know how to handle.\n");
+			break;
+		case SERVER_ERROR:
+			MAILLOG("error: %s:%hu says %s\n", memb->ipaddr,
+					memb->peer ? memb->peer->port : 0, pkt->text ? pkt->text : "");
+			break;
+		case PEER_HELLO:
+			alive = handlepeerhello(memb);
+			break;
+		case RELAY_BATCH:
+			handlerelay(memb, pkt);
+			break;
+		case RELAY_ACK:
+			handlerelayack(memb, pkt);
+			break;
+		case MUX_HELLO:
+			handlemuxhello(memb);
+			break;
+		case SHM_HELLO:
+			alive = handleshmhello(memb);
+			break;
+		case MAIL_STATUS:
+			handlestatus(memb, pkt);
+			break;
+		case MAIL_ACK:
+			handleack(memb, pkt);
+			break;
+		case MAIL_FETCH:
+			handlefetch(memb, pkt);
+			break;
+		case MAIL_BATCH:
+			// the client takes several mails in one packet from now on
+			memb->batching = 1;
+			break;
+		case CLOSE_CON:
+			// closing a session leaves its connection alive
+			alive = memb->mux != NULL;
+			closemember(memb);
+			break;
+		default:
+			MAILLOG("Unexpected message type. Dont know how to handle.\n");
 	}
-	printf("================\n");
+
+	// free the message
+	freepkt(pkt);
+	return (alive);
 }
 
-// displays all lists available.
-int listall()
-{
-	listmembers();
-	listmails();
+// runs a command typed on the server console.
+void runconsole(char *intxt) {
+	if (strncmp(intxt, "list", 4) == 0) {
+		listall();
+	} else if (strncmp(intxt, "stats", 5) == 0) {
+		liststats();
+		listlog();
+		listcapture();
+		listbodystats();
+		listfilterstats();
+		listpollstats();
+		listdensestats();
+	} else if (strncmp(intxt, "filter", 6) == 0) {
+		listfilter();
+	} else if (strncmp(intxt, "reload", 6) == 0) {
+		reloadfilter();
+	} else {
+		fprintf(stderr, "error: invalid command.\n");
+	}
 }
 
-// sends pending emails to the connected clients and deletes the email from
-// the email list.
-int sendmails() {
-	// printf("sendmails(): method entry\n");
+// handles commands typed on the server console. only what is already
+// there is read, so a partial line never blocks the event loop.
+void handleconsole() {
+	static char intxt[MAXMSGLEN];
+	static size_t inlen = 0;
+	char *line, *nl;
+	ssize_t n;
 
-	Mail * mail, * nextmail;
-	Member * memb;
-	for (mail = maillist; mail; ) {
-		nextmail = mail->next;
-		if ((memb = findmembbynameip(mail->name, mail->ipaddr)) != NULL) {
-
-			char outputmail[MAXPKTLEN];
-			strcpy(outputmail, "From: ");
-			strcat(outputmail, mail->sendername);
-			strcat(outputmail, "@");
-			strcat(outputmail, mail->senderip);
-			strcat(outputmail, "\n");
-			strcat(outputmail, mail->message);
-			sendpkt(memb->sock, EMAIL_MSG_TO_CLIENT, strlen(outputmail) + 1, outputmail);
-
-			if(!deletemail(mail->mailid))
-			{
-				fprintf(stderr, "error: unable to delete delivered email.\n");
-			}
-
-		}
-		mail = nextmail;
+	n = read(0, intxt + inlen, sizeof(intxt) - inlen - 1);
+	if (n == 0)
+		exit(0);
+	if (n < 0)
+		return;
+	inlen += n;
+	intxt[inlen] = '\0';
+
+	for (line = intxt; (nl = strchr(line, '\n')) != NULL; line = nl + 1) {
+		*nl = '\0';
+		runconsole(line);
 	}
+	inlen -= line - intxt;
+	memmove(intxt, line, inlen);
+
+	// forget a line too long to be a command
+	if (inlen == sizeof(intxt) - 1)
+		inlen = 0;
+	fflush(stdout);
 }
 
-// sends emails on time out and again starts the timer.
-void handletimeout() {
+// returns how many milliseconds epoll_wait() may sleep before the next
+// sweep is due.
+int sweeptimeout() {
+	uint64_t now = nowusec();
+	uint64_t wait = 0;
 
-	// printf("handletimeout(): method entry\n");
+	if (!sweeppending && nextsweep > now)
+		wait = nextsweep - now;
+	return ((int) ((wait + 999) / 1000));
+}
 
-	// Look for emails and send them to clients.
-	sendmails();
+// returns how many milliseconds epoll_wait() may sleep before any timer
+// is due.
+int nexttimeout() {
+	int wait = sweeptimeout();
+	int other;
+
+	if ((other = idletimeout()) >= 0 && other < wait)
+		wait = other;
+	if ((other = peertimeout()) >= 0 && other < wait)
+		wait = other;
+	if ((other = admintimeout()) >= 0 && other < wait)
+		wait = other;
+	if ((other = fetchtimeout()) >= 0 && other < wait)
+		wait = other;
+	return (wait);
+}
 
-	if (!starttimer()) {
-		fprintf(stderr, "could not start timer.");
-	}
-	return;
+// prints the command line options of the server.
+void usage(char *prog) {
+	fprintf(stderr, "usage : %s [options]\n", prog);
+	fprintf(stderr, "  --max-frame <bytes>        largest packet accepted (%d)\n",
+			DEFAULT_MAX_FRAME);
+	fprintf(stderr, "  --sender-mails <n>         mails queued per sender ip (%d)\n",
+			DEFAULT_SENDER_MAILS);
+	fprintf(stderr, "  --sender-bytes <bytes>     bytes queued per sender ip (%d)\n",
+			DEFAULT_SENDER_BYTES);
+	fprintf(stderr, "  --recipient-mails <n>      mails queued per recipient (%d)\n",
+			DEFAULT_RCPT_MAILS);
+	fprintf(stderr, "  --recipient-bytes <bytes>  bytes queued per recipient (%d)\n",
+			DEFAULT_RCPT_BYTES);
+	fprintf(stderr, "  --queue-bytes <bytes>      bytes queued in total (%d)\n",
+			DEFAULT_QUEUE_BYTES);
+	fprintf(stderr, "  --retry-after <seconds>    wait hinted to throttled senders (%d)\n",
+			DEFAULT_RETRY_AFTER);
+	fprintf(stderr, "  --window <n>               unacknowledged mails per recipient (%d)\n",
+			DEFAULT_WINDOW);
+	fprintf(stderr, "  --address <ip-addr>        address to listen on (%s)\n",
+			DEFAULT_ADDRESS);
+	fprintf(stderr, "  --port <port>              port to listen on (%d)\n",
+			DEFAULT_PORT);
+	fprintf(stderr, "  --backlog <n>              listen backlog (%d)\n",
+			DEFAULT_BACKLOG);
+	fprintf(stderr, "  --defer-accept <seconds>   use TCP_DEFER_ACCEPT (off)\n");
+	fprintf(stderr, "  --idle-timeout <seconds>   ping clients idle this long, 0 for never (%d)\n",
+			DEFAULT_IDLE_TIMEOUT);
+	fprintf(stderr, "  --pong-timeout <seconds>   evict clients not answering a ping (%d)\n",
+			DEFAULT_PONG_TIMEOUT);
+	fprintf(stderr, "  --keepalive <seconds>      use TCP keepalive after this idle time (off)\n");
+	fprintf(stderr, "  --peer <range>=<ip>:<port> relay mail for the range to a peer server\n");
+	fprintf(stderr, "  --relay-from <range>       accept relayed mail from peers in the range\n");
+	fprintf(stderr, "  --admin <path>             serve admin queries on a unix socket (off)\n");
+	fprintf(stderr, "  --unix <path>              also accept clients on a unix socket (off)\n");
+	fprintf(stderr, "  --handoff <path>           take over from, and hand over to, a server on restart (off)\n");
+	fprintf(stderr, "  --capture <file>           record what clients send into a capture file (off)\n");
+	fprintf(stderr, "  --filter <file>            drop or quarantine mail matching the rules in the file (off)\n");
+	fprintf(stderr, "  --busy-poll <cpu>          spin the event loop on the cpu for lower latency (off)\n");
+	fprintf(stderr, "  --dense                    hold idle clients in as little memory as possible (off)\n");
 }
 
-// starts a timer with 30 seconds.
-int starttimer() {
+// parses a number given to an option. returns 0 if invalid.
+int parsenumber(char *arg, uint64_t *val) {
+	char *end;
+	unsigned long long n;
 
-	// printf("starttimer(): method entry\n");
-	signal(SIGALRM, handletimeout);
-	alarm(30);
-	return 1;
+	errno = 0;
+	n = strtoull(arg, &end, 10);
+	if (errno || end == arg || *end != '\0' || arg[0] == '-')
+		return (0);
+	*val = n;
+	return (1);
 }
 
-main(int argc, char *argv[]) {
+// fills config from the command line. returns 0 on a bad option.
+int parseoptions(int argc, char *argv[]) {
+	static struct option options[] = {
+		{ "max-frame",       required_argument, NULL, 'f' },
+		{ "sender-mails",    required_argument, NULL, 'm' },
+		{ "sender-bytes",    required_argument, NULL, 'b' },
+		{ "recipient-mails", required_argument, NULL, 'M' },
+		{ "recipient-bytes", required_argument, NULL, 'B' },
+		{ "queue-bytes",     required_argument, NULL, 'q' },
+		{ "retry-after",     required_argument, NULL, 'r' },
+		{ "window",          required_argument, NULL, 'w' },
+		{ "address",         required_argument, NULL, 'a' },
+		{ "port",            required_argument, NULL, 'p' },
+		{ "backlog",         required_argument, NULL, 'l' },
+		{ "defer-accept",    required_argument, NULL, 'd' },
+		{ "idle-timeout",    required_argument, NULL, 'i' },
+		{ "pong-timeout",    required_argument, NULL, 'P' },
+		{ "keepalive",       required_argument, NULL, 'k' },
+		{ "peer",            required_argument, NULL, 'R' },
+		{ "relay-from",      required_argument, NULL, 'F' },
+		{ "admin",           required_argument, NULL, 'A' },
+		{ "unix",            required_argument, NULL, 'U' },
+		{ "handoff",         required_argument, NULL, 'H' },
+		{ "capture",         required_argument, NULL, 'C' },
+		{ "filter",          required_argument, NULL, 'X' },
+		{ "busy-poll",       required_argument, NULL, 'Y' },
+		{ "dense",           no_argument,       NULL, 'D' },
+		{ NULL, 0, NULL, 0 }
+	};
+	uint64_t val;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		if (opt == '?')
+			return (0);
+		if (opt == 'a') {
+			struct in_addr in;
+			if (inet_pton(AF_INET, optarg, &in) != 1)
+				return (0);
+			config.address = optarg;
+			continue;
+		}
+		if (opt == 'A') {
+			config.adminpath = optarg;
+			continue;
+		}
+		if (opt == 'U') {
+			config.unixpath = optarg;
+			continue;
+		}
+		if (opt == 'H') {
+			config.handoffpath = optarg;
+			continue;
+		}
+		if (opt == 'C') {
+			config.capturepath = optarg;
+			continue;
+		}
+		if (opt == 'X') {
+			config.filterpath = optarg;
+			continue;
+		}
+		if (opt == 'D') {
+			config.dense = 1;
+			continue;
+		}
+		if (opt == 'R' || opt == 'F') {
+			if (!(opt == 'R' ? addroute(optarg) : addrelayfrom(optarg)))
+				return (0);
+			continue;
+		}
+		if (!parsenumber(optarg, &val))
+			return (0);
+
+		// only these options may be 0, which turns the feature off
+		if (val == 0 && strchr("dikY", opt) == NULL)
+			return (0);
+		switch (opt) {
+			case 'f':
+				if (val > UINT32_MAX)
+					return (0);
+				config.maxframe = val;
+				break;
+			case 'm':
+				config.maxsendermails = val > INT32_MAX ? INT32_MAX : val;
+				break;
+			case 'b':
+				config.maxsenderbytes = val;
+				break;
+			case 'M':
+				config.maxrcptmails = val > INT32_MAX ? INT32_MAX : val;
+				break;
+			case 'B':
+				config.maxrcptbytes = val;
+				break;
+			case 'q':
+				config.maxqueuebytes = val;
+				break;
+			case 'r':
+				config.retryafter = val > INT32_MAX ? INT32_MAX : val;
+				break;
+			case 'w':
+				config.window = val > INT32_MAX ? INT32_MAX : val;
+				break;
+			case 'p':
+				if (val > UINT16_MAX)
+					return (0);
+				config.port = val;
+				break;
+			case 'l':
+				config.backlog = val > INT32_MAX ? INT32_MAX : val;
+				break;
+			case 'd':
+				config.deferaccept = val > INT32_MAX ? INT32_MAX : val;
+				break;
+			case 'i':
+				config.idletimeout = val > INT32_MAX ? INT32_MAX : val;
+				break;
+			case 'P':
+				config.pongtimeout = val > INT32_MAX ? INT32_MAX : val;
+				break;
+			case 'k':
+				config.keepalive = val > INT32_MAX ? INT32_MAX : val;
+				break;
+			case 'Y':
+				if (val > INT32_MAX)
+					return (0);
+				config.busypoll = 1;
+				config.busycpu = val;
+				break;
+		}
+	}
+	return (optind == argc);
+}
 
-	setbuf(stdout, NULL);
-	// server socket descriptor
-	int servsock;
+main(int argc, char *argv[]) {
 
-	// set of live client sockets
-	fd_set livesdset, tempset;
+	// server socket descriptor, and unix, admin and handoff socket
+	// descriptors if any
+	int servsock = -1;
+	int unixsock = -1;
+	int adminsock = -1;
+	int handsock = -1;
 
-	// largest live client socket descriptor
-	int livesdmax;
+	// events returned by epoll_wait()
+	struct epoll_event events[MAX_EVENTS];
 
 	// check usage
-	if (argc != 1) {
-		fprintf(stderr, "usage : %s\n", argv[0]);
+	if (!parseoptions(argc, argv)) {
+		usage(argv[0]);
 		exit(1);
 	}
+	maxpktlen = config.maxframe;
 
-	// get ready to receive requests
-	servsock = startserver();
-	if (servsock == -1) {
+	// a client going away must not kill the server on write
+	signal(SIGPIPE, SIG_IGN);
+
+	// errors seen by the event loop are written by the log thread
+	startlog();
+
+	// measure what latency tracing costs, if compiled in
+	starttrace();
+
+	// record what clients send, if asked for
+	if (config.capturepath && !startcapture(config.capturepath)) {
+		fprintf(stderr, "error: could not start capture.\n");
 		exit(1);
 	}
 
-	if (!starttimer()) {
-		fprintf(stderr, "error: could not start timer.\n");
+	// check submitted mail against the content filter, if asked for
+	if (config.filterpath && !startfilter(config.filterpath)) {
+		fprintf(stderr, "error: could not load filter.\n");
+		exit(1);
+	}
+
+	// hold idle clients without buffers, if asked for
+	if (config.dense && !startdense()) {
+		fprintf(stderr, "error: could not start dense mode.\n");
+		exit(1);
+	}
+
+	if (!startreactor()) {
+		fprintf(stderr, "error: could not start event loop.\n");
+		exit(1);
+	}
+
+	// a server already running on the handoff path hands over its
+	// listening sockets, its clients and its mail
+	if (config.handoffpath &&
+			takeover(config.handoffpath, &servsock, &unixsock, &adminsock)) {
+
+		// mail which was in flight goes out again without waiting
+		sweeppending = 1;
+	}
+
+	// get ready to receive requests
+	if (servsock == -1) {
+		servsock = startserver(config.address, config.port, config.backlog,
+				config.deferaccept);
+		if (servsock == -1) {
+			exit(1);
+		}
 	}
 
 	// startserver also binds and listens.
 
+	if (!watchsock(servsock, EPOLLIN)) {
+		fprintf(stderr, "error: could not start event loop.\n");
+		exit(1);
+	}
 
-	FD_ZERO(&livesdset);
-	FD_ZERO(&tempset);
-	FD_SET(servsock, &livesdset);
-	FD_SET(0, &livesdset);
+	// clients on this host may connect on a unix socket if asked for
+	if (config.unixpath && unixsock == -1)
+		unixsock = startlocal(config.unixpath, SOCK_STREAM,
+				S_IRWXU | S_IRWXG, LOCAL_BACKLOG);
+	if ((config.unixpath || unixsock != -1) &&
+			(unixsock == -1 || !watchsock(unixsock, EPOLLIN))) {
+		fprintf(stderr, "error: could not start unix socket.\n");
+		exit(1);
+	}
 
+	// admin queries are served on a unix socket if asked for
+	if (config.adminpath && adminsock == -1)
+		adminsock = startadmin(config.adminpath);
+	if ((config.adminpath || adminsock != -1) &&
+			(adminsock == -1 || !watchsock(adminsock, EPOLLIN))) {
+		fprintf(stderr, "error: could not start admin socket.\n");
+		exit(1);
+	}
 
-	livesdmax = servsock;
+	// the next server takes over from us on the handoff socket
+	if (config.handoffpath) {
+		handsock = starthandoff(config.handoffpath);
+		if (handsock == -1 || !watchsock(handsock, EPOLLIN)) {
+			fprintf(stderr, "error: could not start handoff socket.\n");
+			exit(1);
+		}
+	}
+
+	// the console is optional, stdin may not be pollable
+	if (!watchsock(0, EPOLLIN)) {
+		fprintf(stderr, "warning: console commands not available.\n");
+	}
+
+	if (!starttimer()) {
+		fprintf(stderr, "error: could not start timer.\n");
+	}
 
-	// Timed expiry of select is not required in current context.
-	// struct timeval tv;
-	// tv.tv_sec = 2;
-	// tv.tv_usec = 500000;
+	// in busy-poll mode the event loop keeps its core to itself
+	if (config.busypoll && !startbusypoll()) {
+		fprintf(stderr, "error: could not pin event loop.\n");
+		exit(1);
+	}
+	fflush(stdout);
 
 	// receive requests and process them
 	while (1) {
 
 		// loop variable
-		int frsock;
+		int i;
+
+		// load the content filter again if SIGHUP asked for it.
+		checkfilter();
+
+		// deliver pending emails if the timer expired.
+		handletimeout();
+
+		// ping idle clients and evict the ones that did not answer.
+		checkidle();
+
+		// answer fetches which waited for mail in vain.
+		checkfetches();
+
+		// reconnect peers and relay mail addressed to them.
+		checkpeers();
+		relaymails();
+
+		// stream the next rows of open admin queries
+		adminwork();
 
-		tempset = livesdset;
+		// write everything queued for clients
+		flushall();
+		if (config.busypoll)
+			pollwritten();
+		if (config.dense)
+			narrowidle();
 
-		// wait using select() for
+		// wait using epoll_wait() for
 		// messages from existing clients and
 		// connect requests from new clients
 
 		int pret;
-		pret = select(livesdmax + 1, &tempset, NULL, NULL, NULL);
-		if (pret == 0)
+		pret = epoll_wait(epfd, events, MAX_EVENTS,
+				config.busypoll ? 0 : nexttimeout());
+		if( pret < 0 && errno != EINTR )
 		{
-			// printf("No SD is set, lets continue..\n");
-			continue;
-		}
-		else if( pret < 0 && errno == EINTR )
-		{
-			// An Interupt because of timer expiry is expected.
-			continue;
-		}
-		else if( pret < 0 && errno != EINTR )
-		{
-			printf("Select return code is %d\n", pret);
-			printf("Oh dear, something went wrong with select()! %s\n", strerror(errno));
+			MAILLOG("Oh dear, something went wrong with epoll_wait()! %s\n", strerror(errno));
 			continue;
 		}
 
-		// look for messages from live clients
-		for (frsock = 0; frsock <= livesdmax; frsock++) {
-			// skip the listen socket
-			// this case is covered separately
-			if (frsock == servsock) {
-				if (FD_ISSET(frsock, &tempset)) {
-					// printf("Its a server fd %d\n", frsock);
-				}
+		for (i = 0; i < pret; i++) {
+			int frsock = events[i].data.fd;
+			Member *memb;
+
+			// look for connect requests
+			if (frsock == servsock || frsock == unixsock) {
+				acceptclients(frsock);
 				continue;
 			}
 
-			if ( FD_ISSET(frsock, &tempset)) {
-
-				if(frsock == 0){
-					char intxt[MAXMSGLEN];
-
-					if (!fgets(intxt, MAXMSGLEN, stdin))
-						exit(0);
-
-					if (strncmp(intxt, "list", 4) == 0) {
-						listall();
-						continue;
-					}else
-					{
-						fprintf(stderr, "error: invalid command.\n");
-						continue;
-					}
-				}
-
-				Packet *pkt;
-
-				// read the message
-				pkt = recvpkt(frsock);
-
-				if (!pkt) {
-
-					// Delete this member from the list.
-					deletemember(frsock);
-
-					// remove this guy from the set of live clients
-					FD_CLR(frsock, &livesdset);
-
-					// close the socket
-					close(frsock);
-				} else {
-					char* mname;
-
-					// take action based on messge type
-					switch (pkt->type) {
-						case USER_NAME:
-							mname = pkt->text;
-
-							Member *memb;
-							memb = findmemberbysock(frsock);
-							if( memb == NULL )
-							{
-								fprintf(stderr,"error: member does not exist with this socket.\n");
-								continue;
-							}
-							else
-							{
-								Member * samememb;
-								samememb = findmembbynameip(mname, memb->ipaddr);
-								if ( samememb != NULL )
-								{
-									fprintf(stderr, "error: user %s already connected from %s\n", mname, memb->ipaddr);
-									char bufr[MAXPKTLEN] = "user with same username already connected from this machine.\0";
-									sendpkt(frsock, SERVER_ERROR, strlen(bufr) + 1, bufr);
-									deletemember(frsock);
-									FD_CLR(frsock, &livesdset);
-
-									// close the socket
-									close(frsock);
-									continue;
-								}
-							}
-
-							if(!updatemember(frsock, mname))
-							{
-								fprintf(stderr,"error: unable to update member name.\n");
-								continue;
-							}
-							break;
-						case EMAIL_MSG_TO_SERVER:
-							{
-								char * msg;
-								msg = pkt->text;
-								char * pch1, *pch2, *user, *ipaddr, *mailmsg;
-								pch1 = strstr(msg, " ");
-								pch2 = strstr(msg, "@");
-
-								// All these checks are already available on
-								// client but making sure so that we don't run
-								// into any issues.
-
-								if (pch1 == NULL || pch2 == NULL) {
-									fprintf(stderr,
-											"error: invalid e-mail format. ignoring mail.\n");
-									continue;
-								}
-
-								if (pch1 < pch2)
-								{
-									fprintf(stderr, "error: user name cannot contain spaces.\n");
-									fprintf(stderr, "error: invalid e-mail format. ignoring mail.\n");
-									continue;
-								}
-
-
-								user = (char *) malloc((strlen(msg) - strlen(pch2) + 1)*sizeof(char));
-								strncpy(user, msg, (strlen(msg) - strlen(pch2))*sizeof(char));
-								user[strlen(msg) - strlen(pch2)] = '\0';
-
-								// fprintf(stderr, "server: user: %s", user);
-
-								ipaddr = (char *) malloc(
-										(strlen(pch2) - strlen(pch1))* sizeof(char));
-								strncpy(ipaddr, msg + strlen(user) + 1,
-										(strlen(pch2) - strlen(pch1) - 1) * sizeof(char));
-								ipaddr[strlen(pch2) - strlen(pch1) - 1] = '\0';
-
-								// fprintf(stderr, "server: ip: %s", ipaddr);
-
-								struct sockaddr_in sa;
-								int result = inet_pton(AF_INET, ipaddr, &(sa.sin_addr));
-								if(result == 0){
-									fprintf(stderr,
-											"error: Invalid IP address format. Ignoring email.\n");
-									free(user);
-									free(ipaddr);
-									continue;
-								}
-
-
-								mailmsg = (char *) malloc(strlen(pch1) * sizeof(char));
-								strncpy(mailmsg,
-										msg + strlen(user) + strlen(ipaddr) + 2,
-										(strlen(pch1) - 1) * sizeof(char));
-								mailmsg[strlen(pch1)-1] = '\0';
-
-								// fprintf(stderr, "server: mailmsg: %s", mailmsg);
-
-								addmail(frsock, user, ipaddr, mailmsg);
-
-								// make sure all temporary char arrays are freed.
-								free(user);
-								free(ipaddr);
-								free(mailmsg);
-
-							}
-							break;
-						case CLOSE_CON:
-							deletemember(frsock);
-							FD_CLR(frsock, &livesdset);
-
-							// close the socket
-							close(frsock);
-							break;
-						default:
-							printf("Unexpected message type. Dont know how to handle.\n");
-					}
-
-					// free the message
-					freepkt(pkt);
-				}
+			if (frsock == adminsock) {
+				acceptadmins(adminsock);
+				continue;
+			}
+
+			// a new server takes over; we only come back if it failed
+			if (frsock == handsock) {
+				handoff(handsock, servsock, unixsock, adminsock);
+				continue;
+			}
+
+			if (frsock == 0) {
+				handleconsole();
+				continue;
+			}
+
+			// the member may have been closed by an earlier event
+			memb = lookupmember(frsock);
+			if (memb == NULL)
+				continue;
+
+			// a client on shared memory woke us through its eventfd
+			if (memb->shm && frsock != memb->sock) {
+				shmevent(memb);
+				continue;
+			}
+
+			// write queued output the socket can now take
+			if (events[i].events & EPOLLOUT) {
+				if (!flushmember(memb))
+					continue;
 			}
-		}
 
-		// client address
-		struct sockaddr_in remoteaddr;
-		socklen_t addrlen;
-		int csd;
-
-		// look for connect requests
-		if (FD_ISSET(servsock, &tempset)) {
-			// fprintf(stderr,"About to accept request.\n");
-			addrlen = sizeof remoteaddr;
-			csd = accept(servsock, (struct sockaddr *) &remoteaddr, &addrlen);
-			// fprintf(stderr,"Accepted request.\n");
-
-			// if accept is fine?
-			if (csd != -1) {
-				// printf("Sending welcome message.\n");
-				char bufr[MAXPKTLEN] = "Welcome to Santosh\'s Email Server, running on port 5945.\0";
-				sendpkt(csd, WELCOME_MSG, strlen(bufr) + 1, bufr);
-
-				// printf("Sent welcome message.\n");
-				char str[INET_ADDRSTRLEN];
-
-				inet_ntop(AF_INET, &(remoteaddr.sin_addr), str,
-						INET_ADDRSTRLEN);
-
-				// Add client to member list. We will update member name later.
-				addmember(csd, str);
-
-				// add this guy to set of live clients
-				FD_SET(csd, &livesdset);
-				if (csd > livesdmax) {
-					livesdmax = csd;
-				}
-			} else {
-				perror("accept");
-				exit(0);
+			// look for messages from live clients
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				if (!memb->closing)
+					readmember(memb);
+				else if (events[i].events & (EPOLLHUP | EPOLLERR))
+					closemember(memb);
 			}
 		}
 	}
@@ -0,0 +1,706 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailserver.h
+// Description: This file contains definitions which are shared by the
+//				modules of the mail server.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// delivery scheduler limits
+#define SWEEP_INTERVAL     30           // seconds between delivery sweeps
+#define SWEEP_BUDGET_USEC  5000         // longest a single sweep may run
+#define DRR_QUANTUM        MAXPKTLEN    // bytes credited to a mailbox per round
+#define MAILBOX_BUCKETS    4096         // buckets in the mailbox hash table
+
+// shared mail text limits
+#define BODY_BUCKETS       4096         // first size of the mail text table
+
+// mail id index limits
+#define MAILID_BUCKETS     4096         // first size of the mail id hash table
+#define STATUS_HISTORY     (1 << 16)    // mails whose fate is remembered
+
+// delivery batch limits, for clients which take MAIL_BATCH
+#define BATCH_MAX_MAILS    64           // most mails in one delivery batch
+#define BATCH_MAX_BYTES    (16 << 10)   // bytes a delivery batch may grow to
+#define BATCH_ENTRY_LEN    12           // mail id and length before each mail
+#define DEFAULT_WINDOW     256          // unacknowledged mails per recipient
+
+// default admission quotas, see the options of mailserver
+#define DEFAULT_MAX_FRAME        MAXPKTLEN
+#define DEFAULT_SENDER_MAILS     1000
+#define DEFAULT_SENDER_BYTES     (1 << 20)
+#define DEFAULT_RCPT_MAILS       1000
+#define DEFAULT_RCPT_BYTES       (1 << 20)
+#define DEFAULT_QUEUE_BYTES      (64 << 20)
+#define DEFAULT_RETRY_AFTER      SWEEP_INTERVAL
+#define SENDER_BUCKETS           1024   // buckets in the sender hash table
+
+// default listener settings
+#define DEFAULT_ADDRESS          "0.0.0.0"
+#define DEFAULT_PORT             5945
+#define DEFAULT_BACKLOG          SOMAXCONN
+
+// default heartbeat settings
+#define DEFAULT_IDLE_TIMEOUT     60
+#define DEFAULT_PONG_TIMEOUT     15
+#define KEEPALIVE_PROBES         3      // unanswered probes before a drop
+
+// pull-based fetch limits, for clients which send MAIL_FETCH
+#define FETCH_REQUEST_LEN  20           // cursor, most mails, most bytes, wait
+#define FETCH_MAX_BYTES    (64 << 10)   // largest page a fetch may ask for
+#define FETCH_MAX_WAIT     300000       // longest a fetch may wait, in msecs
+
+// content filter limits
+#define FILTER_MAX_RULES   65536        // most rules in a filter file
+#define FILTER_MAX_STATES  16384        // most keyword bytes in a filter file
+#define FILTER_MAX_LINE    1024         // longest line of a filter file
+#define FILTER_BENCH_ROUNDS 100000      // mails checked to time the rules
+#define FILTER_BENCH_LEN   80           // bytes of a mail checked to time them
+#define QUARANTINE_MAILS   1024         // quarantined mails kept for review
+
+// what the content filter does with a mail
+#define FILTER_PASS        0
+#define FILTER_QUARANTINE  1
+#define FILTER_DROP        2
+
+// peer relay limits
+#define RELAY_BATCH_MAILS  256          // most mails in one relay batch
+#define RELAY_BATCH_BYTES  (64 << 10)   // bytes a relay batch may grow to
+#define PEER_MAX_FRAME     (1 << 20)    // largest packet accepted from a peer
+#define PEER_WINDOW        8            // unacknowledged batches per peer
+#define PEER_RETRY_MIN     1            // first reconnect delay in seconds
+#define PEER_RETRY_MAX     60           // longest reconnect delay in seconds
+
+// unix socket and shared memory limits
+#define LOCAL_BACKLOG      SOMAXCONN    // listen backlog of the unix socket
+#define SHM_CHUNKS         4            // READ_CHUNKs taken from a ring per wakeup
+
+// busy-poll mode
+#define BUSY_POLL_USEC     50           // SO_BUSY_POLL of a client socket
+
+// connection-density mode
+#define DENSE_SOCK_BUF     4096         // SO_SNDBUF of an idle client socket
+#define DENSE_WIDE_SOCK_BUF (256 << 10) // SO_SNDBUF while output does not fit
+#define DENSE_NARROW_SEC   1            // seconds between narrowing quiet clients' buffers
+#define DENSE_POOL_BUFS    1024         // free buffers kept of each first size
+
+// connection limits
+#define MEMBER_ADDR_LEN    16           // ip-address of a member with its '\0'
+#define ACCEPT_BATCH       256          // most connections accepted per wakeup
+#define MAX_EVENTS         256          // most events handled per wakeup
+#define READ_CHUNK         65536        // bytes read from a socket at once
+#define INBUF_INITIAL      256          // first allocation for a partial packet
+#define OUTBUF_INITIAL     4096         // first allocation for queued output
+#define OUTBUF_HIGHWATER   (256 << 10)  // queued output that pauses delivery
+
+// multiplexed connection limits
+#define MUX_MAX_SESSIONS   (1 << 20)    // most sessions over one connection
+#define MUX_BUCKETS        64           // first size of a session hash table
+
+// admin socket limits
+#define ADMIN_BACKLOG      16           // listen backlog of the admin socket
+#define ADMIN_PAGE         100          // rows of a page unless a limit is given
+#define ADMIN_SLICE        256          // most rows a query visits per pass
+#define ADMIN_INPUT_MAX    4096         // unhandled command bytes kept per admin
+
+typedef struct _mailbox Mailbox;
+typedef struct _peer Peer;
+typedef struct _admin Admin;
+
+// server configuration, filled from the command line
+typedef struct _config {
+
+	// largest frame accepted from a client
+	uint32_t maxframe;
+
+	// most mails and bytes queued from one sender ip-address
+	int maxsendermails;
+	uint64_t maxsenderbytes;
+
+	// most mails and bytes queued for one recipient
+	int maxrcptmails;
+	uint64_t maxrcptbytes;
+
+	// most bytes queued in total
+	uint64_t maxqueuebytes;
+
+	// seconds a throttled sender is asked to wait
+	int retryafter;
+
+	// most mails sent to an acknowledging recipient and not yet
+	// acknowledged
+	int window;
+
+	// address and port to listen on, and the listen backlog
+	char * address;
+	unsigned short port;
+	int backlog;
+
+	// seconds TCP_DEFER_ACCEPT holds a connection, 0 for off
+	int deferaccept;
+
+	// seconds of silence before a client is pinged, 0 for never
+	int idletimeout;
+
+	// seconds a pinged client has to answer before it is evicted
+	int pongtimeout;
+
+	// seconds of silence before TCP keepalive probes start, 0 for off
+	int keepalive;
+
+	// path of the admin socket, NULL for none
+	char * adminpath;
+
+	// path of the unix socket for clients on this host, NULL for none
+	char * unixpath;
+
+	// path of the socket a new server takes over from this one on, NULL
+	// for none
+	char * handoffpath;
+
+	// file the traffic of clients is recorded into, NULL for none
+	char * capturepath;
+
+	// file holding the rules of the content filter, NULL for none
+	char * filterpath;
+
+	// set to spin the event loop on busycpu instead of sleeping
+	int busypoll;
+	int busycpu;
+
+	// set to hold idle connections in as little memory as possible
+	int dense;
+
+} Config;
+
+// mail queued from one sender ip-address
+typedef struct _sender {
+
+	// sender ip address
+	char * ipaddr;
+
+	// mails and bytes queued
+	int mails;
+	uint64_t bytes;
+
+	// mails charged to this sender, oldest first
+	struct _mail * head;
+	struct _mail * tail;
+
+	// next and prev sender in the same hash bucket
+	struct _sender * hnext;
+	struct _sender * hprev;
+
+} Sender;
+
+// info about a client. the flags are packed together and the buffers only
+// exist while there is something in them, so that the many clients which
+// are only waiting for mail take little memory.
+typedef struct _member {
+
+	// member name
+	char * name;
+
+	// member socket
+	int sock;
+
+	// events watched on the socket
+	uint32_t events;
+
+	// member ip-address
+	char ipaddr[MEMBER_ADDR_LEN];
+
+	// mailbox of this member, set once the name is known
+	Mailbox * mbox;
+
+	// tail of a packet that has not fully arrived
+	char * inbuf;
+	size_t inlen;
+	size_t incap;
+
+	// packets waiting to be written, from outoff to outlen
+	char * outbuf;
+	size_t outoff;
+	size_t outlen;
+	size_t outcap;
+
+	// bytes still to be skipped of a refused packet
+	uint32_t discard;
+
+	// id of the connection in the traffic capture, 0 if not recorded
+	uint32_t connid;
+
+	// when the client was last heard from and when it was pinged, 0 if
+	// no ping is outstanding
+	uint64_t lastseen;
+	uint64_t pingsent;
+
+	// next and prev member on the idle or the ping list
+	struct _member * inext;
+	struct _member * iprev;
+
+	// peer this connection relays to, NULL for clients
+	Peer * peer;
+
+	// query state of an admin connection, NULL for others
+	Admin * admin;
+
+	// mails and bytes the last fetch asked for, and until when it waits for
+	// mail, 0 if it does not
+	uint32_t fetchmails;
+	uint32_t fetchbytes;
+	uint64_t fetchuntil;
+
+	// next and prev member on the fetch list
+	struct _member * fnext;
+	struct _member * fprev;
+
+	// rings of a client on the unix socket once it moved to shared memory
+	struct _shm * shm;
+
+	// hash table of the sessions the connection carries
+	struct _member ** sesstab;
+	uint32_t sessbuckets;
+	int nsessions;
+
+	// for a session: the connection it runs over, its id, and the next
+	// session in the same hash bucket
+	struct _member * mux;
+	uint32_t session;
+	struct _member * hnext;
+
+#ifdef MAIL_TRACE
+	// bytes written so far, and mails waiting for their bytes to be
+	// written from firststamp to nstamps
+	uint64_t outwritten;
+	struct _tracestamp * stamps;
+	int firststamp;
+	int nstamps;
+	int capstamps;
+#endif
+
+	// next member
+	struct _member * next;
+
+	// prev member
+	struct _member * prev;
+
+	// set while the socket is on the flush list
+	unsigned int flushing : 1;
+
+	// set while delivery is paused because the output buffer is full
+	unsigned int blocked : 1;
+
+	// set once the connection closes after its output is written
+	unsigned int closing : 1;
+
+	// set once a peer server connected to us may relay mail
+	unsigned int relay : 1;
+
+	// set once the client takes several mails in one MAIL_BATCH
+	unsigned int batching : 1;
+
+	// set once the client asked to be told the id of every mail it sends
+	unsigned int wantids : 1;
+
+	// set once the client acknowledges the mails it receives
+	unsigned int acking : 1;
+
+	// set once the client pulls its mail with MAIL_FETCH
+	unsigned int pulling : 1;
+
+	// set for clients connected on the unix socket
+	unsigned int local : 1;
+
+	// set once the connection carries sessions
+	unsigned int muxed : 1;
+
+	// set while the send buffer is widened, and once output backed up
+	// since the last look at it, see maildense.c
+	unsigned int widened : 1;
+	unsigned int active : 1;
+
+} Member;
+
+// info about a mail
+typedef struct _mail {
+
+	// id of the mail, never reused
+	uint64_t mailid;
+
+	// next mail in the same bucket of the id index
+	struct _mail * idnext;
+
+	// set once the mail reached its recipient or a peer server
+	int delivered;
+
+	// set while the mail waits for its recipient's acknowledgement
+	int inflight;
+
+	// recipient name
+	char * name;
+
+	// recipient ip address
+	char * ipaddr;
+
+	// sender name
+	char * sendername;
+
+	// sender ip
+	char * senderip;
+
+	// message, shared with the mails carrying the same one
+	char * message;
+
+	// text delivered to the recipient, the From: line and the message,
+	// serialized once when the mail is queued for a mailbox and shared
+	// with the mails carrying the same frame
+	char * frame;
+
+	// next and prev mail holding the same message, and the same frame
+	struct _mail * msgnext;
+	struct _mail * msgprev;
+	struct _mail * framenext;
+	struct _mail * frameprev;
+
+	// bytes this mail costs to deliver, the length of its frame
+	uint32_t size;
+
+	// bytes charged to the quotas while queued
+	uint32_t cost;
+
+	// urgent mail is delivered without waiting for a sweep
+	int urgent;
+
+	// sender the mail is charged to
+	Sender * sender;
+
+	// relay batch carrying the mail to a peer server
+	uint32_t relayseq;
+
+	// when the mail was queued, in microseconds
+	uint64_t queuedat;
+
+	// next and prev mail in the list of all mails, oldest first
+	struct _mail * anext;
+	struct _mail * aprev;
+
+	// next and prev mail charged to the same sender
+	struct _mail * snext;
+	struct _mail * sprev;
+
+#ifdef MAIL_TRACE
+	// when the mail was received and enqueued, in nanoseconds
+	uint64_t treceived;
+	uint64_t tenqueued;
+#endif
+
+	// mailbox holding this mail
+	Mailbox * mbox;
+
+	// next mail in the mailbox
+	struct _mail * next;
+
+	// prev mail in the mailbox
+	struct _mail * prev;
+
+} Mail;
+
+// pending mail of one recipient (name@ip), kept in arrival order
+struct _mailbox {
+
+	// recipient name
+	char * name;
+
+	// recipient ip address
+	char * ipaddr;
+
+	// urgent mails, oldest first
+	Mail * urgenthead;
+	Mail * urgenttail;
+
+	// normal mails, oldest first
+	Mail * head;
+	Mail * tail;
+
+	// number of mails queued in both classes
+	int count;
+
+	// mails sent to an acknowledging recipient and not yet acknowledged,
+	// in the order they were sent
+	Mail * sent;
+	Mail * senttail;
+	int inflight;
+
+	// bytes charged for the queued mails
+	uint64_t bytes;
+
+	// deficit round robin credit in bytes
+	uint32_t deficit;
+
+	// connected recipient, NULL while offline
+	Member * memb;
+
+	// set while the mailbox is on the ready ring
+	int ready;
+
+	// next and prev mailbox in the same hash bucket
+	struct _mailbox * hnext;
+	struct _mailbox * hprev;
+
+	// next and prev mailbox in the list of all mailboxes
+	struct _mailbox * next;
+	struct _mailbox * prev;
+
+	// next and prev mailbox on the ready ring
+	struct _mailbox * rnext;
+	struct _mailbox * rprev;
+};
+
+// a peer server and the mail waiting to be relayed to it
+struct _peer {
+
+	// address and port of the peer
+	char * address;
+	unsigned short port;
+
+	// connection to the peer, NULL while down
+	Member * link;
+
+	// mails waiting to be sent, oldest first
+	Mail * head;
+	Mail * tail;
+	int queued;
+
+	// mails sent but not yet acknowledged, oldest first
+	Mail * sent;
+	Mail * senttail;
+	int inflight;
+
+	// sequence number of the next batch, and batches not yet acknowledged
+	uint32_t nextseq;
+	int batches;
+
+	// set once the current connection had a batch acknowledged
+	int acked;
+
+	// when to reconnect, and the current reconnect delay in seconds
+	uint64_t retryat;
+	int backoff;
+
+	// next peer
+	struct _peer * next;
+};
+
+// indexes an admin query walks
+#define ADMIN_MEMBERS    1              // all members, newest first
+#define ADMIN_BY_AGE     2              // all mails, oldest first
+#define ADMIN_BY_RCPT    3              // mails of one recipient
+#define ADMIN_BY_SENDER  4              // mails from one sender ip-address
+
+// a query of an admin connection. the cursor is the next row to send and
+// moves on by itself when that row goes away.
+struct _admin {
+
+	// connection the rows are sent to
+	Member * memb;
+
+	// index walked, 0 when no query is open
+	int index;
+
+	// next row of the query
+	Mail * pos;
+	Member * mpos;
+
+	// only mails queued at least this many microseconds ago
+	uint64_t olderthan;
+
+	// only mails to this ip-address or from a sender of this name, for
+	// queries no index answers; empty for all
+	char rcptip[MEMBER_ADDR_LEN];
+	char sendername[MAXNAMELEN];
+
+	// rows of a page, 0 for no limit, and rows still to send of this page
+	int limit;
+	int left;
+
+	// set while a page is being sent
+	int paging;
+
+	// next and prev admin connection
+	struct _admin * next;
+	struct _admin * prev;
+};
+
+// mailserver.c
+extern Config config;
+extern Member *memblist;
+extern Member *findmemberbysock(int sock);
+extern Member *newmember(int sock, char *ipaddr);
+extern Member *addmember(int sock, char *ipaddr);
+extern int updatemember(Member *memb, char *mname);
+extern void removemember(Member *memb);
+extern void closemember(Member *memb);
+extern int handlepkt(Member *memb, Packet *pkt);
+extern int parsenumber(char *arg, uint64_t *val);
+
+// mailnet.c
+extern int epfd;
+extern int startreactor();
+extern int watchsock(int sd, uint32_t events);
+extern void indexmember(Member *memb);
+extern void unindexmember(Member *memb);
+extern Member *lookupmember(int sock);
+extern size_t outpending(Member *memb);
+extern int queueframe(Member *conn, uint32_t session, uint8_t typ,
+		uint32_t len, char *buf);
+extern int queuepkt(Member *memb, uint8_t typ, uint32_t len, char *buf);
+extern char *reservepkt(Member *memb, uint8_t typ, uint32_t len);
+extern int flushmember(Member *memb);
+extern void flushall();
+extern void lingermember(Member *memb);
+extern int readmember(Member *memb);
+extern void trackidle(Member *memb);
+extern void untrackidle(Member *memb);
+extern void checkidle();
+extern int idletimeout();
+extern int acceptclients(int servsock);
+extern int queuetext(Member *memb, char *buf, size_t len);
+extern void keeppartial(Member *memb, char *data, size_t len);
+extern void dropinput(Member *memb, size_t used);
+extern int handleshmhello(Member *memb);
+extern int attachshm(Member *memb, struct _shm *shm);
+extern int shmevent(Member *memb);
+extern void dropshm(Member *memb);
+
+// mailqueue.c
+extern uint64_t addmail(Member *sender, char *mname, char *ipaddr, char *mailmsg,
+		int urgent);
+extern uint64_t addmailfrom(char *sendername, char *senderip, char *chargeip,
+		char *mname, char *ipaddr, char *mailmsg, int urgent, int relayed);
+extern void restoremail(uint64_t mailid, uint64_t queuedat, char *sendername,
+		char *senderip, char *chargeip, char *mname, char *ipaddr,
+		char *mailmsg, int urgent, int topeer);
+extern uint64_t globalmailid;
+extern int laststatus(uint32_t slot, uint64_t *mailid);
+extern void setstatus(uint64_t mailid, int state);
+extern void freemail(Mail *mail);
+extern Mailbox *findmailbox(char *name, char *ip);
+extern Mail *findmailbyid(uint64_t mailid);
+extern int mailstate(uint64_t mailid);
+extern Mail *mailagehead;
+extern int deletemail(uint64_t mailid);
+extern int listmails();
+extern void attachmailbox(Member *memb);
+extern void detachmailbox(Member *memb);
+extern void resumemailbox(Member *memb);
+extern int ackmails(Member *memb, uint64_t mailid);
+extern void fetchmails(Member *memb, uint64_t cursor, uint32_t maxmails,
+		uint32_t maxbytes, uint32_t wait);
+extern void checkfetches();
+extern int fetchtimeout();
+extern void endfetches();
+extern int sendmails();
+extern uint32_t framesize(char *sendername, char *senderip, char *mailmsg);
+extern char *buildframe(char *sendername, char *senderip, char *mailmsg,
+		uint32_t size);
+
+// mailbody.c
+extern int sharedbody(const char *text, size_t len, int frame);
+extern int keepbody(Mail *mail, int frame, const char *text, size_t len);
+extern Mail *dropbody(Mail *mail, int frame);
+extern void listbodystats();
+
+// mailquota.c
+extern uint64_t queuebytes;
+extern int queuemails;
+extern Sender *findsender(char *ip);
+extern uint32_t envelopecost(char *sendername, char *senderip, char *name,
+		char *ipaddr);
+extern uint32_t mailcost(char *sendername, char *senderip, char *name,
+		char *ipaddr, char *mailmsg);
+extern int admitmail(char *senderip, char *name, char *ipaddr, uint32_t cost,
+		char *why, size_t whylen);
+extern void chargemail(Mail *mail, char *senderip);
+extern void movecharge(Mail *mail, uint32_t bytes);
+extern void refundmail(Mail *mail);
+
+// mailpeer.c
+extern int addroute(char *spec);
+extern int addrelayfrom(char *spec);
+extern Peer *findroute(char *ip);
+extern void relaymail(Peer *peer, Mail *mail);
+extern void peerdown(Member *memb);
+extern void checkpeers();
+extern int peertimeout();
+extern void relaymails();
+extern void handlerelayack(Member *memb, Packet *pkt);
+extern int handlepeerhello(Member *memb);
+extern void handlerelay(Member *memb, Packet *pkt);
+extern void listpeers();
+
+// mailmux.c
+extern Member *findsession(Member *conn, uint32_t session);
+extern Member *opensession(Member *conn, uint32_t session);
+extern void unlinksession(Member *sess);
+extern void closesessions(Member *conn);
+extern void resumesessions(Member *conn);
+extern void startsessions(Member *conn);
+extern void handlemuxhello(Member *memb);
+
+// mailadmin.c
+extern int startadmin(char *path);
+extern int acceptadmins(int adminsock);
+extern ssize_t parseadmin(Member *memb, char *data, size_t len);
+extern void adminwork();
+extern int admintimeout();
+extern void adminunlinkmail(Mail *mail, int index);
+extern void adminunlinkmember(Member *memb);
+extern void freeadmin(Member *memb);
+
+// mailcapture.c
+extern int startcapture(char *path);
+extern void stopcapture();
+extern void captureopen(Member *memb);
+extern void captureclose(Member *memb);
+extern void captureframe(Member *memb, uint32_t session, uint8_t typ,
+		char *text, uint32_t len);
+extern void listcapture();
+
+// mailfilter.c
+extern int startfilter(char *path);
+extern void reloadfilter();
+extern void checkfilter();
+extern int filtermail(Member *memb, char *mname, char *ipaddr, char *mailmsg,
+		uint64_t *mailid);
+extern void listfilter();
+extern void listfilterstats();
+
+// mailpoll.c
+extern int startbusypoll();
+extern void busysock(int sd);
+extern void quickack(Member *memb);
+extern void pollattempt(Member *memb, uint64_t queued);
+extern void pollwritten();
+extern void pollforget(Member *memb);
+extern void listpollstats();
+
+// maildense.c
+extern int startdense();
+extern char *takebuf(size_t size);
+extern void givebuf(char *buf, size_t size);
+extern void densesock(int sd);
+extern int densebusy(Member *memb);
+extern void narrowidle();
+extern void denseforget(Member *memb);
+extern void listdensestats();
+
+// mailhandoff.c
+extern int starthandoff(char *path);
+extern int handoff(int handsock, int servsock, int unixsock, int adminsock);
+extern int takeover(char *path, int *servsock, int *unixsock, int *adminsock);
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,399 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailshm.c
+// Description: This file contains methods to exchange packets with a
+//				client on the same host through shared memory.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "common.h"
+#include "mailshm.h"
+
+#define SHM_READ_CHUNK 65536
+
+// bytes of the mapping holding both rings
+#define SHM_MAP_SIZE (2 * sizeof(ShmRing))
+
+// wakes the other side.
+static void shmnotify(Shm *shm) {
+	uint64_t one = 1;
+	write(shm->peerfd, &one, sizeof(one));
+}
+
+// creates the rings and eventfds of a new transport, as the server side.
+// returns NULL if the system cannot provide them.
+Shm *shmcreate() {
+	Shm *shm;
+
+	shm = (Shm *) calloc(1, sizeof(Shm));
+	if (!shm) {
+		fprintf(stderr, "error : unable to calloc shm\n");
+		exit(0);
+	}
+	shm->notifyfd = shm->peerfd = shm->memfd = -1;
+
+	shm->memfd = memfd_create("mailserver-shm", MFD_CLOEXEC);
+	if (shm->memfd == -1 || ftruncate(shm->memfd, SHM_MAP_SIZE) == -1)
+		goto fail;
+	shm->map = mmap(NULL, SHM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			shm->memfd, 0);
+	if (shm->map == MAP_FAILED) {
+		shm->map = NULL;
+		goto fail;
+	}
+	shm->notifyfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	shm->peerfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (shm->notifyfd == -1 || shm->peerfd == -1)
+		goto fail;
+
+	// the server reads the first ring and starts out waiting on it
+	shm->rx = (ShmRing *) shm->map;
+	shm->tx = shm->rx + 1;
+	atomic_store(&shm->rx->readerwaiting, 1);
+	return (shm);
+
+fail:
+	shmclose(shm);
+	return (NULL);
+}
+
+// unmaps the rings and closes the descriptors of the transport.
+void shmclose(Shm *shm) {
+	if (shm->map)
+		munmap(shm->map, SHM_MAP_SIZE);
+	if (shm->memfd != -1)
+		close(shm->memfd);
+	if (shm->notifyfd != -1)
+		close(shm->notifyfd);
+	if (shm->peerfd != -1)
+		close(shm->peerfd);
+	free(shm->inbuf);
+	free(shm);
+}
+
+// copies as much of buf into the ring written by this side as there is
+// room for, and wakes the reader if it sleeps. returns the bytes copied,
+// or -1 if the other side moved the tail past the head or too far behind
+// it. the rings are writable by the other side, so nothing read from
+// them is trusted.
+ssize_t shmwrite(Shm *shm, const char *buf, size_t len) {
+	ShmRing *ring = shm->tx;
+	uint64_t head, tail;
+	size_t n, off, first;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head - tail > SHM_RING_SIZE) {
+		shm->broken = 1;
+		return (-1);
+	}
+	n = SHM_RING_SIZE - (head - tail);
+	if (n > len)
+		n = len;
+	if (n > SHM_RING_SIZE)
+		n = SHM_RING_SIZE;
+	if (n == 0)
+		return (0);
+
+	off = head & (SHM_RING_SIZE - 1);
+	first = SHM_RING_SIZE - off < n ? SHM_RING_SIZE - off : n;
+	memcpy(ring->data + off, buf, first);
+	memcpy(ring->data, buf + first, n - first);
+	atomic_store_explicit(&ring->head, head + n, memory_order_release);
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&ring->readerwaiting) && atomic_exchange(&ring->readerwaiting, 0))
+		shmnotify(shm);
+	return (n);
+}
+
+// copies up to len bytes out of the ring read by this side, and wakes the
+// writer if it waits for room. returns the bytes copied, or -1 if the
+// other side moved the head behind the tail or too far ahead of it.
+ssize_t shmread(Shm *shm, char *buf, size_t len) {
+	ShmRing *ring = shm->rx;
+	uint64_t head, tail;
+	size_t n, off, first;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (head - tail > SHM_RING_SIZE) {
+		shm->broken = 1;
+		return (-1);
+	}
+	n = head - tail;
+	if (n > len)
+		n = len;
+	if (n > SHM_RING_SIZE)
+		n = SHM_RING_SIZE;
+	if (n == 0)
+		return (0);
+
+	off = tail & (SHM_RING_SIZE - 1);
+	first = SHM_RING_SIZE - off < n ? SHM_RING_SIZE - off : n;
+	memcpy(buf, ring->data + off, first);
+	memcpy(buf + first, ring->data, n - first);
+	atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&ring->writerwaiting) && atomic_exchange(&ring->writerwaiting, 0))
+		shmnotify(shm);
+	return (n);
+}
+
+// tells the writer this side is about to sleep until data arrives.
+// returns 0 if data arrived meanwhile and there is no need to sleep.
+int shmarm(Shm *shm) {
+	ShmRing *ring = shm->rx;
+
+	atomic_store(&ring->readerwaiting, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&ring->head) != atomic_load(&ring->tail)) {
+		atomic_store(&ring->readerwaiting, 0);
+		return (0);
+	}
+	return (1);
+}
+
+// tells the reader this side is about to sleep until there is room.
+// returns 0 if room was made meanwhile and there is no need to sleep.
+int shmwaitroom(Shm *shm) {
+	ShmRing *ring = shm->tx;
+
+	atomic_store(&ring->writerwaiting, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&ring->head) - atomic_load(&ring->tail) < SHM_RING_SIZE) {
+		atomic_store(&ring->writerwaiting, 0);
+		return (0);
+	}
+	return (1);
+}
+
+// wakes this side again, to come back to data it left in the ring.
+void shmpoke(Shm *shm) {
+	uint64_t one = 1;
+	write(shm->notifyfd, &one, sizeof(one));
+}
+
+// consumes the wakeups this side was sent.
+void shmclearnotify(Shm *shm) {
+	uint64_t count;
+	read(shm->notifyfd, &count, sizeof(count));
+}
+
+// sends SHM_HELLO on the socket with the memfd and both eventfds attached.
+// the server keeps the memfd, to hand the rings on to a server taking its
+// place. returns 0 if the socket cannot take the packet right now.
+int shmsendhello(int sd, Shm *shm) {
+	char pkt[PKT_HEADER_LEN + sizeof(uint32_t)];
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	int fds[3] = { shm->memfd, shm->notifyfd, shm->peerfd };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t val;
+
+	pkt[0] = SHM_HELLO;
+	val = htonl(sizeof(uint32_t));
+	memcpy(pkt + 1, &val, sizeof(val));
+	val = htonl(SHM_RING_SIZE);
+	memcpy(pkt + PKT_HEADER_LEN, &val, sizeof(val));
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = pkt;
+	iov.iov_len = sizeof(pkt);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(sd, &msg, MSG_NOSIGNAL) != (ssize_t) sizeof(pkt))
+		return (0);
+	return (1);
+}
+
+// maps the rings of a transport another server process created, as the
+// server side, taking over the given descriptors. returns NULL if the
+// memfd cannot be mapped.
+Shm *shmadopt(int memfd, int notifyfd, int peerfd) {
+	Shm *shm;
+
+	shm = (Shm *) calloc(1, sizeof(Shm));
+	if (!shm) {
+		fprintf(stderr, "error : unable to calloc shm\n");
+		exit(0);
+	}
+	shm->memfd = memfd;
+	shm->notifyfd = notifyfd;
+	shm->peerfd = peerfd;
+
+	shm->map = mmap(NULL, SHM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			memfd, 0);
+	if (shm->map == MAP_FAILED) {
+		shm->map = NULL;
+		shmclose(shm);
+		return (NULL);
+	}
+	shm->rx = (ShmRing *) shm->map;
+	shm->tx = shm->rx + 1;
+	return (shm);
+}
+
+// reads what arrived on the socket without waiting, as the client side,
+// keeping up to three descriptors passed along in fds, counted in nfds,
+// and closing any more. returns what read() would.
+ssize_t shmrecvfds(int sd, char *buf, size_t len, int *fds, int *nfds) {
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t got;
+	int i, fd;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	got = recvmsg(sd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (got == -1)
+		return (-1);
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		for (i = 0; i < (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int)); i++) {
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			if (*nfds < 3)
+				fds[(*nfds)++] = fd;
+			else
+				close(fd);
+		}
+	}
+	return (got);
+}
+
+// maps the rings the server passed along with its answer to SHM_HELLO, as
+// the client side, taking over the descriptors. the answer holds the size
+// of a ring, which must be the one we were built with. returns NULL if the
+// rings cannot be used, having closed the descriptors.
+Shm *shmjoin(int sd, int *fds, int nfds, char *text, uint32_t len) {
+	uint32_t size = 0;
+	struct stat st;
+	void *map = MAP_FAILED;
+	Shm *shm;
+	int i;
+
+	if (len == sizeof(size))
+		memcpy(&size, text, sizeof(size));
+	if (nfds == 3 && ntohl(size) == SHM_RING_SIZE &&
+			fstat(fds[0], &st) == 0 && st.st_size >= (off_t) SHM_MAP_SIZE)
+		map = mmap(NULL, SHM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fds[0], 0);
+	if (map == MAP_FAILED) {
+		for (i = 0; i < nfds; i++)
+			close(fds[i]);
+		return (NULL);
+	}
+	close(fds[0]);
+
+	shm = (Shm *) calloc(1, sizeof(Shm));
+	if (!shm) {
+		fprintf(stderr, "error : unable to calloc shm\n");
+		exit(0);
+	}
+	shm->memfd = -1;
+	shm->map = map;
+	shm->tx = (ShmRing *) map;
+	shm->rx = shm->tx + 1;
+	shm->peerfd = fds[1];
+	shm->notifyfd = fds[2];
+	shm->sock = sd;
+	return (shm);
+}
+
+// returns the next packet which has fully arrived through the rings, or
+// NULL if there is none yet. a packet longer than maxlen breaks the
+// transport, as does a ring left inconsistent.
+Packet *shmrecvpkt(Shm *shm, uint32_t maxlen) {
+	Packet *pkt;
+	uint32_t lent;
+	ssize_t n;
+
+	while (1) {
+		if (shm->inlen >= PKT_HEADER_LEN) {
+			memcpy(&lent, shm->inbuf + 1, sizeof(lent));
+			lent = ntohl(lent);
+			if (lent > maxlen) {
+				shm->broken = 1;
+				return (NULL);
+			}
+			if (shm->inlen >= PKT_HEADER_LEN + lent)
+				break;
+		}
+
+		// keep room for at least a chunk more
+		if (shm->incap - shm->inlen < SHM_READ_CHUNK) {
+			shm->incap = shm->incap ? shm->incap * 2 : 2 * SHM_READ_CHUNK;
+			shm->inbuf = (char *) realloc(shm->inbuf, shm->incap);
+			if (!shm->inbuf) {
+				fprintf(stderr, "error : unable to realloc\n");
+				exit(0);
+			}
+		}
+		n = shmread(shm, shm->inbuf + shm->inlen, shm->incap - shm->inlen);
+		if (n <= 0)
+			return (NULL);
+		shm->inlen += n;
+	}
+
+	pkt = (Packet *) calloc(1, sizeof(Packet));
+	if (!pkt) {
+		fprintf(stderr, "error : unable to calloc\n");
+		exit(0);
+	}
+	pkt->type = (uint8_t) shm->inbuf[0];
+	pkt->lent = lent;
+	if (lent > 0) {
+		pkt->text = (char *) malloc(lent + 1);
+		if (!pkt->text) {
+			fprintf(stderr, "error : unable to malloc\n");
+			exit(0);
+		}
+		memcpy(pkt->text, shm->inbuf + PKT_HEADER_LEN, lent);
+		pkt->text[lent] = '\0';
+	}
+	shm->inlen -= PKT_HEADER_LEN + lent;
+	memmove(shm->inbuf, shm->inbuf + PKT_HEADER_LEN + lent, shm->inlen);
+	return (pkt);
+}
+
+///////////////////////////////////////////////////////////////////////////////
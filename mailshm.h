@@ -0,0 +1,86 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailshm.h
+// Description: This file contains the shared-memory transport used by
+//				clients on the same host as the server.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// A client connected over the server's unix socket may send SHM_HELLO.
+// The server answers with SHM_HELLO carrying the size of a ring in its
+// text and, as SCM_RIGHTS, a memfd holding two rings and two eventfds.
+// From then on the same packets flow through the rings instead of the
+// socket: the first ring carries the client's packets to the server, the
+// second the server's packets to the client. The socket stays open only to
+// tell either side that the other went away.
+//
+// Each ring is a byte stream with a single writer and a single reader.
+// A side only signals the other's eventfd when the other said it is about
+// to sleep, waiting for data or for room, so a busy pair exchanges packets
+// without system calls.
+
+#define SHM_RING_SIZE    (1 << 20)    // bytes of one ring, a power of two
+
+// one direction of the transport
+typedef struct _shmring {
+
+	// bytes written so far, and set while the writer waits for room
+	_Alignas(64) atomic_uint_fast64_t head;
+	atomic_int writerwaiting;
+
+	// bytes read so far, and set while the reader waits for data
+	_Alignas(64) atomic_uint_fast64_t tail;
+	atomic_int readerwaiting;
+
+	_Alignas(64) char data[SHM_RING_SIZE];
+} ShmRing;
+
+// one side of a shared-memory transport
+typedef struct _shm {
+
+	// ring read and ring written by this side
+	ShmRing * rx;
+	ShmRing * tx;
+
+	// eventfd this side is woken on, and the one that wakes the other
+	int notifyfd;
+	int peerfd;
+
+	// the mapping of both rings, and its memfd. the client closes the
+	// memfd once mapped, the server keeps it for a restart.
+	void * map;
+	int memfd;
+
+	// client side: socket to the server, watched for its hangup while
+	// waiting for room
+	int sock;
+
+	// client side: bytes of a packet that has not fully arrived
+	char * inbuf;
+	size_t inlen;
+	size_t incap;
+
+	// set once the other side left a ring's head and tail inconsistent,
+	// or sent a packet longer than the reader takes
+	int broken;
+
+} Shm;
+
+extern Shm *shmcreate();
+extern void shmclose(Shm *shm);
+extern ssize_t shmwrite(Shm *shm, const char *buf, size_t len);
+extern ssize_t shmread(Shm *shm, char *buf, size_t len);
+extern int shmarm(Shm *shm);
+extern int shmwaitroom(Shm *shm);
+extern void shmpoke(Shm *shm);
+extern void shmclearnotify(Shm *shm);
+extern int shmsendhello(int sd, Shm *shm);
+extern ssize_t shmrecvfds(int sd, char *buf, size_t len, int *fds, int *nfds);
+extern Shm *shmjoin(int sd, int *fds, int nfds, char *text, uint32_t len);
+extern Shm *shmadopt(int memfd, int notifyfd, int peerfd);
+extern Packet *shmrecvpkt(Shm *shm, uint32_t maxlen);
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,226 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailtrace.c
+// Description: This file contains methods to follow emails through the
+//				server and keep latency histograms of each stage.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "common.h"
+#include "mailserver.h"
+#include "mailtrace.h"
+
+// returns the monotonic clock in nanoseconds.
+uint64_t nownsec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+// returns the bucket counting the given value. values below
+// 2^HIST_SUB_BITS get a bucket each; above that every power of two is
+// split into 2^HIST_SUB_BITS equal buckets.
+static int histbucket(uint64_t val) {
+	int exp;
+
+	if (val < (1 << HIST_SUB_BITS))
+		return ((int) val);
+	exp = 63 - __builtin_clzll(val);
+	return (((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+			(int) ((val >> (exp - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1)));
+}
+
+// returns the largest value counted by the given bucket.
+static uint64_t histvalue(int bucket) {
+	int exp, sub;
+
+	if (bucket < (1 << HIST_SUB_BITS))
+		return ((uint64_t) bucket);
+	exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+	return ((((uint64_t) ((1 << HIST_SUB_BITS) + sub + 1)) << (exp - HIST_SUB_BITS)) - 1);
+}
+
+// counts a value in the histogram.
+void histrecord(Histogram *hist, uint64_t val) {
+	hist->counts[histbucket(val)]++;
+	hist->total++;
+	if (val > hist->max)
+		hist->max = val;
+}
+
+// returns the value below which pct percent of the counted values lie.
+uint64_t histpercentile(Histogram *hist, double pct) {
+	uint64_t want, seen = 0;
+	int i;
+
+	if (hist->total == 0)
+		return (0);
+	want = (uint64_t) (hist->total * pct / 100.0);
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= want)
+			return (histvalue(i) < hist->max ? histvalue(i) : hist->max);
+	}
+	return (hist->max);
+}
+
+#ifdef MAIL_TRACE
+
+// Global Variables
+Histogram stagehist[TRACE_STAGES];
+char * stagenames[TRACE_STAGES] = {
+	"received -> enqueued",
+	"enqueued -> attempted",
+	"attempted -> written",
+	"received -> written",
+	"content filter"
+};
+
+// time the packets being handled were read
+uint64_t tracereceived = 0;
+
+// nanoseconds tracing adds to one mail, measured at startup
+uint64_t traceoverhead = 0;
+
+// measures what the hooks cost one mail: four clock reads and four
+// histogram updates.
+void starttrace() {
+	Histogram *scratch;
+	uint64_t start;
+	int i;
+
+	scratch = (Histogram *) calloc(1, sizeof(Histogram));
+	if (!scratch) {
+		fprintf(stderr, "error : unable to calloc histogram\n");
+		exit(0);
+	}
+	start = nownsec();
+	for (i = 0; i < 100000; i++)
+		histrecord(scratch, nownsec() & 0xffff);
+	traceoverhead = (nownsec() - start) * 4 / 100000;
+	free(scratch);
+}
+
+// notes the time the packets about to be handled were read.
+void tracereceive() {
+	tracereceived = nownsec();
+}
+
+// stamps a mail which was just queued.
+void traceenqueue(Mail *mail) {
+	mail->treceived = tracereceived ? tracereceived : nownsec();
+	mail->tenqueued = nownsec();
+	histrecord(&stagehist[STAGE_ENQUEUE], mail->tenqueued - mail->treceived);
+	MAILPROBE(mail__enqueue, mail->mailid, mail->tenqueued - mail->treceived);
+}
+
+// stamps a mail which was just handed to its recipient's connection, and
+// remembers where its bytes end in the connection's output.
+void traceattempt(Member *memb, Mail *mail) {
+	TraceStamp *stamp;
+	uint64_t now = nownsec();
+
+	histrecord(&stagehist[STAGE_ATTEMPT], now - mail->tenqueued);
+
+	// a session's mail is written by its connection
+	if (memb->mux)
+		memb = memb->mux;
+
+	if (memb->nstamps == memb->capstamps) {
+		// drop the stamps already consumed before growing the array
+		if (memb->firststamp > 0) {
+			memmove(memb->stamps, memb->stamps + memb->firststamp,
+					(memb->nstamps - memb->firststamp) * sizeof(TraceStamp));
+			memb->nstamps -= memb->firststamp;
+			memb->firststamp = 0;
+		} else {
+			memb->capstamps = memb->capstamps ? memb->capstamps * 2 : 16;
+			memb->stamps = (TraceStamp *) realloc(memb->stamps,
+					memb->capstamps * sizeof(TraceStamp));
+			if (!memb->stamps) {
+				fprintf(stderr, "error : unable to realloc trace stamps\n");
+				exit(0);
+			}
+		}
+	}
+	stamp = &memb->stamps[memb->nstamps++];
+	stamp->end = memb->outwritten + outpending(memb);
+	stamp->received = mail->treceived;
+	stamp->attempted = now;
+}
+
+// notes that bytes more of the member's output were written, and
+// completes the mails whose bytes are now all out.
+void tracewritten(Member *memb, size_t bytes) {
+	TraceStamp *stamp;
+	uint64_t now;
+
+	memb->outwritten += bytes;
+	if (memb->firststamp == memb->nstamps)
+		return;
+
+	now = nownsec();
+	while (memb->firststamp < memb->nstamps) {
+		stamp = &memb->stamps[memb->firststamp];
+		if (stamp->end > memb->outwritten)
+			break;
+		histrecord(&stagehist[STAGE_WRITE], now - stamp->attempted);
+		histrecord(&stagehist[STAGE_TOTAL], now - stamp->received);
+		MAILPROBE(mail__written, memb->sock, now - stamp->received);
+		memb->firststamp++;
+	}
+	if (memb->firststamp == memb->nstamps)
+		memb->firststamp = memb->nstamps = 0;
+}
+
+// counts the time the content filter took over a mail, since start.
+void tracefilter(uint64_t start) {
+	histrecord(&stagehist[STAGE_FILTER], nownsec() - start);
+}
+
+// frees the stamps of a member which is going away.
+void tracefree(Member *memb) {
+	free(memb->stamps);
+	memb->stamps = NULL;
+}
+
+// displays the latency histograms of all stages in microseconds.
+void liststats() {
+	Histogram *hist;
+	int i;
+
+	printf("================\nLatency (usec)\n================\n");
+	printf("%-24s %10s %10s %10s %10s %10s %10s\n", "stage", "count",
+			"p50", "p90", "p99", "p999", "max");
+	for (i = 0; i < TRACE_STAGES; i++) {
+		hist = &stagehist[i];
+		printf("%-24s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+				stagenames[i], (unsigned long long) hist->total,
+				histpercentile(hist, 50) / 1000.0,
+				histpercentile(hist, 90) / 1000.0,
+				histpercentile(hist, 99) / 1000.0,
+				histpercentile(hist, 99.9) / 1000.0,
+				hist->max / 1000.0);
+	}
+	printf("tracing overhead: about %llu nsec per mail\n",
+			(unsigned long long) traceoverhead);
+	printf("================\n");
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,102 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: mailtrace.h
+// Description: This file contains the static tracepoints and the latency
+//				tracing hooks of the mail server.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Tracing is compiled in with 'make TRACE=1', which defines MAIL_TRACE.
+// Without it every probe and hook below expands to nothing.
+//
+// MAILPROBE() places a USDT (SystemTap SDT) probe under the provider
+// "mailserver" when <sys/sdt.h> is available. Probes cost a single nop
+// until a tracer such as bpftrace or perf attaches to them.
+//
+// The trace hooks stamp every mail when it is received, enqueued, handed
+// to its recipient's connection and written to the socket, and feed the
+// time between stamps into per-stage latency histograms. The time the
+// content filter takes over a mail gets a histogram of its own.
+//
+// The histograms themselves are always compiled in, busy-poll mode keeps
+// one as well.
+
+struct _mail;
+struct _member;
+
+// histogram buckets: 2^HIST_SUB_BITS linear buckets per power of two
+#define HIST_SUB_BITS   4
+#define HIST_BUCKETS    (64 << HIST_SUB_BITS)
+
+// counts of latencies in nanoseconds
+typedef struct _histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+} Histogram;
+
+extern uint64_t nownsec();
+extern void histrecord(Histogram *hist, uint64_t val);
+extern uint64_t histpercentile(Histogram *hist, double pct);
+
+#ifdef MAIL_TRACE
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MAILPROBE(name, ...) STAP_PROBEV(mailserver, name, ##__VA_ARGS__)
+#endif
+#endif
+
+#ifndef MAILPROBE
+#define MAILPROBE(name, ...) do { } while (0)
+#endif
+
+// latency stages of a mail
+#define STAGE_ENQUEUE   0   // received to enqueued
+#define STAGE_ATTEMPT   1   // enqueued to handed to the connection
+#define STAGE_WRITE     2   // handed to the connection to written
+#define STAGE_TOTAL     3   // received to written
+#define STAGE_FILTER    4   // checked by the content filter
+#define TRACE_STAGES    5
+
+// a mail handed to a connection, waiting for its bytes to be written
+typedef struct _tracestamp {
+	uint64_t end;
+	uint64_t received;
+	uint64_t attempted;
+} TraceStamp;
+
+extern uint64_t tracereceived;
+
+extern void starttrace();
+extern void tracereceive();
+extern void traceenqueue(struct _mail *mail);
+extern void traceattempt(struct _member *memb, struct _mail *mail);
+extern void tracewritten(struct _member *memb, size_t bytes);
+extern void tracefree(struct _member *memb);
+extern void tracefilter(uint64_t start);
+extern void liststats();
+
+#define tracenow() nownsec()
+
+#else
+
+#define MAILPROBE(name, ...) do { } while (0)
+
+#define starttrace()
+#define tracereceive()
+#define traceenqueue(mail)
+#define traceattempt(memb, mail)
+#define tracewritten(memb, bytes)
+#define tracefree(memb)
+#define tracefilter(start)
+#define liststats() \
+	printf("tracing is not compiled in, rebuild with 'make TRACE=1'.\n")
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
@@ -16,41 +16,58 @@
 #include <strings.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <time.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "common.h"
+#include "mailtrace.h"
 
 #define MAXNAMELEN 256
 
 void printpkt(Packet *);
 
-// prepare server to accept requests
+// largest packet text recvpkt() accepts. anything longer is refused before
+// it is read so that a peer cannot make us allocate arbitrary amounts.
+uint32_t maxpktlen = UINT32_MAX;
+
+// prepare server to accept requests on the given address, port and listen
+// backlog. the socket is non-blocking so that pending connections can be
+// accepted in a loop. deferaccept, if not 0, is the number of seconds the
+// kernel may hold a connection until the client sends data.
 // returns file descriptor of socket
 // returns -1 on error
 
-int startserver() {
+int startserver(char *addr, ushort port, int backlog, int deferaccept) {
 	// fprintf(stderr, "Method Entry: startserver()\n");
 
 	int sd;
 
-	char * servhost;
-	ushort servport;
-
-	// create a TCP socket using socket()
-	sd = socket(PF_INET, SOCK_STREAM, 0);
+	// create a non-blocking TCP socket using socket()
+	sd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd == -1) {
+		perror("socket");
+		return (-1);
+	}
 
-	// bind the socket to some port using bind()
-	// let the system choose a port
+	// bind the socket to the given address and port using bind()
 
 	struct sockaddr_in server_address;
+	memset(&server_address, 0, sizeof(server_address));
 	server_address.sin_family = AF_INET;
-	server_address.sin_addr.s_addr = htonl(INADDR_ANY);
-	server_address.sin_port = htons(5945);
+	server_address.sin_port = htons(port);
+	if (inet_pton(AF_INET, addr, &server_address.sin_addr) != 1) {
+		fprintf(stderr, "error: invalid listen address %s\n", addr);
+		close(sd);
+		return (-1);
+	}
 
 	// Set this so that no issues if port already blocked.
 	int optval = 1;
@@ -60,37 +77,80 @@ int startserver() {
 		exit(1);
 	}
 
-	bind(sd, (struct sockaddr *) &server_address, sizeof(server_address));
+	// accepted sockets inherit TCP_NODELAY
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(int));
 
-	// we are ready to receive connections
-	listen(sd, 5);
-
-	// figure out the full local host name (servhost)
-	// use gethostname() and gethostbyname()
-	// full host name is zeus.ite.gmu.edu instead of just zeus
-
-	char hostname[MAXNAMELEN];
+	if (deferaccept > 0 &&
+			setsockopt(sd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferaccept,
+				sizeof(int)) == -1) {
+		perror("setsockopt TCP_DEFER_ACCEPT");
+	}
 
-	if (gethostname(hostname, sizeof hostname) != 0)
-		perror("gethostname");
+	if (bind(sd, (struct sockaddr *) &server_address,
+				sizeof(server_address)) == -1) {
+		perror("bind");
+		close(sd);
+		return (-1);
+	}
 
-	struct hostent* h;
-	h = gethostbyname(hostname);
+	// we are ready to receive connections
+	if (listen(sd, backlog) == -1) {
+		perror("listen");
+		close(sd);
+		return (-1);
+	}
 
-	// figure out the port assigned to this server (servport)
-	// use getsockname()
+	// figure out the address and port we are bound to. no name lookup is
+	// done so that a slow resolver cannot hold up startup.
 
-	int len = sizeof(struct sockaddr);
+	socklen_t len = sizeof(server_address);
+	char servhost[INET_ADDRSTRLEN];
 
 	getsockname(sd, (struct sockaddr *) &server_address, &len);
-
-	servhost = h->h_name;
-	servport = ntohs(server_address.sin_port);
+	inet_ntop(AF_INET, &server_address.sin_addr, servhost, sizeof(servhost));
 
 	// ready to accept requests
 	fprintf(stderr,
-			"Welcome to Santosh's E-mail Server running on host %s, port %hu\n",
-			servhost, servport);
+			"Welcome to Santosh's E-mail Server running on %s, port %hu\n",
+			servhost, ntohs(server_address.sin_port));
+	return (sd);
+}
+
+// prepare server to accept requests on a unix-domain socket of the given
+// type at the given path, which is created with the given permissions. a
+// socket file left behind by an earlier run is replaced.
+// returns file descriptor of socket
+// returns -1 on error
+int startlocal(char *path, int type, mode_t mode, int backlog) {
+	struct sockaddr_un addr;
+	int sd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "error: socket path too long: %s\n", path);
+		return (-1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd == -1) {
+		perror("socket");
+		return (-1);
+	}
+
+	unlink(path);
+	if (bind(sd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		perror("bind");
+		close(sd);
+		return (-1);
+	}
+	chmod(path, mode);
+	if (listen(sd, backlog) == -1) {
+		perror("listen");
+		close(sd);
+		return (-1);
+	}
 	return (sd);
 }
 
@@ -132,6 +192,35 @@ int hooktoserver(char* user, char* servhost, ushort servport) {
 	return (sd);
 }
 
+// establishes connection with a server on the same host through its
+// unix-domain socket at the given path
+// returns file descriptor of socket
+// returns -1 on error
+int hooktolocal(char *path) {
+	struct sockaddr_un addr;
+	int sd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "error: socket path too long: %s\n", path);
+		return (-1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sd == -1) {
+		perror("socket");
+		return (-1);
+	}
+	if (connect(sd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("connecting");
+		close(sd);
+		return (-1);
+	}
+	return (sd);
+}
+
 // receives n bytes on the given socket into the buffer.
 int readn(int sd, char *buf, size_t n) {
 	// printf("readn via utils. %d, %d\n", sd, n);
@@ -193,11 +282,19 @@ Packet *recvpkt(int sd)
 	}
 	pkt->lent = ntohl(pkt->lent);
 
+	// refuse oversized packets
+	if (pkt->lent > maxpktlen) {
+		free(pkt);
+		errno = EMSGSIZE;
+		return(NULL);
+	}
+
 	// allocate space for message text
 	if (pkt->lent > 0) {
 		pkt->text = (char *) malloc(pkt->lent + 1);
-		if (!pkt) {
+		if (!pkt->text) {
 			fprintf(stderr, "error : unable to malloc\n");
+			free(pkt);
 			return(NULL);
 		}
 
@@ -209,6 +306,7 @@ Packet *recvpkt(int sd)
 
 		pkt->text[pkt->lent] = '\0';
 	}
+	MAILPROBE(recvpkt, sd, pkt->type, pkt->lent);
 
 	// fprintf(stderr, "Reading packet complete succesfully. %s\n", pkt->text);
 	// printpkt(pkt);
@@ -220,6 +318,7 @@ Packet *recvpkt(int sd)
 int sendpkt(int sd, uint8_t typ, uint32_t len, char *buf)
 {
 	//fprintf(stderr, "Send packet via utils. sd: %d, typ: %u, len: %lu, buf: %s\n", sd, typ, len, buf);
+	MAILPROBE(sendpkt, sd, typ, len);
 	char tmp[8];
 	uint32_t siz;
 
@@ -243,6 +342,14 @@ void freepkt(Packet *pkt)
 	free(pkt);
 }
 
+// returns the monotonic clock in microseconds.
+uint64_t nowusec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
 // display data in the given packet.
 void printpkt(Packet *pkt)
 {
@@ -0,0 +1,150 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: testquota.c
+// Description: This file contains checks of what the quotas charge for
+//				queued mail whose texts are shared.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "common.h"
+#include "mailserver.h"
+
+// Queues and deletes mail through mailqueue.c, with mailbody.c and
+// mailquota.c behind it, and checks after each step that every byte
+// stored is charged once: the queue holds the envelope of each mail and
+// each distinct message and frame once, and the sender and the mailboxes
+// add up to the same. The rest of the server is stubbed out below; no
+// member is logged in, so queued mail stays queued.
+
+#define ENVELOPE(from, rcpt) \
+	envelopecost(from, "10.0.0.1", rcpt, "10.0.0.2")
+
+// Global Variables
+Config config;
+int failures = 0;
+
+// stubs for the parts of the server the queue calls into
+void adminunlinkmail(Mail *mail, int index) { }
+Peer *findroute(char *ip) { return (NULL); }
+void relaymail(Peer *peer, Mail *mail) { }
+size_t outpending(Member *memb) { return (0); }
+void pollattempt(Member *memb, uint64_t queued) { }
+int queuepkt(Member *memb, uint8_t typ, uint32_t len, char *buf) { return (1); }
+char *reservepkt(Member *memb, uint8_t typ, uint32_t len) { return (NULL); }
+void resumesessions(Member *conn) { }
+
+// reports a check which does not hold.
+static void check(int ok, const char *what, uint64_t got, uint64_t want) {
+	if (ok)
+		return;
+	printf("FAIL: %s: %llu, expected %llu\n", what, (unsigned long long) got,
+			(unsigned long long) want);
+	failures++;
+}
+
+// checks the charge of the queue, of the sender 10.0.0.1 and of the
+// mailbox of rcpt@10.0.0.2.
+static void expect(const char *step, uint64_t queue, uint64_t sender,
+		char *rcpt, uint64_t rcptbytes) {
+	Sender *s = findsender("10.0.0.1");
+	Mailbox *mbox = rcpt ? findmailbox(rcpt, "10.0.0.2") : NULL;
+
+	printf("%s\n", step);
+	check(queuebytes == queue, "queue bytes", queuebytes, queue);
+	check((s ? s->bytes : 0) == sender, "sender bytes", s ? s->bytes : 0, sender);
+	if (rcpt)
+		check((mbox ? mbox->bytes : 0) == rcptbytes, "mailbox bytes",
+				mbox ? mbox->bytes : 0, rcptbytes);
+}
+
+// queues a mail from from@10.0.0.1 to rcpt@10.0.0.2. checks that it is
+// charged what mailcost() said before it was queued, and returns its id.
+static uint64_t queue(char *from, char *rcpt, char *text) {
+	uint64_t before = queuebytes, cost, mailid;
+
+	cost = mailcost(from, "10.0.0.1", rcpt, "10.0.0.2", text);
+	mailid = addmailfrom(from, "10.0.0.1", "10.0.0.1", rcpt, "10.0.0.2",
+			text, 0, 0);
+	check(queuebytes - before == cost, "charge against mailcost()",
+			queuebytes - before, cost);
+	return (mailid);
+}
+
+int main(int argc, char *argv[]) {
+	char text[] = "the same notification for everyone";
+	char other[] = "a text of its own";
+	uint64_t len = strlen(text), frame, envb, envc, a, b, c, d;
+
+	config.maxsendermails = config.maxrcptmails = 1000;
+	config.maxsenderbytes = config.maxrcptbytes = config.maxqueuebytes = 1 << 20;
+
+	// "From: alice@10.0.0.1\n" and the text with its '\0'
+	frame = framesize("alice", "10.0.0.1", text);
+	check(frame == 21 + len + 1, "frame size", frame, 21 + len + 1);
+	envb = ENVELOPE("alice", "bob");
+	envc = ENVELOPE("alice", "carol");
+
+	// the first mail stores both texts and pays for them
+	a = queue("alice", "bob", text);
+	expect("a stored", envb + len + frame, envb + len + frame, "bob",
+			envb + len + frame);
+
+	// the second shares them and pays for its envelope only
+	b = queue("alice", "carol", text);
+	expect("b shared", envb + envc + len + frame, envb + envc + len + frame,
+			"carol", envc);
+
+	// a goes, and b takes over the texts it still keeps
+	deletemail(a);
+	expect("a gone", envc + len + frame, envc + len + frame, "carol",
+			envc + len + frame);
+	check(findmailbox("bob", "10.0.0.2") == NULL, "bob's mailbox released", 1, 0);
+
+	// another sender shares the message but not the frame
+	c = queue("dave", "bob", text);
+	expect("c shares the message", envc + len + frame +
+			ENVELOPE("dave", "bob") + framesize("dave", "10.0.0.1", text),
+			envc + len + frame + ENVELOPE("dave", "bob") +
+			framesize("dave", "10.0.0.1", text), "bob",
+			ENVELOPE("dave", "bob") + framesize("dave", "10.0.0.1", text));
+
+	// b goes, and c takes over the message only; alice's frame is freed
+	deletemail(b);
+	expect("b gone", ENVELOPE("dave", "bob") + len +
+			framesize("dave", "10.0.0.1", text),
+			ENVELOPE("dave", "bob") + len + framesize("dave", "10.0.0.1", text),
+			"bob", ENVELOPE("dave", "bob") + len +
+			framesize("dave", "10.0.0.1", text));
+
+	// a text of its own is charged in full
+	d = queue("alice", "carol", other);
+	deletemail(c);
+	expect("c gone", envc + strlen(other) + framesize("alice", "10.0.0.1", other),
+			envc + strlen(other) + framesize("alice", "10.0.0.1", other),
+			"carol", envc + strlen(other) + framesize("alice", "10.0.0.1", other));
+
+	// nothing is left charged once the queue is empty
+	deletemail(d);
+	expect("empty", 0, 0, NULL, 0);
+	check(queuemails == 0, "queued mails", queuemails, 0);
+	check(findsender("10.0.0.1") == NULL, "sender released", 1, 0);
+
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return (1);
+	}
+	printf("quota checks passed\n");
+	return (0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
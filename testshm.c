@@ -0,0 +1,196 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// File Name: testshm.c
+// Description: This file contains checks of the bounds of the shared
+//				memory rings.
+// Author: Santosh K Tadikonda, stadikon@gmu.edu
+// Date: Dec 1, 2013
+// Version: 1.0
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Include files
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "common.h"
+#include "mailshm.h"
+
+// Creates a transport as the server does and joins it as a client does,
+// in one process, then moves bytes and packets through the rings with
+// their head and tail about to wrap, fills a ring, and leaves a ring
+// inconsistent or sends an oversized packet as a hostile peer would. The
+// side reading such a ring must refuse it rather than copy out of bounds.
+
+// Global Variables
+int failures = 0;
+
+// reports a check which does not hold.
+static void check(int ok, const char *what, long long got, long long want) {
+	if (ok)
+		return;
+	printf("FAIL: %s: %lld, expected %lld\n", what, got, want);
+	failures++;
+}
+
+// joins the transport created by server as the client side.
+static Shm *join(Shm *server) {
+	int fds[3] = { dup(server->memfd), dup(server->notifyfd),
+			dup(server->peerfd) };
+	uint32_t size = htonl(SHM_RING_SIZE);
+	Shm *client;
+
+	client = shmjoin(-1, fds, 3, (char *) &size, sizeof(size));
+	if (!client) {
+		printf("FAIL: unable to join the transport\n");
+		exit(1);
+	}
+	return (client);
+}
+
+// returns the byte sent at offset off of a stream.
+static char pattern(uint64_t off) {
+	return ((char) (off * 131 + off / 251));
+}
+
+// sets the head and tail of a ring, as if that many bytes had been
+// written and read.
+static void setring(ShmRing *ring, uint64_t head, uint64_t tail) {
+	atomic_store(&ring->head, head);
+	atomic_store(&ring->tail, tail);
+}
+
+// writes the header of a packet of type typ and length lent into buf.
+static void header(char *buf, uint8_t typ, uint32_t lent) {
+	buf[0] = typ;
+	lent = htonl(lent);
+	memcpy(buf + 1, &lent, sizeof(lent));
+}
+
+int main(int argc, char *argv[]) {
+	static char out[SHM_RING_SIZE + 100], in[SHM_RING_SIZE + 100];
+	size_t sent, got, chunk;
+	ssize_t n;
+	Shm *server, *client;
+	Packet *pkt;
+	size_t i;
+
+	for (i = 0; i < sizeof(out); i++)
+		out[i] = pattern(i);
+
+	server = shmcreate();
+	if (!server) {
+		printf("FAIL: unable to create the transport\n");
+		return (1);
+	}
+	client = join(server);
+
+	// bytes come out as they went in, across the end of the ring and
+	// across the wrap of the 64-bit counters
+	printf("wraparound\n");
+	setring(client->tx, UINT64_MAX - 100, UINT64_MAX - 100);
+	sent = got = 0;
+	chunk = 7;
+	while (got < 3 * (size_t) SHM_RING_SIZE && !failures) {
+		for (i = 0; i < chunk; i++)
+			out[i] = pattern(sent + i);
+		n = shmwrite(client, out, chunk);
+		check(n >= 0, "bytes written", n, chunk);
+		if (n > 0)
+			sent += n;
+		n = shmread(server, in, chunk / 2 + 1);
+		check(n >= 0, "bytes read", n, chunk / 2 + 1);
+		for (i = 0; n > 0 && i < (size_t) n; i++)
+			if (in[i] != pattern(got + i)) {
+				check(0, "byte at stream offset", got + i, pattern(got + i));
+				break;
+			}
+		if (n > 0)
+			got += n;
+		chunk = chunk * 3 % 65521 + 1;
+	}
+	check(atomic_load(&client->tx->head) < (uint64_t) sent, "head wrapped",
+			atomic_load(&client->tx->head), sent);
+
+	// a full ring takes no more
+	printf("full ring\n");
+	setring(server->tx, UINT64_MAX - 5, UINT64_MAX - 5);
+	n = shmwrite(server, out, sizeof(out));
+	check(n == SHM_RING_SIZE, "bytes into an empty ring", n, SHM_RING_SIZE);
+	n = shmwrite(server, out, 1);
+	check(n == 0, "bytes into a full ring", n, 0);
+	n = shmread(client, in, sizeof(in));
+	check(n == SHM_RING_SIZE, "bytes out of a full ring", n, SHM_RING_SIZE);
+	check(memcmp(in, out, SHM_RING_SIZE) == 0, "bytes intact", 0, 0);
+	check(!client->broken && !server->broken, "transport intact", 1, 0);
+
+	// a packet split across the end of the ring arrives whole, and one
+	// of the largest length taken is accepted
+	printf("packets\n");
+	setring(server->tx, 3 * SHM_RING_SIZE - 3, 3 * SHM_RING_SIZE - 3);
+	header(in, 7, 1000);
+	memcpy(in + PKT_HEADER_LEN, out, 1000);
+	header(in + PKT_HEADER_LEN + 1000, 8, 4096);
+	memcpy(in + 2 * PKT_HEADER_LEN + 1000, out + 1000, 4096);
+	n = shmwrite(server, in, 2 * PKT_HEADER_LEN + 1000 + 4096);
+	check(n == 2 * PKT_HEADER_LEN + 1000 + 4096, "packet bytes written", n,
+			2 * PKT_HEADER_LEN + 1000 + 4096);
+	pkt = shmrecvpkt(client, 4096);
+	check(pkt && pkt->type == 7 && pkt->lent == 1000 &&
+			memcmp(pkt->text, out, 1000) == 0, "split packet", 0, 0);
+	if (pkt)
+		freepkt(pkt);
+	pkt = shmrecvpkt(client, 4096);
+	check(pkt && pkt->type == 8 && pkt->lent == 4096 &&
+			memcmp(pkt->text, out + 1000, 4096) == 0, "largest packet", 0, 0);
+	if (pkt)
+		freepkt(pkt);
+	check(shmrecvpkt(client, 4096) == NULL && !client->broken,
+			"no packet pending", client->broken, 0);
+
+	// a packet longer than the reader takes breaks the transport
+	printf("oversized packet\n");
+	header(in, 7, 4097);
+	shmwrite(server, in, PKT_HEADER_LEN);
+	check(shmrecvpkt(client, 4096) == NULL, "oversized packet refused", 1, 0);
+	check(client->broken, "transport broken", client->broken, 1);
+	shmclose(client);
+	shmclose(server);
+
+	// a tail moved past the head, or a head too far ahead of the tail,
+	// breaks the transport instead of copying out of bounds
+	printf("inconsistent rings\n");
+	server = shmcreate();
+	if (!server) {
+		printf("FAIL: unable to create the transport\n");
+		return (1);
+	}
+	client = join(server);
+	setring(client->tx, 100, 105);
+	n = shmwrite(client, out, 10);
+	check(n == -1 && client->broken, "write with tail past head", n, -1);
+	setring(server->tx, SHM_RING_SIZE + 6, 5);
+	n = shmread(client, in, 10);
+	check(n == -1, "read with head too far ahead", n, -1);
+	setring(server->rx, 5, 10);
+	n = shmread(server, in, 10);
+	check(n == -1 && server->broken, "read with head behind tail", n, -1);
+	shmclose(client);
+	shmclose(server);
+
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return (1);
+	}
+	printf("shared memory checks passed\n");
+	return (0);
+}
+
+///////////////////////////////////////////////////////////////////////////////